@@ -3,16 +3,102 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/select.h> // fd_set/select: no se exponen con -std=c99 sin este include
+#include <sys/time.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #define MAX_BUFFER_SIZE 4096
+#define CABECERA_RESPUESTA 5 // estado (1 byte) y largo (4 bytes, big-endian)
+#define ESTADO_PARCIAL 3 // la respuesta sigue en la trama siguiente (SELECT por trozos)
+#define MAX_LOTE (64 * 1024) // el servidor no acepta pedidos más largos
 
 static int g_sock = -1;
 
+// Respuestas recibidas todavía sin mostrar (con tramas, una puede llegar en varios read)
+static char *recibido = NULL;
+static size_t recibido_len = 0, recibido_cap = 0;
+static int respuesta_en_curso = 0; // la última trama fue PARCIAL
+
+// BATCH en curso: sus líneas se juntan hasta END y se envían como un solo pedido
+// (con tramas, cada línea escrita sería un pedido aparte)
+static char *lote = NULL;
+static size_t lote_len = 0, lote_cap = 0;
+static int en_lote = 0;
+
+static int recibido_agregar(const char *datos, size_t n) {
+    if (recibido_len + n > recibido_cap) {
+        size_t nueva = recibido_cap ? recibido_cap : MAX_BUFFER_SIZE;
+        while (nueva < recibido_len + n) nueva *= 2;
+        char *nb = (char *)realloc(recibido, nueva);
+        if (!nb) return 0;
+        recibido = nb;
+        recibido_cap = nueva;
+    }
+    memcpy(recibido + recibido_len, datos, n);
+    recibido_len += n;
+    return 1;
+}
+
+// Agrega una línea (y su '\n') al BATCH en curso; 0 si el lote supera MAX_LOTE
+static int lote_agregar(const char *linea) {
+    size_t n = strlen(linea);
+    if (lote_len + n + 1 > MAX_LOTE) return 0;
+    if (lote_len + n + 1 > lote_cap) {
+        size_t nueva = lote_cap ? lote_cap : MAX_BUFFER_SIZE;
+        while (nueva < lote_len + n + 1) nueva *= 2;
+        char *nb = (char *)realloc(lote, nueva);
+        if (!nb) return 0;
+        lote = nb;
+        lote_cap = nueva;
+    }
+    memcpy(lote + lote_len, linea, n);
+    lote_len += n;
+    lote[lote_len++] = '\n';
+    return 1;
+}
+
+// Línea igual a 'palabra', sin contar espacios alrededor (como la compara el servidor)
+static int linea_es(const char *linea, const char *palabra) {
+    while (*linea == ' ' || *linea == '\t') linea++;
+    size_t largo = strlen(palabra);
+    if (strncmp(linea, palabra, largo) != 0) return 0;
+    for (linea += largo; *linea; linea++) {
+        if (*linea != ' ' && *linea != '\t' && *linea != '\r') return 0;
+    }
+    return 1;
+}
+
+// Muestra las respuestas completas que haya en el buffer y deja el resto para el próximo read
+static void mostrar_tramas(void) {
+    size_t usado = 0;
+    while (recibido_len - usado >= CABECERA_RESPUESTA) {
+        const uint8_t *b = (const uint8_t *)recibido + usado;
+        size_t largo = ((size_t)b[1] << 24) | ((size_t)b[2] << 16) | ((size_t)b[3] << 8) | b[4];
+        if (recibido_len - usado < CABECERA_RESPUESTA + largo) break;
+        if (largo > 0) {
+            if (!respuesta_en_curso) printf("<< ");
+            fwrite(recibido + usado + CABECERA_RESPUESTA, 1, largo, stdout);
+            fflush(stdout);
+        }
+        respuesta_en_curso = (b[0] == ESTADO_PARCIAL);
+        usado += CABECERA_RESPUESTA + largo;
+    }
+    recibido_len -= usado;
+    memmove(recibido, recibido + usado, recibido_len);
+}
+
+// Envía un comando como trama: largo (4 bytes, big-endian) y el texto, sin fin de línea
+static int enviar_trama(int sock, const char *comando, size_t largo) {
+    uint8_t cabecera[4] = { (uint8_t)(largo >> 24), (uint8_t)(largo >> 16), (uint8_t)(largo >> 8), (uint8_t)largo };
+    if (send(sock, cabecera, sizeof(cabecera), 0) < 0) return -1;
+    return largo > 0 ? (int)send(sock, comando, largo, 0) : 0;
+}
+
 void mostrar_ayuda_cliente(void) {
     printf("\n=== AYUDA - CLIENTE MICRO DB ===\n");
     printf("\nUSO:\n");
@@ -149,10 +235,41 @@ int main(int argc, char const *argv[]) {
     printf("Conectado a %s:%d (Socket %d).\n", ip, puerto, sock);
     printf("Escriba 'HELP' o 'EXIT' para terminar.\n");
 
-    // Leer mensaje inicial de bienvenida del servidor (si lo hay)
-    memset(buffer, 0, MAX_BUFFER_SIZE);
-    int initread = read(sock, buffer, MAX_BUFFER_SIZE);
-    if (initread > 0) {
+    // Pedir el protocolo con tramas: el largo delimita cada respuesta, así una respuesta
+    // partida en varios read (o varias juntas en uno) se muestra completa y en orden.
+    // Las dos primeras líneas (bienvenida y confirmación) todavía llegan como texto.
+    int tramas = 0;
+    const char *pedido = "PROTOCOL FRAMED\n";
+    if (send(sock, pedido, strlen(pedido), 0) < 0) {
+        perror("Error al enviar datos");
+        close(sock);
+        return 1;
+    }
+    size_t inicial = 0;
+    int lineas = 0;
+    while (lineas < 2 && inicial < MAX_BUFFER_SIZE - 1) {
+        int n = read(sock, buffer + inicial, MAX_BUFFER_SIZE - 1 - inicial);
+        if (n <= 0) break;
+        for (int i = 0; i < n; i++) {
+            if (buffer[inicial + i] == '\n') lineas++;
+        }
+        inicial += (size_t)n;
+    }
+    buffer[inicial] = '\0';
+    char *confirmacion = strchr(buffer, '\n');
+    if (confirmacion) {
+        *confirmacion++ = '\0';
+        printf("<< %s\n", buffer); // bienvenida
+        tramas = (strncmp(confirmacion, "OK", 2) == 0);
+        char *resto = strchr(confirmacion, '\n');
+        if (!tramas) {
+            printf("<< %s", confirmacion); // servidor sin tramas: se sigue en modo texto
+        } else if (resto && !recibido_agregar(resto + 1, inicial - (size_t)(resto + 1 - buffer))) {
+            fprintf(stderr, "Memoria insuficiente\n");
+            close(sock);
+            return 1;
+        }
+    } else if (inicial > 0) {
         printf("<< %s", buffer);
     }
 
@@ -177,6 +294,14 @@ int main(int argc, char const *argv[]) {
                 printf("\n[INFO] El servidor cerró la conexión. Saliendo automáticamente.\n");
                 break;
             }
+            if (tramas) {
+                if (!recibido_agregar(buffer, (size_t)chunk_size)) {
+                    fprintf(stderr, "Memoria insuficiente\n");
+                    break;
+                }
+                mostrar_tramas();
+                continue;
+            }
             buffer[chunk_size] = '\0';
             if (strstr(buffer, "---END---") != NULL) {
                 char *end_marker = strstr(buffer, "---END---");
@@ -194,24 +319,55 @@ int main(int argc, char const *argv[]) {
                 break;
             }
             command[strcspn(command, "\n")] = 0;
+            if (!en_lote && linea_es(command, "BATCH")) {
+                en_lote = 1;
+                lote_len = 0;
+            }
+            if (en_lote) {
+                // Hasta END no se envía nada: el lote entero viaja como un pedido
+                int fin_lote = linea_es(command, "END");
+                if (en_lote == 1 && !lote_agregar(command)) {
+                    printf("ERROR: El BATCH supera los %d bytes; se descarta hasta END.\n", MAX_LOTE);
+                    en_lote = 2;
+                }
+                if (!fin_lote) continue;
+                int descartado = (en_lote == 2);
+                en_lote = 0;
+                if (descartado) continue;
+                size_t largo = tramas ? lote_len - 1 : lote_len; // con tramas, sin el '\n' final
+                if ((tramas ? enviar_trama(sock, lote, largo) : (int)send(sock, lote, largo, 0)) < 0) {
+                    perror("Error al enviar datos");
+                    break;
+                }
+                continue;
+            }
             if (strlen(command) == 0) continue;
             if (strncmp(command, "HELP", 4) == 0) {
                 printf("\nComandos disponibles:\n");
-                printf("  BEGIN TRANSACTION: Inicia una transacción exclusiva.\n    Ejemplo: BEGIN TRANSACTION\n");
+                printf("  BEGIN TRANSACTION [WAIT ms]: Inicia una transacción (bloquea sólo las filas que modifica).\n    Ejemplo: BEGIN TRANSACTION WAIT 500\n");
                 printf("  COMMIT TRANSACTION: Finaliza y confirma la transacción.\n    Ejemplo: COMMIT TRANSACTION\n");
+                printf("  ROLLBACK: Descarta los cambios de la transacción.\n    Ejemplo: ROLLBACK\n");
                 printf("  SELECT ALL: Muestra todos los registros.\n    Ejemplo: SELECT ALL\n");
                 printf("  SELECT WHERE CAMPO=VALOR: Filtra registros por campo.\n    Ejemplo: SELECT WHERE Producto=Tablet\n");
-                printf("  INSERT id;producto;cantidad;precio: Inserta un nuevo registro.\n    Ejemplo: INSERT 100;Router;5;199.99\n");
+                printf("  ... ORDER BY Campo [ASC|DESC] LIMIT n OFFSET m: Ordena y pagina el resultado.\n    Ejemplo: SELECT ALL ORDER BY Precio DESC LIMIT 10\n");
+                printf("  DECLARE c CURSOR FOR SELECT ... / FETCH [n] FROM c / CLOSE c: Recorre el resultado de a n filas.\n    Ejemplo: FETCH 100 FROM c\n");
+                printf("  PREPARE s AS <sentencia con ?> / EXECUTE s(v1, ...) / DEALLOCATE s: Sentencia parseada una sola vez.\n    Ejemplo: PREPARE s AS SELECT WHERE Cantidad > ?   y luego   EXECUTE s(50)\n");
+                printf("  INSERT id;producto;cantidad;precio[, ...]: Inserta uno o varios registros.\n    Ejemplo: INSERT 100;Router;5;199.99, 101;Switch;2;89.90\n");
                 printf("  UPDATE ID=<id> SET Campo=Valor: Modifica un campo de un registro.\n    Ejemplo: UPDATE ID=10 SET Precio=15.50\n");
                 printf("  DELETE ID=<id>: Elimina un registro por ID.\n    Ejemplo: DELETE ID=10\n");
+                printf("  BATCH / sentencias / END: INSERT, UPDATE y DELETE en un solo pedido, uno por linea; todo o nada.\n    Ejemplo: BATCH   INSERT 200;Mouse;3;9.99   UPDATE ID=10 SET Cantidad=4   END (cada uno en su linea)\n");
                 printf("  EXIT: Desconecta y cierra el cliente.\n    Ejemplo: EXIT\n");
                 continue;
             }
+            // Con tramas el largo va delante; en modo texto cada comando termina en '\n'
+            size_t largo = strlen(command);
+            if (!tramas) command[largo++] = '\n';
             if (strncmp(command, "EXIT", 4) == 0) {
-                send(sock, command, strlen(command), 0);
+                if (tramas) enviar_trama(sock, command, largo);
+                else send(sock, command, largo, 0);
                 break;
             }
-            if (send(sock, command, strlen(command), 0) < 0) {
+            if ((tramas ? enviar_trama(sock, command, largo) : (int)send(sock, command, largo, 0)) < 0) {
                 perror("Error al enviar datos");
                 break;
             }
@@ -220,6 +376,8 @@ int main(int argc, char const *argv[]) {
 
     close(sock);
     g_sock = -1;
+    free(recibido);
+    free(lote);
     printf("Desconectado.\n");
     return 0;
 }
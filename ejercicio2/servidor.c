@@ -1,486 +1,5375 @@
+#define _GNU_SOURCE // pthread_rwlock_t, usleep, strnlen, pread y ftruncate con -std=c99
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // Para strcasecmp
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/uio.h> // writev
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
-#include <sys/file.h> // Para la función 'flock'
 #include <signal.h>
 #include <sys/wait.h>
 #include <math.h>
 #include <time.h> // Para usleep y clock_gettime
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stddef.h> // offsetof
+#include <limits.h> // LONG_MAX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h> // RLIMIT_NOFILE
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <poll.h>
+#include <sched.h> // afinidad de los reactores
+#if defined(__AVX2__)
+#include <immintrin.h> // parser CSV: AVX2 si se compila con -mavx2 / -march=native
+#elif defined(__SSE2__)
+#include <emmintrin.h> // SSE2 es la base en x86-64
+#endif
 
 // --- Constantes y Configuración
 #define MAX_COMMAND_LENGTH 512
-#define CSV_FILE_NAME "registros_generados.csv"
-#define BACKLOG_QUEUE 5 // M clientes en espera (Requisito 1: M)
-#define MAX_CLIENTS 5 // N clientes concurrentes (Requisito 1: N)
+#define CSV_FILE_NAME "registros_generados.csv" // formato de intercambio (IMPORT/EXPORT CSV)
+#define DB_FILE_NAME "registros_generados.mdb" // archivo base paginado
+#define WAL_FILE_NAME "registros_generados.wal"
+#define WAL_OLD_FILE_NAME "registros_generados.wal.old" // WAL rotado mientras dura una compactación
+#define WAL_CHECKPOINT_BYTES (1024 * 1024) // Umbral por defecto del WAL (MICRODB_WAL_MAX_BYTES)
+#define BACKLOG_QUEUE 128 // M clientes en espera (Requisito 1: M)
+#define MAX_CLIENTS 16384 // N clientes concurrentes (Requisito 1: N); no hay un hilo por cliente
+#define MAX_HILOS_RED 64 // reactores epoll (MICRODB_HILOS_RED, por defecto los núcleos en línea)
+#define MAX_HILOS_TRABAJO 64 // pool que ejecuta los comandos (MICRODB_HILOS_TRABAJO, por defecto los núcleos en línea)
+#define MIN_HILOS_TRABAJO 2  // uno puede esperar un lock mientras otro ejecuta el COMMIT que lo libera
+#define MAX_EVENTOS_EPOLL 256
+#define MAX_ACEPTAR_POR_EVENTO 64
+#define MAX_CONEXIONES_LIBRES 1024 // structs de conexión reciclados por reactor
+#define MAX_ENTRADA_CONEXION (64 * 1024) // comando más largo aceptado, con su fin de línea
+#define LIMITE_SALIDA_PENDIENTE (1024 * 1024) // con más salida sin enviar se dejan de ejecutar comandos
+#define BUFFER_RETENIDO 4096 // buffers de salida más grandes se liberan al vaciarse
+#define TAM_TROZO_FLUJO (64 * 1024) // SELECT por trozos: bytes por trozo y salida pendiente para pedir el siguiente
+#define MIN_LIMITE_FLUJO 1000 // con LIMIT menor la respuesta se arma de una vez
+#define MAX_CURSORES 16 // cursores abiertos por conexión (DECLARE)
+#define MAX_FILAS_FETCH 10000 // filas por FETCH (el mensaje de error lo repite)
+#define MAX_PREPARADAS 32 // sentencias preparadas por conexión (PREPARE)
+#define MAX_PARAMETROS 8 // '?' por sentencia preparada
 #define DEFAULT_PORT 8080
+#define CSV_HEADER "ID;Producto;Cantidad;Precio\n"
+#define MAX_TOPK_HEAP 100000 // LIMIT+OFFSET máximo atendido con heap acotado; más allá se ordena todo
+#define MAX_ECO_COMANDO 256 // bytes del comando desconocido que se repiten en el error
+#define TRACE_FILE_NAME "traza.json" // TRACE DUMP sin nombre de archivo
+
+// Protocolo con tramas (PROTOCOL FRAMED). Pedido: largo del comando (4 bytes, big-endian)
+// y el comando, sin fin de línea. Respuesta: estado (1 byte), largo (4 bytes, big-endian) y el texto.
+#define CABECERA_PEDIDO 4
+#define CABECERA_RESPUESTA 5
+// AVISO: mensaje que no responde a un pedido. PARCIAL: trozo de una respuesta que sigue en la trama siguiente.
+enum { ESTADO_OK = 0, ESTADO_ERROR = 1, ESTADO_AVISO = 2, ESTADO_PARCIAL = 3 };
 
 // --- Variables Globales de Estado
-volatile int clientes_activos = 0;
-#define MAX_TOTAL_CLIENTES 1024
-static int sockets_clientes[MAX_TOTAL_CLIENTES];
-static pthread_mutex_t mutex_sockets_clientes = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t mutex_clientes;
-int archivo_bloqueado = 0; // Estado: 1 si hay una transacción activa
-int bloqueado_por_socket = -1; // Socket del cliente que tiene el lock
-pthread_mutex_t mutex_estado_bloqueo; // Mutex para proteger archivo_bloqueado y bloqueado_por_socket
-int descriptor_archivo_bloqueado = -1; // Descriptor del archivo bloqueado durante la transacción
-static int socket_servidor_global = -1; // socket de escucha global para cierre seguro
-static volatile int siguiente_id_usuario = 1;
-pthread_cond_t condicion_clientes; // Señaliza disponibilidad de slots de cliente
+static int clientes_activos = 0; // se actualiza con __atomic desde el aceptador y los reactores
+static int siguiente_id_usuario = 1; // se incrementa con __atomic desde los reactores
+static int max_clientes_config = MAX_CLIENTS; // N
+static int evento_terminar = -1; // eventfd: el handler de señales despierta a todos los epoll_wait
 
 /* Bandera de terminación segura desde el handler de señales */
 static volatile sig_atomic_t stop_requested = 0;
 
+// Respuesta en armado o pendiente de envío (desde "enviado")
+typedef struct {
+    char *datos;
+    size_t len, cap, enviado;
+    int sin_memoria;
+} Salida;
+
+struct Reactor;
+struct Conexion;
+typedef struct Escrituras Escrituras; // cambios sin confirmar de una transacción
+typedef struct Transaccion Transaccion;
+typedef struct Flujo Flujo; // SELECT que se envía por trozos
+typedef struct Cursor Cursor; // DECLARE ... CURSOR FOR SELECT
+typedef struct Preparada Preparada; // PREPARE nombre AS ...
+
+// Comando que un reactor delega en el pool de trabajadores. Cada conexión tiene a lo
+// sumo uno en curso, así que la tarea va dentro de la conexión y no se pide memoria.
+typedef struct Tarea {
+    struct Tarea *siguiente;
+    struct Conexion *conexion;
+    char *comando;   // dentro de la entrada de la conexión, que no se toca hasta que vuelve
+    size_t consumido; // bytes de la entrada que ocupa el pedido
+} Tarea;
+
+// Estado de una conexión. Después de registrarla en epoll sólo la toca su reactor,
+// salvo mientras un trabajador ejecuta su comando (en_curso).
+typedef struct Conexion {
+    int socket;
+    int id_usuario;
+    struct sockaddr_in direccion;
+    struct Reactor *reactor;
+    int transaccion_activa;
+    Transaccion *transaccion; // la transacción abierta (locks y cambios sin confirmar)
+    int en_curso;    // hay un comando en un trabajador: no se ejecuta otro hasta que vuelva
+    int cerrar;      // EXIT, EOF o error: cerrar al terminar de enviar la salida
+    int puede_leer;  // epoll es edge-triggered: hay que leer hasta EAGAIN antes de esperar otro aviso
+    int fin_lectura; // el cliente cerró su lado de la conexión
+    int tramas;      // PROTOCOL FRAMED: pedidos y respuestas con prefijo de largo
+    int saltando_lote; // BATCH demasiado largo: se descartan sus líneas hasta END
+    int hay_pisado;  // con tramas, el '\0' del comando actual pisó el primer byte del pedido siguiente
+    char pisado;
+    Flujo *flujo;    // SELECT a medio enviar: hasta que termine no se ejecutan otros comandos
+    Cursor *cursores; // abiertos con DECLARE
+    int num_cursores;
+    Preparada *preparadas; // PREPARE: planes ya parseados, hasta DEALLOCATE o el cierre
+    int num_preparadas;
+    char *entrada;   // bytes recibidos todavía sin procesar (NULL mientras esté vacía)
+    size_t entrada_len, entrada_cap;
+    Salida salida;
+    Salida respuesta; // respuesta del comando en curso: se reinicia después de cada pedido, sin liberarla
+    Tarea tarea;
+    int comando_tipo; // TipoComando del que está en un trabajador y cuándo se separó (métricas)
+    uint64_t comando_inicio_ns;
+    struct Conexion *anterior, *siguiente; // lista de conexiones del reactor (cierre del servidor)
+} Conexion;
+
+
+typedef struct Reactor {
+    int id;
+    int epoll_fd;
+    pthread_t hilo;
+    int socket_escucha;           // propio con SO_REUSEPORT; compartido si el sistema no lo soporta
+    Conexion *conexiones;
+    Conexion *libres;             // structs de conexiones cerradas, para no pedir memoria en cada accept
+    int num_libres;
+    int evento_hechas;            // eventfd: un trabajador dejó una tarea terminada
+    pthread_mutex_t mutex_hechas;
+    Tarea *hechas;
+    long long proxima_revision;   // ms (CLOCK_MONOTONIC) de la próxima revisión de transacciones vencidas
+} Reactor;
+
 // --- Prototipos
-void *handle_client(void *arg);
-int try_acquire_lock(int socket_cliente);
-void release_lock(int socket_cliente);
+static void procesar_comando(Conexion *c, char *command, Salida *out);
 void load_config(char *ip, int *puerto, int *max_clientes, int *backlog);
-char *execute_query(const char *command, int *is_success);
-char *perform_modification(const char *command, int *is_success);
-char *mostrar_ayuda_detallada(void);
-static char *read_entire_file(const char *path);
+int execute_query(const char *command, Transaccion *tx, Salida *out, Flujo **flujo);
+int perform_modification(const char *command, Transaccion *tx, Salida *out);
+static char *ejecutar_lote(const char *command, Transaccion *tx, size_t *sentencias, size_t conteo[3]);
+char *import_csv(const char *command, int *is_success);
+char *export_csv(const char *command, int *is_success);
+const char *mostrar_ayuda_detallada(void);
+static int es_select_all_simple(const char *command);
+static int flujo_continuar(Flujo *f, Salida *out, int con_tramas);
+static void flujo_liberar(Flujo *f);
+static void cursores_cerrar(Conexion *c);
+static void comando_cursor(Conexion *c, const char *command, Salida *out);
+static void preparadas_liberar(Conexion *c);
+static void comando_preparada(Conexion *c, const char *command, Salida *out);
+static Escrituras *escrituras_nueva(void);
+static void escrituras_liberar(Escrituras *e);
+static size_t escrituras_cantidad(const Escrituras *e);
+static const char *confirmar_transaccion(Escrituras *e, int *is_success);
+static char *error_dup(const char *msg);
+static int cargar_base_de_datos(void);
+static void cerrar_base_de_datos(void);
+static int ejecutar_compactacion(int forzar);
+static char *compactacion_reporte(void);
+static void load_config_cache(void);
+static void cache_reporte(Salida *out);
+static void metricas_reporte(Salida *out);
+static int iniciar_metricas(int puerto);
+static void detener_metricas(void);
+static void comando_traza(const char *command, Salida *out);
+static void grupo_estadisticas(long *fsyncs, long *commits);
+static long config_entero_env(const char *nombre, long por_defecto, long minimo);
+static int bench_csv(const char *path, int repeticiones);
 static void cleanup_resources(void);
 static void handle_termination_signal(int signum);
 
-// Estructura para pasar argumentos al hilo
+// --- Métricas (STATS y puerto de métricas)
+/*
+ * Contadores para encontrar los puntos calientes bajo carga real sin un profiler:
+ * cantidad, errores y latencia por tipo de comando, bytes recibidos y enviados,
+ * conexiones y espera y tenencia de locks. Se leen con STATS o, en el formato de
+ * texto de Prometheus, en el puerto MICRODB_PUERTO_METRICAS (sólo en 127.0.0.1).
+ *
+ * La latencia de un comando va desde que el reactor lo separa de la entrada hasta que
+ * tiene su respuesta: incluye la espera en la cola del pool y, en un SELECT por trozos,
+ * llega hasta el primer trozo. Los tiempos van a histogramas logarítmicos con 8
+ * divisiones por potencia de 2 (error menor al 12,5%), de los que salen p50/p99/p999.
+ * Todo se actualiza con __atomic relajado: un reporte puede mezclar valores de
+ * instantes apenas distintos.
+ */
+
+#define DIVISIONES_HISTOGRAMA 8 // por potencia de 2
+#define BUCKETS_HISTOGRAMA (40 * DIVISIONES_HISTOGRAMA) // hasta 2^40 ns (~18 minutos)
+
 typedef struct {
-    int socket;
-    struct sockaddr_in direccion;
-    int id_usuario;
-} info_cliente;
+    uint64_t buckets[BUCKETS_HISTOGRAMA];
+    uint64_t cantidad, suma_ns, max_ns;
+} Histograma;
 
-// --- Funciones de Bloqueo (Transacciones)
+typedef enum {
+    CMD_SELECT, CMD_INSERT, CMD_UPDATE, CMD_DELETE, CMD_BATCH, CMD_BEGIN, CMD_COMMIT, CMD_ROLLBACK,
+    CMD_IMPORT, CMD_EXPORT, CMD_DECLARE, CMD_FETCH, CMD_CLOSE, CMD_PREPARE, CMD_EXECUTE, CMD_DEALLOCATE,
+    CMD_CHECKPOINT, CMD_SHOW, CMD_STATS, CMD_TRACE, CMD_PROTOCOL, CMD_HELP, CMD_EXIT, CMD_OTRO, NUM_TIPOS_COMANDO
+} TipoComando;
 
-int try_acquire_lock(int socket_cliente) {
-    int result = 0;
-
-    // Abrimos el archivo en modo lectura/escritura
-    int fd = open(CSV_FILE_NAME, O_RDWR);
-    if (fd < 0) return -1; // Error de archivo
-
-    // Intentamos un bloqueo exclusivo (LOCK_EX) sin esperar (LOCK_NB)
-    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
-        // Bloqueo exitoso
-        pthread_mutex_lock(&mutex_estado_bloqueo);
-        archivo_bloqueado = 1;
-        bloqueado_por_socket = socket_cliente;
-        descriptor_archivo_bloqueado = fd; // mantener descriptor abierto para sostener el lock
-        pthread_mutex_unlock(&mutex_estado_bloqueo);
-        result = 1; // éxito
-    } else {
-        // Bloqueo fallido (ya bloqueado por otro)
-        result = 0; // Fallo
-        close(fd);
+// Mismo orden que TipoComando; el nombre es la etiqueta en los reportes
+static const char *const prefijos_comando[NUM_TIPOS_COMANDO] = {
+    "SELECT", "INSERT", "UPDATE", "DELETE", "BATCH", "BEGIN", "COMMIT", "ROLLBACK",
+    "IMPORT", "EXPORT", "DECLARE", "FETCH", "CLOSE", "PREPARE", "EXECUTE", "DEALLOCATE",
+    "CHECKPOINT", "SHOW", "STATS", "TRACE", "PROTOCOL", "HELP", "EXIT", "" };
+static const char *const nombres_comando[NUM_TIPOS_COMANDO] = {
+    "select", "insert", "update", "delete", "batch", "begin", "commit", "rollback",
+    "import", "export", "declare", "fetch", "close", "prepare", "execute", "deallocate",
+    "checkpoint", "show", "stats", "trace", "protocol", "help", "exit", "otro" };
+
+static struct {
+    Histograma comandos[NUM_TIPOS_COMANDO];
+    uint64_t errores[NUM_TIPOS_COMANDO];
+    Histograma espera_lock;   // sólo los pedidos que tuvieron que encolarse
+    Histograma tenencia_lock; // del primer lock de una transacción hasta que los suelta
+    uint64_t conflictos_lock, vencidos_lock; // abortadas por wait-die / plazo de espera agotado
+    uint64_t bytes_recibidos, bytes_enviados;
+    uint64_t conexiones_aceptadas, conexiones_rechazadas;
+    uint64_t inicio_ns;
+} metricas;
+
+static uint64_t reloj_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec;
+}
+
+static void metricas_sumar(uint64_t *contador, uint64_t n) {
+    __atomic_add_fetch(contador, n, __ATOMIC_RELAXED);
+}
+
+// Los primeros 8 buckets son de 1 ns; después cada potencia de 2 se divide en 8
+static size_t histograma_bucket(uint64_t ns) {
+    if (ns < DIVISIONES_HISTOGRAMA) return (size_t)ns;
+    int e = 63 - __builtin_clzll(ns);
+    size_t b = (size_t)(e - 2) * DIVISIONES_HISTOGRAMA + (size_t)((ns >> (e - 3)) & (DIVISIONES_HISTOGRAMA - 1));
+    return b < BUCKETS_HISTOGRAMA ? b : BUCKETS_HISTOGRAMA - 1;
+}
+
+// Punto medio del bucket, el valor que se informa para los que cayeron en él
+static uint64_t histograma_valor(size_t b) {
+    if (b < DIVISIONES_HISTOGRAMA) return b;
+    int e = (int)(b / DIVISIONES_HISTOGRAMA) + 2;
+    uint64_t ancho = 1ull << (e - 3);
+    return (uint64_t)(DIVISIONES_HISTOGRAMA + b % DIVISIONES_HISTOGRAMA) * ancho + ancho / 2;
+}
+
+static void histograma_registrar(Histograma *h, uint64_t ns) {
+    metricas_sumar(&h->buckets[histograma_bucket(ns)], 1);
+    metricas_sumar(&h->cantidad, 1);
+    metricas_sumar(&h->suma_ns, ns);
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
-    return result;
 }
 
-void release_lock(int socket_cliente) {
-    pthread_mutex_lock(&mutex_estado_bloqueo);
-    if (archivo_bloqueado && bloqueado_por_socket == socket_cliente) {
-        printf("[SERVIDOR] Liberando lock exclusivo del socket %d...\n", socket_cliente);
-        // Liberar el bloqueo sobre el descriptor sostenido
-        if (descriptor_archivo_bloqueado >= 0) {
-            flock(descriptor_archivo_bloqueado, LOCK_UN);
-            close(descriptor_archivo_bloqueado);
-            descriptor_archivo_bloqueado = -1;
+// Valor por debajo del cual queda la fracción 'p' de las muestras (0 sin muestras)
+static uint64_t histograma_percentil(const Histograma *h, double p) {
+    uint64_t total = 0;
+    for (size_t b = 0; b < BUCKETS_HISTOGRAMA; b++) total += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    if (total == 0) return 0;
+    uint64_t objetivo = (uint64_t)ceil(p * (double)total), acumulado = 0;
+    if (objetivo == 0) objetivo = 1;
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    for (size_t b = 0; b < BUCKETS_HISTOGRAMA; b++) {
+        acumulado += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if (acumulado >= objetivo) {
+            uint64_t v = histograma_valor(b);
+            return v < max ? v : max;
         }
-        archivo_bloqueado = 0;
-        bloqueado_por_socket = -1;
-        printf("[SERVIDOR] Lock liberado exitosamente. Archivo disponible para otros clientes.\n");
-    } else {
-        printf("[SERVIDOR] No hay lock activo para el socket %d.\n", socket_cliente);
     }
-    pthread_mutex_unlock(&mutex_estado_bloqueo);
+    return max;
+}
+
+static TipoComando tipo_comando(const char *command) {
+    for (int i = 0; i < CMD_OTRO; i++) {
+        if (strncmp(command, prefijos_comando[i], strlen(prefijos_comando[i])) == 0) return (TipoComando)i;
+    }
+    return CMD_OTRO;
 }
 
-// --- Manejo de Cliente Concurrente
+// Un comando terminó: 'inicio' es cuando el reactor lo separó de la entrada
+static void metricas_comando(int tipo, uint64_t inicio, const Salida *respuesta) {
+    histograma_registrar(&metricas.comandos[tipo], reloj_ns() - inicio);
+    if (respuesta->len >= 5 && memcmp(respuesta->datos, "ERROR", 5) == 0) metricas_sumar(&metricas.errores[tipo], 1);
+}
 
-void *handle_client(void *arg) {
-    info_cliente *info = (info_cliente *)arg;
-    int socket_cliente = info->socket;
-    char buffer[MAX_COMMAND_LENGTH] = {0};
-    int transaccion_activa = 0;
+// --- Trazas (TRACE ON / OFF / DUMP)
+/*
+ * Para ver en qué se fue el tiempo de un pedido lento (espera de locks, lectura de
+ * archivos, parseo, envío) las fases de los comandos se marcan como intervalos. Cada
+ * hilo los guarda en su propio anillo de EVENTOS_TRAZA_POR_HILO, sin locks: lleno, pisa
+ * los más viejos. TRACE DUMP los vuelca en el formato JSON de Chrome (chrome://tracing,
+ * ui.perfetto.dev), con un carril por hilo.
+ *
+ * Apagadas (por defecto; las prenden TRACE ON o MICRODB_TRAZA=1) cada intervalo cuesta
+ * una lectura atómica. Cada evento tiene un número de secuencia que el dueño pone en 0
+ * antes de escribirlo y en su posición + 1 al terminar: TRACE DUMP copia los anillos
+ * mientras se escriben y descarta los eventos que cambiaron durante la copia. Un anillo
+ * se pide la primera vez que su hilo registra algo y no se libera, así que sólo
+ * registran los hilos fijos (E/S, trabajadores, compactación).
+ */
 
+#define EVENTOS_TRAZA_POR_HILO 8192 // potencia de 2
+#define MAX_ANILLOS_TRAZA (MAX_HILOS_RED + MAX_HILOS_TRABAJO + 8)
 
-    printf("[THREAD %lu] Cliente conectado desde %s:%d\n",
-           pthread_self(), inet_ntoa(info->direccion.sin_addr), ntohs(info->direccion.sin_port));
+typedef struct {
+    uint64_t secuencia;  // posición + 1 una vez escrito; 0 mientras se escribe
+    const char *nombre;  // texto constante
+    uint64_t inicio_ns, fin_ns;
+    long dato;           // socket, ID de fila, etc.; -1 = ninguno
+} EventoTraza;
 
-    // Registrar socket en la lista global
-    pthread_mutex_lock(&mutex_sockets_clientes);
-    for (int i = 0; i < MAX_TOTAL_CLIENTES; ++i) {
-        if (sockets_clientes[i] == 0) {
-            sockets_clientes[i] = socket_cliente;
-            break;
-        }
-    }
-    pthread_mutex_unlock(&mutex_sockets_clientes);
+typedef struct {
+    int tid;             // carril en el JSON
+    char hilo[24];
+    uint64_t escritos;   // sólo lo usa el hilo dueño
+    EventoTraza eventos[EVENTOS_TRAZA_POR_HILO];
+} AnilloTraza;
 
-    // Enviar bienvenida con el identificador de usuario asignado
-    char welcome[128];
-    snprintf(welcome, sizeof(welcome), "Bienvenido. Usted es el Usuario %d. Use HELP para ayuda.\n", info->id_usuario);
-    send(socket_cliente, welcome, strlen(welcome), 0);
+static int traza_activa = 0; // acceso con __atomic
+static AnilloTraza *anillos_traza[MAX_ANILLOS_TRAZA];
+static int num_anillos_traza = 0; // __atomic
+static __thread AnilloTraza *anillo_propio;
+static __thread int anillo_imposible; // sin lugar o sin memoria: este hilo no registra
+static __thread char nombre_hilo_traza[24];
 
-    // Esto permite al cliente ser interactivo, manteniéndose conectado hasta que decida salir.
-    while (1) {
-        memset(buffer, 0, MAX_COMMAND_LENGTH);
-        int valread = read(socket_cliente, buffer, MAX_COMMAND_LENGTH);
+static void traza_nombrar_hilo(const char *tipo, int numero) {
+    snprintf(nombre_hilo_traza, sizeof(nombre_hilo_traza), "%s %d", tipo, numero);
+}
 
-        if (valread <= 0) {
-            // Cierre inesperado o desconexión normal
-            printf("[THREAD %lu] Cliente desconectado (socket %d).\n", pthread_self(), socket_cliente);
-            break;
-        }
+static AnilloTraza *traza_anillo(void) {
+    if (anillo_propio || anillo_imposible) return anillo_propio;
+    int i = __atomic_load_n(&num_anillos_traza, __ATOMIC_RELAXED);
+    do {
+        if (i >= MAX_ANILLOS_TRAZA) { anillo_imposible = 1; return NULL; }
+    } while (!__atomic_compare_exchange_n(&num_anillos_traza, &i, i + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    AnilloTraza *a = (AnilloTraza *)calloc(1, sizeof(AnilloTraza));
+    if (!a) { anillo_imposible = 1; return NULL; }
+    a->tid = i + 1;
+    if (nombre_hilo_traza[0]) memcpy(a->hilo, nombre_hilo_traza, sizeof(a->hilo));
+    else snprintf(a->hilo, sizeof(a->hilo), "hilo %d", a->tid);
+    __atomic_store_n(&anillos_traza[i], a, __ATOMIC_RELEASE);
+    anillo_propio = a;
+    return a;
+}
+
+// Comienzo de un intervalo: 0 si las trazas están apagadas
+static uint64_t traza_inicio(void) {
+    return __atomic_load_n(&traza_activa, __ATOMIC_RELAXED) ? reloj_ns() : 0;
+}
+
+static void traza_fin(const char *nombre, uint64_t inicio, long dato) {
+    if (!inicio) return;
+    AnilloTraza *a = traza_anillo();
+    if (!a) return;
+    uint64_t n = a->escritos++;
+    EventoTraza *e = &a->eventos[n & (EVENTOS_TRAZA_POR_HILO - 1)];
+    __atomic_store_n(&e->secuencia, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // el 0 se ve antes que los campos nuevos
+    __atomic_store_n(&e->nombre, nombre, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->inicio_ns, inicio, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->fin_ns, reloj_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&e->dato, dato, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->secuencia, n + 1, __ATOMIC_RELEASE);
+}
+
+// --- Funciones de Bloqueo (Transacciones)
+/*
+ * Locks por ID de registro con dos modos: compartido (S, lecturas puntuales dentro de
+ * una transacción) y exclusivo (X, INSERT/UPDATE/DELETE). Además hay un lock de tabla:
+ * el DML lo toma en modo intención (IX, compatible entre sí) e IMPORT CSV en exclusivo,
+ * porque reemplaza todas las filas. Los locks se sueltan juntos en COMMIT o al abortar.
+ *
+ * Cada lock tiene una cola FIFO de espera: un pedido nuevo se pone detrás de los que ya
+ * esperan aunque sea compatible con los dueños, así un X no queda postergado por un flujo
+ * de S. Al soltar, el que suelta pasa el lock a los primeros de la cola y despierta sólo
+ * a esos, cada uno con su propia condición.
+ *
+ * Los interbloqueos se evitan con wait-die: una transacción sólo se encola si es más vieja
+ * (menor número) que todos los dueños y los que esperan delante; si no, se aborta. Así
+ * cada espera va de una más vieja a una más nueva y nunca hay un ciclo. La espera está
+ * acotada (BEGIN TRANSACTION WAIT ms, o MICRODB_ESPERA_LOCK_MS) porque ocupa un trabajador.
+ * Por lo mismo, a lo sumo num_trabajadores - 1 trabajadores esperan locks a la vez: si
+ * todos esperaran, el COMMIT del dueño no tendría dónde ejecutarse y el servidor entero
+ * quedaría parado hasta que vencieran los plazos. Con el cupo lleno el pedido responde
+ * como si se hubiera vencido la espera.
+ */
+
+#define BUCKETS_LOCKS 4096 // potencia de 2
+#define MAX_ESPERA_LOCK_MS 60000
+
+enum { LOCK_OK = 0, LOCK_MORIR, LOCK_TIEMPO, LOCK_SIN_MEMORIA };
+
+// Pedido encolado; vive en la pila del hilo que espera
+typedef struct EsperaLock {
+    Transaccion *tx;
+    int exclusivo;
+    int concedido;            // lo marca quien suelta el lock, antes de despertarlo
+    pthread_cond_t cond;
+    struct EsperaLock *siguiente;
+} EsperaLock;
+
+typedef struct EntradaLock {
+    int id;
+    int exclusivo;            // 1: un único dueño en modo X (en la tabla, IMPORT)
+    Transaccion **duenos;     // varios si es compartido
+    size_t num_duenos, cap_duenos;
+    EsperaLock *primera, *ultima; // cola FIFO: no se libera la entrada mientras tenga pedidos
+    struct EntradaLock *siguiente;
+} EntradaLock;
+
+struct Transaccion {
+    uint64_t numero;          // orden de inicio: menor = más vieja
+    struct timespec inicio;   // CLOCK_MONOTONIC, para la duración máxima
+    long espera_ms;           // espera máxima por cada lock
+    Escrituras *escrituras;   // cambios sin confirmar
+    int *filas_bloqueadas;    // IDs con lock tomado, para soltarlos al terminar
+    size_t num_bloqueadas, cap_bloqueadas;
+    int bloquea_tabla;
+    int abortada;             // perdió un conflicto (wait-die): el servidor la descarta
+    uint64_t locks_desde_ns;  // cuándo tomó su primer lock (métricas: tenencia), 0 = ninguno
+};
+
+static pthread_mutex_t mutex_locks = PTHREAD_MUTEX_INITIALIZER;
+static EntradaLock *locks_filas[BUCKETS_LOCKS];
+static EntradaLock lock_tabla;
+static uint64_t siguiente_transaccion = 1; // se incrementa con __atomic
+static int transacciones_abiertas = 0;     // __atomic; los reactores sólo revisan duraciones si hay
+static long espera_lock_ms = 1000;         // MICRODB_ESPERA_LOCK_MS
+static long duracion_max_tx_ms = 30000;    // MICRODB_DURACION_MAX_TX_MS (0 = sin límite)
+static int esperas_lock_en_curso = 0;      // con mutex_locks: trabajadores parados en lock_adquirir
+static int max_esperas_lock = 0;           // num_trabajadores - 1, fijado al iniciar el pool
+
+static Transaccion *transaccion_nueva(long espera_ms) {
+    Transaccion *tx = (Transaccion *)calloc(1, sizeof(Transaccion));
+    if (!tx) return NULL;
+    tx->escrituras = escrituras_nueva();
+    if (!tx->escrituras) { free(tx); return NULL; }
+    tx->numero = __atomic_fetch_add(&siguiente_transaccion, 1, __ATOMIC_RELAXED);
+    tx->espera_ms = espera_ms;
+    clock_gettime(CLOCK_MONOTONIC, &tx->inicio);
+    __atomic_add_fetch(&transacciones_abiertas, 1, __ATOMIC_RELAXED);
+    return tx;
+}
+
+static EntradaLock *lock_buscar(int id, int crear) {
+    size_t b = ((uint32_t)id * 2654435761u) & (BUCKETS_LOCKS - 1);
+    for (EntradaLock *l = locks_filas[b]; l; l = l->siguiente) {
+        if (l->id == id) return l;
+    }
+    if (!crear) return NULL;
+    EntradaLock *l = (EntradaLock *)calloc(1, sizeof(EntradaLock));
+    if (!l) return NULL;
+    l->id = id;
+    l->siguiente = locks_filas[b];
+    locks_filas[b] = l;
+    return l;
+}
+
+static void lock_liberar_si_libre(EntradaLock *l) {
+    if (l == &lock_tabla || l->num_duenos > 0 || l->primera) return;
+    EntradaLock **p = &locks_filas[((uint32_t)l->id * 2654435761u) & (BUCKETS_LOCKS - 1)];
+    while (*p != l) p = &(*p)->siguiente;
+    *p = l->siguiente;
+    free(l->duenos);
+    free(l);
+}
 
-        char *command = buffer;
-        command[strcspn(command, "\n")] = 0; // Eliminar newline
+static int lock_es_dueno(const EntradaLock *l, const Transaccion *tx) {
+    for (size_t i = 0; i < l->num_duenos; i++) {
+        if (l->duenos[i] == tx) return 1;
+    }
+    return 0;
+}
 
-        if (strncmp(command, "EXIT", 4) == 0) {
-            // Desconexión normal
-            printf("[THREAD %lu] Comando EXIT recibido (socket %d).\n", pthread_self(), socket_cliente);
+static void lock_quitar_dueno(EntradaLock *l, const Transaccion *tx) {
+    for (size_t i = 0; i < l->num_duenos; i++) {
+        if (l->duenos[i] == tx) {
+            l->duenos[i] = l->duenos[--l->num_duenos];
             break;
         }
+    }
+    if (l->num_duenos == 0) l->exclusivo = 0;
+}
 
-        // --- 1. Manejo de Transacciones ---
-        else if (strncmp(command, "BEGIN TRANSACTION", 17) == 0) {
-            if (try_acquire_lock(socket_cliente)) {
-                transaccion_activa = 1;
-                send(socket_cliente, "OK: Transaccion iniciada. Lock exclusivo obtenido.\n", 50, 0);
-            } else {
-                // Si otro cliente lo intenta, debe recibir un error (Requisito 5)
-                send(socket_cliente, "ERROR: Transaccion activa. Reintente luego.\n", 44, 0);
-            }
-        }
-        else if (strncmp(command, "COMMIT TRANSACTION", 18) == 0) {
-            if (transaccion_activa) {
-                release_lock(socket_cliente);
-                transaccion_activa = 0;
-                send(socket_cliente, "OK: Transaccion confirmada. Lock liberado.\n", 43, 0);
-            } else {
-                send(socket_cliente, "ERROR: No hay transaccion activa para hacer COMMIT.\n", 52, 0);
-            }
+// Si el pedido es compatible con los dueños actuales lo agrega (o sube S a X) y devuelve 1
+static int lock_tomar_si_compatible(EntradaLock *l, Transaccion *tx, int exclusivo, int *sin_memoria) {
+    int propio = lock_es_dueno(l, tx);
+    size_t otros = l->num_duenos - (propio ? 1 : 0);
+    if (otros > 0 && (exclusivo || l->exclusivo)) return 0;
+    if (!propio) {
+        if (l->num_duenos == l->cap_duenos) {
+            size_t nueva = l->cap_duenos ? l->cap_duenos * 2 : 2;
+            Transaccion **duenos = (Transaccion **)realloc(l->duenos, nueva * sizeof(Transaccion *));
+            if (!duenos) { *sin_memoria = 1; return 0; }
+            l->duenos = duenos;
+            l->cap_duenos = nueva;
         }
+        l->duenos[l->num_duenos++] = tx;
+    }
+    if (exclusivo) l->exclusivo = 1;
+    return 1;
+}
+
+// Pasa el lock a los primeros de la cola mientras sean compatibles (varios S seguidos o un X)
+static void lock_conceder(EntradaLock *l) {
+    while (l->primera) {
+        EsperaLock *e = l->primera;
+        int sin_memoria = 0;
+        if (!lock_tomar_si_compatible(l, e->tx, e->exclusivo, &sin_memoria) && !sin_memoria) return;
+        l->primera = e->siguiente;
+        if (!l->primera) l->ultima = NULL;
+        e->concedido = sin_memoria ? -1 : 1;
+        pthread_cond_signal(&e->cond);
+    }
+}
+
+static void lock_sacar_de_cola(EntradaLock *l, EsperaLock *e) {
+    EsperaLock *anterior = NULL;
+    for (EsperaLock *p = l->primera; p; anterior = p, p = p->siguiente) {
+        if (p != e) continue;
+        if (anterior) anterior->siguiente = p->siguiente;
+        else l->primera = p->siguiente;
+        if (l->ultima == p) l->ultima = anterior;
+        return;
+    }
+}
+
+// Con mutex_locks tomado. Sube de S a X si la transacción es la única dueña.
+static int lock_adquirir(EntradaLock *l, Transaccion *tx, int exclusivo) {
+    int propio = lock_es_dueno(l, tx);
+    if (propio && (l->exclusivo || !exclusivo)) return LOCK_OK;
+    int sin_memoria = 0;
+    if (!l->primera && lock_tomar_si_compatible(l, tx, exclusivo, &sin_memoria)) return LOCK_OK;
+    if (sin_memoria) return LOCK_SIN_MEMORIA;
+
+    // Wait-die: sólo espera si es más vieja que los dueños y que los que esperan delante
+    for (size_t i = 0; i < l->num_duenos; i++) {
+        if (l->duenos[i] != tx && l->duenos[i]->numero < tx->numero) return LOCK_MORIR;
+    }
+    for (EsperaLock *e = l->primera; e; e = e->siguiente) {
+        if (e->tx->numero < tx->numero) return LOCK_MORIR;
+    }
+    if (tx->espera_ms == 0) return LOCK_TIEMPO;
+    // Siempre queda un trabajador libre para el COMMIT de los dueños y el resto de los comandos
+    if (esperas_lock_en_curso >= max_esperas_lock) return LOCK_TIEMPO;
 
-        // --- 2. Modificaciones (DML) ---
-        else if (strncmp(command, "INSERT", 6) == 0 || strncmp(command, "UPDATE", 6) == 0 || strncmp(command, "DELETE", 6) == 0) {
-            // Si hay otra transacción activa, rechazar
-            pthread_mutex_lock(&mutex_estado_bloqueo);
-            int locked = archivo_bloqueado;
-            int locked_by_me = (bloqueado_por_socket == socket_cliente);
-            pthread_mutex_unlock(&mutex_estado_bloqueo);
+    struct timespec limite;
+    clock_gettime(CLOCK_MONOTONIC, &limite);
+    limite.tv_sec += tx->espera_ms / 1000;
+    limite.tv_nsec += (tx->espera_ms % 1000) * 1000000L;
+    if (limite.tv_nsec >= 1000000000L) { limite.tv_sec++; limite.tv_nsec -= 1000000000L; }
 
-            if (locked && !locked_by_me) {
-                send(socket_cliente, "ERROR: Transaccion activa en curso. Reintente luego.\n", 53, 0);
-            } else if (!transaccion_activa) {
-                send(socket_cliente, "ERROR: Las modificaciones requieren BEGIN TRANSACTION.\n", 55, 0);
+    uint64_t inicio_espera = reloj_ns();
+    uint64_t traza = traza_inicio();
+    EsperaLock espera = { tx, exclusivo, 0, PTHREAD_COND_INITIALIZER, NULL };
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&espera.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (l->ultima) l->ultima->siguiente = &espera;
+    else l->primera = &espera;
+    l->ultima = &espera;
+    esperas_lock_en_curso++;
+
+    int rc = 0;
+    while (!espera.concedido && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&espera.cond, &mutex_locks, &limite);
+    }
+    esperas_lock_en_curso--;
+    pthread_cond_destroy(&espera.cond);
+    histograma_registrar(&metricas.espera_lock, reloj_ns() - inicio_espera);
+    traza_fin("espera_lock", traza, l->id);
+    if (espera.concedido) return espera.concedido > 0 ? LOCK_OK : LOCK_SIN_MEMORIA;
+    // Se venció el plazo: sale de la cola y, si bloqueaba a los de atrás, los deja pasar
+    lock_sacar_de_cola(l, &espera);
+    lock_conceder(l);
+    return LOCK_TIEMPO;
+}
+
+// Con mutex_locks tomado: lock de fila (S o X), registrado para soltarlo al terminar
+static int bloquear_fila_tomado(Transaccion *tx, int id, int exclusivo) {
+    EntradaLock *l = lock_buscar(id, 1);
+    if (!l) return LOCK_SIN_MEMORIA;
+    int nuevo = !lock_es_dueno(l, tx);
+    int rc = lock_adquirir(l, tx, exclusivo);
+    if (rc == LOCK_OK && nuevo) {
+        if (tx->num_bloqueadas == tx->cap_bloqueadas) {
+            size_t nueva = tx->cap_bloqueadas ? tx->cap_bloqueadas * 2 : 16;
+            int *ids = (int *)realloc(tx->filas_bloqueadas, nueva * sizeof(int));
+            if (!ids) {
+                lock_quitar_dueno(l, tx);
+                lock_conceder(l);
+                rc = LOCK_SIN_MEMORIA;
             } else {
-                int success;
-                char *response = perform_modification(command, &success);
-                send(socket_cliente, response, strlen(response), 0);
-                free(response);
+                tx->filas_bloqueadas = ids;
+                tx->cap_bloqueadas = nueva;
             }
         }
+        if (rc == LOCK_OK) tx->filas_bloqueadas[tx->num_bloqueadas++] = id;
+    }
+    if (rc == LOCK_OK && !tx->locks_desde_ns) tx->locks_desde_ns = reloj_ns();
+    lock_liberar_si_libre(l);
+    return rc;
+}
 
-        // --- 3. Consultas (SELECT) ---
-        else if (strncmp(command, "SELECT", 6) == 0) {
-            pthread_mutex_lock(&mutex_estado_bloqueo);
-            int locked = archivo_bloqueado;
-            pthread_mutex_unlock(&mutex_estado_bloqueo);
+static int transaccion_bloquear_fila(Transaccion *tx, int id, int exclusivo) {
+    pthread_mutex_lock(&mutex_locks);
+    int rc = bloquear_fila_tomado(tx, id, exclusivo);
+    pthread_mutex_unlock(&mutex_locks);
+    return rc;
+}
 
-            if (locked) {
-                 // Si hay una transacción activa, ningún otro cliente puede realizar consultas (Requisito 5)
-                send(socket_cliente, "ERROR: Transaccion activa en curso. Reintente luego.\n", 53, 0);
-            } else {
-                int success;
-                char *response = execute_query(command, &success);
-
-                if (strncmp(command, "SELECT ALL", 10) == 0 && success) {
-                    char *content = read_entire_file(CSV_FILE_NAME);
-                    if (content) {
-                        size_t content_len = strlen(content);
-                        if (content_len > 3000) {
-                            // Enviar en chunks de 2000 bytes
-                            size_t chunk_size = 2000;
-                            size_t sent = 0;
-
-                            while (sent < content_len) {
-                                size_t remaining = content_len - sent;
-                                size_t current_chunk = (remaining > chunk_size) ? chunk_size : remaining;
-
-                                send(socket_cliente, content + sent, current_chunk, 0);
-                                sent += current_chunk;
-
-                                // Pequeña pausa para evitar saturar el buffer
-                                usleep(1000); // 1ms
-                            }
-
-                            // Enviar marcador de fin de mensaje
-                            send(socket_cliente, "\n---END---\n", 11, 0);
-                            free(content);
-                        } else {
-                            send(socket_cliente, content, content_len, 0);
-                            free(content);
-                        }
-                    }
-                    free(response);
-                } else {
-                    send(socket_cliente, response, strlen(response), 0);
-                    free(response);
-                }
-            }
+// Intención sobre la tabla y X sobre todas las filas de una sentencia, en una sola pasada
+// por mutex_locks: un INSERT de miles de filas no toma y suelta el mutex por cada una
+static int transaccion_bloquear_filas(Transaccion *tx, const int *ids, size_t n) {
+    pthread_mutex_lock(&mutex_locks);
+    int rc = lock_adquirir(&lock_tabla, tx, 0);
+    if (rc == LOCK_OK) tx->bloquea_tabla = 1;
+    if (rc == LOCK_OK && !tx->locks_desde_ns) tx->locks_desde_ns = reloj_ns();
+    for (size_t i = 0; i < n && rc == LOCK_OK; i++) rc = bloquear_fila_tomado(tx, ids[i], 1);
+    pthread_mutex_unlock(&mutex_locks);
+    return rc;
+}
+
+// Lock de tabla: intención (DML) o exclusivo (IMPORT CSV)
+static int transaccion_bloquear_tabla(Transaccion *tx, int exclusivo) {
+    pthread_mutex_lock(&mutex_locks);
+    int rc = lock_adquirir(&lock_tabla, tx, exclusivo);
+    if (rc == LOCK_OK) tx->bloquea_tabla = 1;
+    if (rc == LOCK_OK && !tx->locks_desde_ns) tx->locks_desde_ns = reloj_ns();
+    pthread_mutex_unlock(&mutex_locks);
+    return rc;
+}
+
+// Respuesta para un lock no obtenido. Si la transacción perdió por wait-die queda abortada.
+static char *transaccion_error_lock(Transaccion *tx, int rc) {
+    if (rc == LOCK_MORIR) {
+        metricas_sumar(&metricas.conflictos_lock, 1);
+        tx->abortada = 1;
+        return error_dup("ERROR: Conflicto de lock con una transaccion anterior. Transaccion abortada; sus cambios se descartaron.\n");
+    }
+    if (rc == LOCK_TIEMPO) metricas_sumar(&metricas.vencidos_lock, 1);
+    if (rc == LOCK_TIEMPO) return error_dup("ERROR: Tiempo de espera de lock agotado. Reintente la operacion.\n");
+    return error_dup("ERROR: Memoria insuficiente.\n");
+}
+
+static void transaccion_soltar_locks(Transaccion *tx) {
+    pthread_mutex_lock(&mutex_locks);
+    for (size_t i = 0; i < tx->num_bloqueadas; i++) {
+        EntradaLock *l = lock_buscar(tx->filas_bloqueadas[i], 0);
+        if (!l) continue;
+        lock_quitar_dueno(l, tx);
+        lock_conceder(l);
+        lock_liberar_si_libre(l);
+    }
+    if (tx->bloquea_tabla) {
+        lock_quitar_dueno(&lock_tabla, tx);
+        lock_conceder(&lock_tabla);
+    }
+    tx->num_bloqueadas = 0;
+    tx->bloquea_tabla = 0;
+    pthread_mutex_unlock(&mutex_locks);
+    if (tx->locks_desde_ns) {
+        histograma_registrar(&metricas.tenencia_lock, reloj_ns() - tx->locks_desde_ns);
+        tx->locks_desde_ns = 0;
+    }
+}
+
+// Fin de la transacción de la conexión (COMMIT ya aplicado, abortada o cliente desconectado)
+static void transaccion_terminar(Conexion *c) {
+    Transaccion *tx = c->transaccion;
+    if (!tx) return;
+    transaccion_soltar_locks(tx);
+    escrituras_liberar(tx->escrituras);
+    free(tx->filas_bloqueadas);
+    free(tx);
+    c->transaccion = NULL;
+    c->transaccion_activa = 0;
+    __atomic_sub_fetch(&transacciones_abiertas, 1, __ATOMIC_RELAXED);
+}
+
+// --- Conexiones y reactores epoll
+/*
+ * Cada reactor es un hilo, fijado a un núcleo, con su propio epoll en modo
+ * edge-triggered y su propio socket de escucha con SO_REUSEPORT: el kernel
+ * reparte las conexiones nuevas entre los reactores y cada uno acepta las
+ * suyas, sin un accept ni locks compartidos. Una conexión inactiva cuesta sólo
+ * su struct: los buffers se piden al recibir o enviar algo y se liberan al
+ * vaciarse.
+ *
+ * Los reactores sólo hacen E/S y separan comandos: las consultas y las
+ * modificaciones se encolan para el pool de trabajadores y la respuesta vuelve
+ * al reactor por su eventfd. Cada conexión tiene a lo sumo un comando en un
+ * trabajador, así que sus respuestas salen en orden.
+ */
+
+static Reactor reactores[MAX_HILOS_RED];
+static int num_reactores = 0;
+
+static int buffer_reservar(char **buf, size_t *cap, size_t necesario) {
+    if (necesario <= *cap) return 1;
+    size_t nueva = *cap ? *cap : 512;
+    while (nueva < necesario) nueva *= 2;
+    char *nb = (char *)realloc(*buf, nueva);
+    if (!nb) return 0;
+    *buf = nb;
+    *cap = nueva;
+    return 1;
+}
+
+static size_t salida_pendiente(const Salida *s) {
+    return s->len - s->enviado;
+}
+
+static void salida_agregar(Salida *s, const char *datos, size_t n) {
+    if (!buffer_reservar(&s->datos, &s->cap, s->len + n)) {
+        s->sin_memoria = 1; // la conexión se corta al entregar esta salida
+        return;
+    }
+    memcpy(s->datos + s->len, datos, n);
+    s->len += n;
+}
+
+static void salida_texto(Salida *s, const char *texto) {
+    salida_agregar(s, texto, strlen(texto));
+}
+
+// Agrega una respuesta pedida con malloc (mensajes armados por las funciones de la base);
+// NULL es que faltó memoria para armarla
+static void salida_entregar(Salida *s, char *respuesta) {
+    if (!respuesta) {
+        salida_texto(s, "ERROR: Memoria insuficiente.\n");
+        return;
+    }
+    salida_texto(s, respuesta);
+    free(respuesta);
+}
+
+// Vacía la salida para el pedido siguiente; el buffer se conserva si no pasa de 'retener'
+static void salida_reiniciar(Salida *s, size_t retener) {
+    s->len = s->enviado = 0;
+    s->sin_memoria = 0;
+    if (s->cap > retener) {
+        free(s->datos);
+        s->datos = NULL;
+        s->cap = 0;
+    }
+}
+
+static void salida_trama(Salida *s, int estado, const char *datos, size_t n) {
+    uint8_t cabecera[CABECERA_RESPUESTA] = { (uint8_t)estado, (uint8_t)(n >> 24), (uint8_t)(n >> 16),
+                                             (uint8_t)(n >> 8), (uint8_t)n };
+    salida_agregar(s, (const char *)cabecera, sizeof(cabecera));
+    salida_agregar(s, datos, n);
+}
+
+static int estado_respuesta(const char *datos, size_t n) {
+    return (n >= 5 && memcmp(datos, "ERROR", 5) == 0) ? ESTADO_ERROR : ESTADO_OK;
+}
+
+// Pasa a la conexión la respuesta completa de un comando. Con tramas cada comando tiene
+// exactamente una respuesta (vacía si no hay nada que decir), así un cliente que manda
+// varios pedidos seguidos sabe a cuál corresponde cada una; un SELECT por trozos manda
+// tramas PARCIAL y cierra con la última.
+//
+// Sin nada pendiente la respuesta se manda en el acto desde c->respuesta, con la
+// cabecera de la trama en el mismo writev; sólo lo que el socket no aceptó se copia a
+// la salida de la conexión.
+static void conexion_responder(Conexion *c, int con_trama) {
+    Salida *r = &c->respuesta;
+    if (r->sin_memoria) c->salida.sin_memoria = 1;
+    size_t n = r->len;
+    uint8_t cabecera[CABECERA_RESPUESTA] = { (uint8_t)(c->flujo ? ESTADO_PARCIAL : estado_respuesta(r->datos, n)),
+                                             (uint8_t)(n >> 24), (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n };
+    struct iovec partes[2];
+    int num_partes = 0;
+    if (con_trama) partes[num_partes++] = (struct iovec){ cabecera, sizeof(cabecera) };
+    if (n > 0) partes[num_partes++] = (struct iovec){ r->datos, n };
+
+    size_t enviado = 0;
+    if (num_partes > 0 && salida_pendiente(&c->salida) == 0 && !c->salida.sin_memoria) {
+        ssize_t e;
+        uint64_t traza = traza_inicio();
+        do e = writev(c->socket, partes, num_partes); while (e < 0 && errno == EINTR);
+        traza_fin("enviar", traza, c->socket);
+        if (e > 0) enviado = (size_t)e; // ante un error, conexion_vaciar lo detecta al reintentar
+        metricas_sumar(&metricas.bytes_enviados, enviado);
+    }
+    for (int i = 0; i < num_partes; i++) {
+        size_t salta = (enviado < partes[i].iov_len) ? enviado : partes[i].iov_len;
+        enviado -= salta;
+        salida_agregar(&c->salida, (const char *)partes[i].iov_base + salta, partes[i].iov_len - salta);
+    }
+    // Un SELECT por trozos vuelve enseguida con el siguiente: se conserva el buffer del trozo
+    salida_reiniciar(r, c->flujo ? 2 * TAM_TROZO_FLUJO : BUFFER_RETENIDO);
+}
+
+static void conexion_responder_texto(Conexion *c, const char *texto) {
+    if (c->tramas) salida_trama(&c->salida, estado_respuesta(texto, strlen(texto)), texto, strlen(texto));
+    else salida_texto(&c->salida, texto);
+}
+
+// Envía lo pendiente sin bloquear. Devuelve -1 si la conexión se rompió.
+static int conexion_vaciar(Conexion *c) {
+    Salida *s = &c->salida;
+    while (s->enviado < s->len) {
+        uint64_t traza = traza_inicio();
+        ssize_t n = send(c->socket, s->datos + s->enviado, s->len - s->enviado, MSG_NOSIGNAL);
+        traza_fin("enviar", traza, c->socket);
+        if (n > 0) {
+            s->enviado += (size_t)n;
+            metricas_sumar(&metricas.bytes_enviados, (uint64_t)n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0; // EPOLLOUT avisa cuando el socket vuelva a tener lugar
+        } else {
+            return -1;
         }
-        // --- 4. Comando HELP ---
-        else if (strncmp(command, "HELP", 4) == 0) {
-            char *ayuda = mostrar_ayuda_detallada();
-            if (ayuda) {
-                send(socket_cliente, ayuda, strlen(ayuda), 0);
-                free(ayuda);
-            } else {
-                send(socket_cliente, "ERROR: No se pudo generar la ayuda.\n", 36, 0);
-            }
+    }
+    s->len = s->enviado = 0;
+    if (s->cap > BUFFER_RETENIDO) {
+        free(s->datos);
+        s->datos = NULL;
+        s->cap = 0;
+    }
+    return 0;
+}
+
+// Lee hasta EAGAIN, EOF o hasta llenar la entrada. Devuelve -1 ante un error de lectura.
+static int conexion_leer(Conexion *c) {
+    while (c->puede_leer && c->entrada_len < MAX_ENTRADA_CONEXION) {
+        size_t lugar = MAX_ENTRADA_CONEXION - c->entrada_len;
+        if (lugar > 4096) lugar = 4096;
+        if (!buffer_reservar(&c->entrada, &c->entrada_cap, c->entrada_len + lugar + 1)) return -1;
+        uint64_t traza = traza_inicio();
+        ssize_t n = recv(c->socket, c->entrada + c->entrada_len, lugar, 0);
+        traza_fin("recibir", traza, c->socket);
+        if (n > 0) {
+            c->entrada_len += (size_t)n;
+            metricas_sumar(&metricas.bytes_recibidos, (uint64_t)n);
+        } else if (n == 0) {
+            c->fin_lectura = 1;
+            c->puede_leer = 0;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            c->puede_leer = 0;
+        } else if (errno != EINTR) {
+            return -1;
         }
-        
-        // --- 5. Comando no reconocido - Mostrar ayuda automáticamente ---
-        else {
-            char *ayuda = mostrar_ayuda_detallada();
-            char *mensaje_error = (char *)malloc(2048 + 100);
-            if (mensaje_error && ayuda) {
-                snprintf(mensaje_error, 2048 + 100, 
-                    "ERROR: Comando no reconocido: '%s'\n\n%s", command, ayuda);
-                send(socket_cliente, mensaje_error, strlen(mensaje_error), 0);
-                free(mensaje_error);
-                free(ayuda);
-            } else {
-                char *error_simple = "ERROR: Comando no reconocido. Use HELP para ver los comandos disponibles.\n";
-                send(socket_cliente, error_simple, strlen(error_simple), 0);
-                if (ayuda) free(ayuda);
-                if (mensaje_error) free(mensaje_error);
-            }
+    }
+    return 0;
+}
+
+static void conexion_consumir(Conexion *c, size_t n) {
+    if (c->hay_pisado) {
+        if (n < c->entrada_len) c->entrada[n] = c->pisado;
+        c->hay_pisado = 0;
+    }
+    c->entrada_len -= n;
+    if (c->entrada_len > 0) {
+        memmove(c->entrada, c->entrada + n, c->entrada_len);
+    } else {
+        free(c->entrada);
+        c->entrada = NULL;
+        c->entrada_cap = 0;
+    }
+}
+
+// Línea [inicio, fin) igual a 'palabra', sin contar espacios alrededor ni el '\r' final
+static int linea_es(const char *inicio, const char *fin, const char *palabra) {
+    while (inicio < fin && (*inicio == ' ' || *inicio == '\t')) inicio++;
+    while (fin > inicio && (fin[-1] == ' ' || fin[-1] == '\t' || fin[-1] == '\r')) fin--;
+    size_t largo = strlen(palabra);
+    return (size_t)(fin - inicio) == largo && memcmp(inicio, palabra, largo) == 0;
+}
+
+// Fin de línea de la línea END que cierra un BATCH cuya primera línea termina en 'fin', o NULL
+static char *fin_de_lote(char *fin, char *limite) {
+    for (char *p = fin + 1; p < limite; ) {
+        char *nl = (char *)memchr(p, '\n', (size_t)(limite - p));
+        if (!nl) return NULL;
+        if (linea_es(p, nl, "END")) return nl;
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+// Descarta las líneas de un BATCH demasiado largo hasta su END. Devuelve 1 si terminó.
+static int conexion_saltar_lote(Conexion *c) {
+    while (c->saltando_lote && c->entrada_len > 0) {
+        char *fin = (char *)memchr(c->entrada, '\n', c->entrada_len);
+        if (!fin) {
+            if (c->entrada_len >= MAX_ENTRADA_CONEXION) conexion_consumir(c, c->entrada_len);
+            return 0;
+        }
+        if (linea_es(c->entrada, fin, "END")) c->saltando_lote = 0;
+        conexion_consumir(c, (size_t)(fin - c->entrada) + 1);
+    }
+    return !c->saltando_lote;
+}
+
+/*
+ * Próximo comando de la entrada, terminado en '\n' (se admite "\r\n"). Si ya
+ * no queda nada por leer del socket, el resto sin '\n' también es un comando:
+ * los clientes que no terminan la línea mandan un comando por envío. Un BATCH
+ * abarca varias líneas: el comando es el bloque entero hasta la línea END.
+ */
+static char *conexion_siguiente_comando(Conexion *c, size_t *consumido) {
+    if (!conexion_saltar_lote(c) || c->entrada_len == 0) return NULL;
+    char *fin = (char *)memchr(c->entrada, '\n', c->entrada_len);
+    if (fin && linea_es(c->entrada, fin, "BATCH")) {
+        char *fin_lote = fin_de_lote(fin, c->entrada + c->entrada_len);
+        if (!fin_lote && c->entrada_len >= MAX_ENTRADA_CONEXION) {
+            c->saltando_lote = 1; // el resto del lote no se ejecuta como comandos sueltos
+        } else if (!fin_lote && !c->fin_lectura) {
+            return NULL; // esperar el END
         }
+        fin = fin_lote;
+    }
+    if (fin) {
+        *consumido = (size_t)(fin - c->entrada) + 1;
+    } else if (!c->puede_leer || c->entrada_len >= MAX_ENTRADA_CONEXION) {
+        fin = c->entrada + c->entrada_len; // conexion_leer deja un byte libre para el '\0'
+        *consumido = c->entrada_len;
+    } else {
+        return NULL;
     }
+    *fin = '\0';
+    if (fin > c->entrada && fin[-1] == '\r') fin[-1] = '\0';
+    return c->entrada;
+}
+
+/*
+ * Próximo pedido con tramas, si ya llegó completo. El '\0' del comando pisa el primer
+ * byte del pedido siguiente, que conexion_consumir repone.
+ * Un pedido más largo que la entrada no se puede saltear sin perder el sincronismo:
+ * se responde el error y se cierra la conexión.
+ */
+static char *conexion_siguiente_trama(Conexion *c, size_t *consumido) {
+    if (c->entrada_len < CABECERA_PEDIDO) return NULL;
+    const uint8_t *b = (const uint8_t *)c->entrada;
+    size_t largo = ((size_t)b[0] << 24) | ((size_t)b[1] << 16) | ((size_t)b[2] << 8) | b[3];
+    if (largo > MAX_ENTRADA_CONEXION - CABECERA_PEDIDO) {
+        conexion_responder_texto(c, "ERROR: Comando demasiado largo.\n");
+        conexion_consumir(c, c->entrada_len);
+        c->cerrar = 1;
+        return NULL;
+    }
+    if (c->entrada_len < CABECERA_PEDIDO + largo) return NULL;
+    *consumido = CABECERA_PEDIDO + largo;
+    c->pisado = c->entrada[*consumido]; // conexion_leer deja un byte libre al final
+    c->hay_pisado = 1;
+    c->entrada[*consumido] = '\0';
+    return c->entrada + CABECERA_PEDIDO;
+}
 
-    // --- Cleanup
-    if (transaccion_activa) {
+static void conexion_cerrar(Reactor *r, Conexion *c) {
+    if (c->transaccion_activa) {
         // Manejo de cierre inesperado: si la transacción está activa, debe liberar el lock
-        printf("[THREAD %lu] ADVERTENCIA: Cliente desconectado con transaccion activa (socket %d). Liberando lock...\n", 
-               pthread_self(), socket_cliente);
-        release_lock(socket_cliente);
-        printf("[THREAD %lu] Lock liberado exitosamente. Otros clientes pueden realizar operaciones.\n", pthread_self());
+        // Los cambios sin confirmar se descartan
+        printf("[SERVIDOR] ADVERTENCIA: Cliente desconectado con transaccion activa (socket %d). Descartando %zu cambios y liberando sus locks...\n",
+               c->socket, escrituras_cantidad(c->transaccion->escrituras));
+        transaccion_terminar(c);
     }
+    flujo_liberar(c->flujo);
+    c->flujo = NULL;
+    cursores_cerrar(c);
+    preparadas_liberar(c);
+
+    if (c->anterior) c->anterior->siguiente = c->siguiente;
+    else r->conexiones = c->siguiente;
+    if (c->siguiente) c->siguiente->anterior = c->anterior;
+
+    close(c->socket); // también lo saca del epoll
+    int activos = __atomic_sub_fetch(&clientes_activos, 1, __ATOMIC_RELAXED);
+    printf("[Servidor] Cliente %d desconectado (socket %d). Clientes activos: %d.\n", c->id_usuario, c->socket, activos);
+
+    free(c->entrada);
+    free(c->salida.datos);
+    free(c->respuesta.datos);
+    if (r->num_libres < MAX_CONEXIONES_LIBRES) {
+        c->siguiente = r->libres;
+        r->libres = c;
+        r->num_libres++;
+    } else {
+        free(c);
+    }
+}
+
+static Conexion *conexion_nueva(Reactor *r) {
+    Conexion *c = r->libres;
+    if (c) {
+        r->libres = c->siguiente;
+        r->num_libres--;
+        memset(c, 0, sizeof(Conexion));
+    } else {
+        c = (Conexion *)calloc(1, sizeof(Conexion));
+        if (!c) return NULL;
+    }
+    c->reactor = r;
+    return c;
+}
+
+// --- Pool de trabajadores
+/*
+ * Cola FIFO compartida (varios reactores producen, varios trabajadores
+ * consumen) protegida por un mutex. Las tareas son pocas y largas comparadas
+ * con el costo del lock: a lo sumo una por conexión.
+ */
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t hay_tareas;
+    Tarea *primera, *ultima;
+    int detener;
+} cola_trabajo = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+static pthread_t trabajadores[MAX_HILOS_TRABAJO];
+static int num_trabajadores = 0;
+
+// Comandos que pueden tardar (recorren la tabla, escriben el WAL o archivos): van a un trabajador.
+// El resto (BEGIN, HELP, EXIT, errores) se resuelve en el reactor.
+static int comando_va_a_trabajador(const char *command) {
+    return strncmp(command, "SELECT", 6) == 0 || strncmp(command, "EXPORT CSV", 10) == 0 ||
+           strncmp(command, "INSERT", 6) == 0 || strncmp(command, "UPDATE", 6) == 0 ||
+           strncmp(command, "DELETE", 6) == 0 || strncmp(command, "IMPORT CSV", 10) == 0 ||
+           strncmp(command, "CHECKPOINT", 10) == 0 || strncmp(command, "SHOW COMPACTION", 15) == 0 ||
+           strncmp(command, "COMMIT TRANSACTION", 18) == 0 || strncmp(command, "BATCH", 5) == 0 ||
+           strncmp(command, "DECLARE", 7) == 0 || strncmp(command, "FETCH", 5) == 0 || strncmp(command, "CLOSE", 5) == 0 ||
+           strncmp(command, "EXECUTE", 7) == 0 || strncmp(command, "STATS", 5) == 0 || strncmp(command, "TRACE DUMP", 10) == 0;
+}
+
+// 'comando' queda en la entrada de la conexión: se consume cuando vuelve la respuesta
+static void cola_encolar(Conexion *c, char *comando, size_t consumido) {
+    Tarea *t = &c->tarea;
+    t->siguiente = NULL;
+    t->conexion = c;
+    t->comando = comando;
+    t->consumido = consumido;
+    c->en_curso = 1;
 
+    pthread_mutex_lock(&cola_trabajo.mutex);
+    if (cola_trabajo.ultima) cola_trabajo.ultima->siguiente = t;
+    else cola_trabajo.primera = t;
+    cola_trabajo.ultima = t;
+    pthread_cond_signal(&cola_trabajo.hay_tareas);
+    pthread_mutex_unlock(&cola_trabajo.mutex);
+}
+
+// Devuelve una tarea terminada a su reactor y lo despierta
+static void reactor_completar(Tarea *t) {
+    Reactor *r = t->conexion->reactor;
+    uint64_t uno = 1;
+    pthread_mutex_lock(&r->mutex_hechas);
+    t->siguiente = r->hechas;
+    r->hechas = t;
+    pthread_mutex_unlock(&r->mutex_hechas);
+    if (write(r->evento_hechas, &uno, sizeof(uno)) < 0 && errno != EAGAIN) perror("eventfd");
+}
+
+// Agrega el trozo siguiente del SELECT en curso; al terminar suelta la instantánea
+static void conexion_continuar_flujo(Conexion *c, Salida *out) {
+    if (flujo_continuar(c->flujo, out, c->tramas)) {
+        flujo_liberar(c->flujo);
+        c->flujo = NULL;
+    }
+}
 
-    // Eliminar socket de la lista global
-    pthread_mutex_lock(&mutex_sockets_clientes);
-    for (int i = 0; i < MAX_TOTAL_CLIENTES; ++i) {
-        if (sockets_clientes[i] == socket_cliente) {
-            sockets_clientes[i] = 0;
+static void *trabajador_thread(void *arg) {
+    traza_nombrar_hilo("trabajador", (int)(intptr_t)arg);
+    for (;;) {
+        pthread_mutex_lock(&cola_trabajo.mutex);
+        while (!cola_trabajo.primera && !cola_trabajo.detener) {
+            pthread_cond_wait(&cola_trabajo.hay_tareas, &cola_trabajo.mutex);
+        }
+        if (cola_trabajo.detener) {
+            pthread_mutex_unlock(&cola_trabajo.mutex);
             break;
         }
+        Tarea *t = cola_trabajo.primera;
+        cola_trabajo.primera = t->siguiente;
+        if (!cola_trabajo.primera) cola_trabajo.ultima = NULL;
+        pthread_mutex_unlock(&cola_trabajo.mutex);
+
+        Conexion *c = t->conexion;
+        uint64_t traza = traza_inicio();
+        if (c->flujo) {
+            conexion_continuar_flujo(c, &c->respuesta);
+            traza_fin("trozo_select", traza, c->socket);
+        } else {
+            procesar_comando(c, t->comando, &c->respuesta);
+            traza_fin(nombres_comando[c->comando_tipo], traza, c->socket);
+        }
+        reactor_completar(t);
     }
-    pthread_mutex_unlock(&mutex_sockets_clientes);
+    return NULL;
+}
 
-    close(socket_cliente);
+static int iniciar_trabajadores(int cantidad) {
+    for (int i = 0; i < cantidad; i++) {
+        if (pthread_create(&trabajadores[i], NULL, trabajador_thread, (void *)(intptr_t)i) != 0) {
+            perror("pthread_create trabajador");
+            break;
+        }
+        num_trabajadores++;
+    }
+    max_esperas_lock = num_trabajadores - 1;
+    return num_trabajadores > 0;
+}
 
-    // Esto permite al servidor manejar el conteo de clientes concurrentes (Requisito 1)
-    pthread_mutex_lock(&mutex_clientes);
-    clientes_activos--;
-    printf("[Servidor] Clientes activos: %d.\n", clientes_activos);
-    pthread_cond_signal(&condicion_clientes);
-    pthread_mutex_unlock(&mutex_clientes);
+// Espera a que cada trabajador termine su tarea actual; las que seguían en la cola se descartan
+static void detener_trabajadores(void) {
+    pthread_mutex_lock(&cola_trabajo.mutex);
+    cola_trabajo.detener = 1;
+    pthread_cond_broadcast(&cola_trabajo.hay_tareas);
+    pthread_mutex_unlock(&cola_trabajo.mutex);
+    for (int i = 0; i < num_trabajadores; i++) pthread_join(trabajadores[i], NULL);
+    num_trabajadores = 0;
 
-    free(info);
-    pthread_exit(NULL);
+    cola_trabajo.primera = cola_trabajo.ultima = NULL; // las tareas son de sus conexiones
 }
 
-// --- MAIN
-int main(int argc, char *argv[]) {
-    int socket_servidor, nuevo_socket;
-    struct sockaddr_in direccion;
-    int longitud_direccion = sizeof(direccion);
-    char ip[16] = "127.0.0.1";
-    int puerto = DEFAULT_PORT;
-    int config_max_clientes = MAX_CLIENTS;
-    int config_backlog = BACKLOG_QUEUE;
+// --- Bucle de los reactores
 
-    load_config(ip, &puerto, &config_max_clientes, &config_backlog);
+// Procesa lo que se pueda de la conexión: envía, lee y ejecuta comandos hasta quedar a la espera
+static void conexion_atender(Reactor *r, Conexion *c) {
+    for (;;) {
+        if (conexion_vaciar(c) < 0) {
+            if (c->en_curso) c->cerrar = 1; // se cierra cuando vuelva el trabajador
+            else conexion_cerrar(r, c);
+            return;
+        }
+        if (c->en_curso) return; // la entrada queda en el buffer hasta que vuelva la respuesta
+        // Contrapresión: con mucha salida sin enviar no se ejecutan más comandos hasta el próximo EPOLLOUT
+        if (salida_pendiente(&c->salida) > LIMITE_SALIDA_PENDIENTE) return;
+        if (c->cerrar || c->salida.sin_memoria) {
+            if (salida_pendiente(&c->salida) == 0 || c->salida.sin_memoria) conexion_cerrar(r, c);
+            return;
+        }
+        if (c->flujo) {
+            // SELECT por trozos: el siguiente se pide cuando casi todo el anterior salió al socket
+            if (salida_pendiente(&c->salida) <= TAM_TROZO_FLUJO) cola_encolar(c, NULL, 0);
+            return;
+        }
 
-    // Validación de parámetros (como antes)
-    if (argc == 2) {
-        fprintf(stderr, "ERROR: Parámetros incorrectos.\n");
-        fprintf(stderr, "Se esperan 0, 2 o 4 parámetros, pero se proporcionó 1.\n\n");
-        fprintf(stderr, "USO CORRECTO:\n");
-        fprintf(stderr, "  %s                           - Valores por defecto\n", argv[0]);
-        fprintf(stderr, "  %s N M                       - Configurar clientes concurrentes y backlog\n", argv[0]);
-        fprintf(stderr, "  %s IP PUERTO N M             - Configurar IP, puerto, clientes y backlog\n", argv[0]);
-        exit(EXIT_FAILURE);
-    } else if (argc > 5) {
-        fprintf(stderr, "ERROR: Demasiados parámetros.\n");
-        fprintf(stderr, "Se proporcionaron %d parámetros, pero el máximo es 4.\n\n", argc - 1);
-        fprintf(stderr, "USO CORRECTO:\n");
-        fprintf(stderr, "  %s                           - Valores por defecto\n", argv[0]);
-        fprintf(stderr, "  %s N M                       - Configurar clientes concurrentes y backlog\n", argv[0]);
-        fprintf(stderr, "  %s IP PUERTO N M             - Configurar IP, puerto, clientes y backlog\n", argv[0]);
-        exit(EXIT_FAILURE);
-    } else if (argc == 3) {
-        config_max_clientes = atoi(argv[1]);
-        config_backlog = atoi(argv[2]);
-        if (config_max_clientes <= 0) {
-            fprintf(stderr, "ERROR: N (clientes concurrentes) debe ser mayor que 0. Valor recibido: %d\n", config_max_clientes);
-            exit(EXIT_FAILURE);
+        size_t consumido;
+        int con_trama = c->tramas; // PROTOCOL cambia el modo: la respuesta va en el del pedido
+        char *comando = con_trama ? conexion_siguiente_trama(c, &consumido) : conexion_siguiente_comando(c, &consumido);
+        if (comando) {
+            if (!con_trama && consumido >= MAX_ENTRADA_CONEXION) {
+                salida_texto(&c->salida, "ERROR: Comando demasiado largo.\n");
+            } else if (comando[0] == '\0') {
+                // línea vacía: nada que responder (con tramas, una respuesta vacía)
+                if (con_trama) salida_trama(&c->salida, ESTADO_OK, "", 0);
+            } else if (!comando_va_a_trabajador(comando)) {
+                uint64_t inicio = reloj_ns(), traza = traza_inicio();
+                int tipo = tipo_comando(comando);
+                procesar_comando(c, comando, &c->respuesta);
+                metricas_comando(tipo, inicio, &c->respuesta);
+                traza_fin(nombres_comando[tipo], traza, c->socket);
+                conexion_responder(c, con_trama);
+            } else {
+                c->comando_tipo = tipo_comando(comando);
+                c->comando_inicio_ns = reloj_ns();
+                cola_encolar(c, comando, consumido);
+                return; // la entrada queda como está hasta que vuelva la respuesta
+            }
+            conexion_consumir(c, consumido);
+            continue;
         }
-        if (config_backlog < 0) {
-            fprintf(stderr, "ERROR: M (backlog) debe ser mayor o igual a 0. Valor recibido: %d\n", config_backlog);
-            exit(EXIT_FAILURE);
+        if (c->cerrar) continue; // trama inválida: enviar el error y cerrar
+        if (c->puede_leer) {
+            if (conexion_leer(c) < 0) {
+                conexion_cerrar(r, c);
+                return;
+            }
+            continue;
         }
-    } else if (argc == 5) {
-        strncpy(ip, argv[1], sizeof(ip) - 1);
-        ip[sizeof(ip) - 1] = '\0';
-        puerto = atoi(argv[2]);
-        config_max_clientes = atoi(argv[3]);
-        config_backlog = atoi(argv[4]);
-        if (strlen(ip) == 0) { fprintf(stderr, "ERROR: Dirección IP vacía.\n"); exit(EXIT_FAILURE); }
+        if (c->fin_lectura) {
+            c->cerrar = 1;
+            continue;
+        }
+        return; // esperar el próximo evento
+    }
+}
+
+// Pasa a cada conexión la respuesta de su trabajador y sigue atendiéndola
+static long long reloj_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// Aborta las transacciones de sus conexiones que superaron la duración máxima. Las que
+// están ejecutando un comando se revisan la vez siguiente.
+static void reactor_revisar_transacciones(Reactor *r) {
+    long long ahora = reloj_ms();
+    Conexion *siguiente;
+    for (Conexion *c = r->conexiones; c; c = siguiente) {
+        siguiente = c->siguiente;
+        // Con un comando en curso la conexión es del trabajador; un SELECT por trozos todavía usa los cambios
+        if (c->en_curso || c->flujo || !c->transaccion) continue;
+        Transaccion *tx = c->transaccion;
+        long long inicio = (long long)tx->inicio.tv_sec * 1000 + tx->inicio.tv_nsec / 1000000;
+        if (ahora - inicio < duracion_max_tx_ms) continue;
+        printf("[SERVIDOR] Transaccion del socket %d abortada: supero la duracion maxima (%ld ms).\n", c->socket, duracion_max_tx_ms);
+        transaccion_terminar(c);
+        char aviso[160];
+        snprintf(aviso, sizeof(aviso), "ERROR: Transaccion abortada por superar la duracion maxima (%ld ms); sus cambios se descartaron.\n",
+                 duracion_max_tx_ms);
+        if (c->tramas) salida_trama(&c->salida, ESTADO_AVISO, aviso, strlen(aviso));
+        else salida_texto(&c->salida, aviso);
+        conexion_atender(r, c);
+    }
+}
+
+static void reactor_recibir_hechas(Reactor *r) {
+    uint64_t contador;
+    if (read(r->evento_hechas, &contador, sizeof(contador)) < 0 && errno != EAGAIN) perror("eventfd");
+
+    pthread_mutex_lock(&r->mutex_hechas);
+    Tarea *t = r->hechas;
+    r->hechas = NULL;
+    pthread_mutex_unlock(&r->mutex_hechas);
+
+    while (t) {
+        Tarea *siguiente = t->siguiente;
+        Conexion *c = t->conexion;
+        c->en_curso = 0;
+        if (t->comando) metricas_comando(c->comando_tipo, c->comando_inicio_ns, &c->respuesta); // no los trozos siguientes de un SELECT
+        conexion_responder(c, c->tramas);
+        if (t->consumido > 0) conexion_consumir(c, t->consumido);
+        conexion_atender(r, c);
+        t = siguiente;
+    }
+}
+
+// Acepta las conexiones pendientes del socket de escucha del reactor. El socket es de
+// nivel, así que se toma un lote por evento para no postergar a las conexiones ya abiertas.
+static void reactor_aceptar(Reactor *r) {
+    for (int i = 0; i < MAX_ACEPTAR_POR_EVENTO; i++) {
+        struct sockaddr_in direccion;
+        socklen_t longitud = sizeof(direccion);
+        int nuevo_socket = accept4(r->socket_escucha, (struct sockaddr *)&direccion, &longitud, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (nuevo_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+                if (errno == EMFILE || errno == ENFILE) usleep(10000); // sin descriptores: no girar en vacío
+            }
+            return;
+        }
+
+        int activos = __atomic_add_fetch(&clientes_activos, 1, __ATOMIC_RELAXED);
+        Conexion *c = activos <= max_clientes_config ? conexion_nueva(r) : NULL;
+        if (!c) {
+            // Se superó N (o no hay memoria): se avisa y se cierra sin registrar la conexión
+            const char *msg = "ERROR: Servidor ocupado. Se superó el máximo de clientes y conexiones en espera. Intente más tarde.\n";
+            send(nuevo_socket, msg, strlen(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(nuevo_socket);
+            __atomic_sub_fetch(&clientes_activos, 1, __ATOMIC_RELAXED);
+            metricas_sumar(&metricas.conexiones_rechazadas, 1);
+            continue;
+        }
+
+        // Respuestas cortas: sin Nagle cada una sale en cuanto se escribe
+        int opt = 1;
+        setsockopt(nuevo_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        c->socket = nuevo_socket;
+        c->direccion = direccion;
+        c->id_usuario = __atomic_fetch_add(&siguiente_id_usuario, 1, __ATOMIC_RELAXED);
+        metricas_sumar(&metricas.conexiones_aceptadas, 1);
+        printf("[Servidor] Nuevo cliente! ID: %d desde %s:%d (socket %d, E/S %d). Clientes activos: %d.\n",
+               c->id_usuario, inet_ntoa(direccion.sin_addr), ntohs(direccion.sin_port), nuevo_socket, r->id, activos);
+
+        // Enviar bienvenida con el identificador de usuario asignado
+        char welcome[128];
+        snprintf(welcome, sizeof(welcome), "Bienvenido. Usted es el Usuario %d. Use HELP para ayuda.\n", c->id_usuario);
+        salida_texto(&c->salida, welcome);
+        conexion_vaciar(c); // socket recién creado: el saludo entra entero en el buffer del kernel
+
+        c->siguiente = r->conexiones;
+        if (r->conexiones) r->conexiones->anterior = c;
+        r->conexiones = c;
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, c->socket, &ev) < 0) {
+            perror("epoll_ctl");
+            conexion_cerrar(r, c);
+        }
+    }
+}
+
+static void *reactor_thread(void *arg) {
+    Reactor *r = (Reactor *)arg;
+    traza_nombrar_hilo("E/S", r->id);
+    struct epoll_event eventos[MAX_EVENTOS_EPOLL];
+
+    while (!stop_requested) {
+        // Con transacciones abiertas y duración máxima, se despierta al menos una vez por segundo
+        int con_limite = duracion_max_tx_ms > 0 && __atomic_load_n(&transacciones_abiertas, __ATOMIC_RELAXED) > 0;
+        int n = epoll_wait(r->epoll_fd, eventos, MAX_EVENTOS_EPOLL, con_limite ? 1000 : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *dato = eventos[i].data.ptr;
+            if (!dato) continue; // evento_terminar
+            if (dato == &r->evento_hechas) {
+                reactor_recibir_hechas(r);
+                continue;
+            }
+            if (dato == &r->socket_escucha) {
+                reactor_aceptar(r);
+                continue;
+            }
+            Conexion *c = (Conexion *)dato;
+            if ((eventos[i].events & EPOLLERR) && !c->en_curso) {
+                conexion_cerrar(r, c);
+                continue;
+            }
+            if (eventos[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) c->puede_leer = 1;
+            conexion_atender(r, c);
+        }
+        if (con_limite && reloj_ms() >= r->proxima_revision) {
+            reactor_revisar_transacciones(r);
+            r->proxima_revision = reloj_ms() + 1000;
+        }
+    }
+    return NULL;
+}
+
+// Fija el hilo a la i-ésima CPU de las que el proceso tiene permitidas
+static void fijar_a_nucleo(pthread_t hilo, int i) {
+    cpu_set_t permitidas, una;
+    if (sched_getaffinity(0, sizeof(permitidas), &permitidas) != 0) return;
+    int restantes = i % CPU_COUNT(&permitidas);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &permitidas) || restantes-- > 0) continue;
+        CPU_ZERO(&una);
+        CPU_SET(cpu, &una);
+        if (pthread_setaffinity_np(hilo, sizeof(una), &una) != 0) perror("pthread_setaffinity_np");
+        return;
+    }
+}
+
+static int iniciar_reactores(int cantidad, const int *escuchas, int compartido, int fijar_nucleos) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL }; // nivel: despierta a todos hasta el final
+    for (int i = 0; i < cantidad; i++) {
+        Reactor *r = &reactores[i];
+        r->id = i;
+        r->conexiones = NULL;
+        r->libres = NULL;
+        r->num_libres = 0;
+        r->hechas = NULL;
+        r->socket_escucha = escuchas[compartido ? 0 : i];
+        pthread_mutex_init(&r->mutex_hechas, NULL);
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        r->evento_hechas = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        struct epoll_event ev_hechas = { .events = EPOLLIN, .data.ptr = &r->evento_hechas };
+        // Socket compartido (sin SO_REUSEPORT): EPOLLEXCLUSIVE evita despertar a todos por cada conexión
+        struct epoll_event ev_escucha = { .events = EPOLLIN | (compartido ? EPOLLEXCLUSIVE : 0), .data.ptr = &r->socket_escucha };
+        if (r->epoll_fd < 0 || r->evento_hechas < 0 ||
+            epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, evento_terminar, &ev) < 0 ||
+            epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->evento_hechas, &ev_hechas) < 0 ||
+            epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->socket_escucha, &ev_escucha) < 0) {
+            perror("epoll reactor");
+            return 0;
+        }
+        if (pthread_create(&r->hilo, NULL, reactor_thread, r) != 0) {
+            perror("pthread_create reactor");
+            return 0;
+        }
+        if (fijar_nucleos) fijar_a_nucleo(r->hilo, i);
+        num_reactores++;
+    }
+    return 1;
+}
+
+/*
+ * Cierre ordenado: primero salen los reactores (ya no aceptan ni toman
+ * comandos nuevos), después los trabajadores terminan lo que estaban
+ * ejecutando, y recién entonces se cierran las conexiones, liberando los
+ * locks de transacciones abiertas.
+ */
+static void detener_reactores(void) {
+    uint64_t uno = 1;
+    stop_requested = 1;
+    if (write(evento_terminar, &uno, sizeof(uno)) < 0) perror("eventfd");
+    for (int i = 0; i < num_reactores; i++) pthread_join(reactores[i].hilo, NULL);
+    detener_trabajadores();
+
+    for (int i = 0; i < num_reactores; i++) {
+        Reactor *r = &reactores[i];
+        r->hechas = NULL; // las tareas son de sus conexiones, que se cierran a continuación
+        while (r->conexiones) conexion_cerrar(r, r->conexiones);
+        while (r->libres) {
+            Conexion *c = r->libres;
+            r->libres = c->siguiente;
+            free(c);
+        }
+        if (i == 0 || r->socket_escucha != reactores[0].socket_escucha) close(r->socket_escucha);
+        close(r->epoll_fd);
+        close(r->evento_hechas);
+        pthread_mutex_destroy(&r->mutex_hechas);
+    }
+    num_reactores = 0;
+}
+
+// Socket de escucha no bloqueante. Con *reuseport varios sockets comparten IP:puerto y el
+// kernel reparte las conexiones entre ellos; si el sistema no lo soporta se apaga la marca.
+static int crear_socket_escucha(const char *ip, int puerto, int backlog, int *reuseport) {
+    struct sockaddr_in direccion;
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s < 0) { perror("socket failed"); return -1; }
+
+    int opt = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+        perror("setsockopt"); close(s); return -1;
+    }
+    if (*reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        printf("[SERVIDOR] ADVERTENCIA: SO_REUSEPORT no disponible (%s); los reactores comparten un socket de escucha.\n", strerror(errno));
+        *reuseport = 0;
+    }
+    // Habilitar SO_KEEPALIVE para detectar desconexiones colgadas (los sockets aceptados lo heredan)
+    if (setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt))) {
+        perror("setsockopt SO_KEEPALIVE");
+    }
+
+    memset(&direccion, 0, sizeof(direccion));
+    direccion.sin_family = AF_INET;
+    direccion.sin_addr.s_addr = inet_addr(ip);
+    direccion.sin_port = htons(puerto);
+
+    if (bind(s, (struct sockaddr *)&direccion, sizeof(direccion)) < 0) {
+        perror("bind failed"); close(s); return -1;
+    }
+    if (listen(s, backlog) < 0) {
+        perror("listen"); close(s); return -1;
+    }
+    return s;
+}
+
+// Sube el límite de descriptores abiertos para poder sostener N conexiones
+static void ajustar_limite_descriptores(int max_clientes) {
+    struct rlimit lim;
+    rlim_t deseado = (rlim_t)max_clientes + 64; // archivo base, WAL, lock, epoll y stdio
+    if (getrlimit(RLIMIT_NOFILE, &lim) != 0 || lim.rlim_cur >= deseado) return;
+    lim.rlim_cur = (lim.rlim_max != RLIM_INFINITY && lim.rlim_max < deseado) ? lim.rlim_max : deseado;
+    if (setrlimit(RLIMIT_NOFILE, &lim) != 0 || lim.rlim_cur < deseado) {
+        printf("[SERVIDOR] ADVERTENCIA: el límite de descriptores es %lu; no alcanza para %d clientes.\n",
+               (unsigned long)lim.rlim_cur, max_clientes);
+    }
+}
+
+// --- Ejecución de comandos
+
+// Ejecuta un comando completo de la conexión y deja la respuesta en out. Corre en el
+// reactor de la conexión o en un trabajador, nunca en los dos a la vez.
+static void procesar_comando(Conexion *c, char *command, Salida *out) {
+    int socket_cliente = c->socket;
+
+    if (strncmp(command, "EXIT", 4) == 0) {
+        // Desconexión normal
+        printf("[Servidor] Comando EXIT recibido (socket %d).\n", socket_cliente);
+        c->cerrar = 1;
+    }
+
+    // --- 1. Manejo de Transacciones ---
+    else if (strncmp(command, "BEGIN TRANSACTION", 17) == 0) {
+        // Sin lock global: los locks de fila se toman al modificar. WAIT fija cuánto
+        // espera esta transacción por cada lock ocupado (0 = nunca espera).
+        long espera = espera_lock_ms;
+        int ms;
+        char extra[2];
+        int formato_ok = sscanf(command + 17, " %1s", extra) != 1 ||
+                         (sscanf(command + 17, " WAIT %d %1s", &ms, extra) == 1 && ms >= 0);
+        if (formato_ok && sscanf(command + 17, " WAIT %d", &ms) == 1) espera = (ms < MAX_ESPERA_LOCK_MS) ? ms : MAX_ESPERA_LOCK_MS;
+
+        if (!formato_ok) {
+            salida_texto(out, "ERROR: Formato BEGIN invalido. Use BEGIN TRANSACTION [WAIT ms].\n");
+        } else if (c->transaccion_activa) {
+            salida_texto(out, "ERROR: Ya hay una transaccion activa en esta conexion.\n");
+        } else if (!(c->transaccion = transaccion_nueva(espera))) {
+            salida_texto(out, "ERROR: Memoria insuficiente.\n");
+        } else {
+            c->transaccion_activa = 1;
+            salida_texto(out, "OK: Transaccion iniciada.\n");
+        }
+    }
+    else if (strncmp(command, "COMMIT TRANSACTION", 18) == 0) {
+        if (c->transaccion_activa) {
+            // Escribe el WAL y aplica los cambios: corre en un trabajador
+            int success;
+            salida_texto(out, confirmar_transaccion(c->transaccion->escrituras, &success));
+            if (success) transaccion_terminar(c);
+        } else {
+            salida_texto(out, "ERROR: No hay transaccion activa para hacer COMMIT.\n");
+        }
+    }
+    else if (strncmp(command, "ROLLBACK", 8) == 0) {
+        // Los cambios nunca llegaron a la tabla ni al WAL: basta con descartarlos
+        if (c->transaccion_activa) {
+            char msg[96];
+            snprintf(msg, sizeof(msg), "OK: Transaccion revertida. %zu cambios descartados.\n",
+                     escrituras_cantidad(c->transaccion->escrituras));
+            transaccion_terminar(c);
+            salida_texto(out, msg);
+        } else {
+            salida_texto(out, "ERROR: No hay transaccion activa para hacer ROLLBACK.\n");
+        }
+    }
+
+    // --- 2. Modificaciones (DML) ---
+    else if (strncmp(command, "INSERT", 6) == 0 || strncmp(command, "UPDATE", 6) == 0 || strncmp(command, "DELETE", 6) == 0) {
+        if (!c->transaccion_activa) {
+            salida_texto(out, "ERROR: Las modificaciones requieren BEGIN TRANSACTION.\n");
+        } else {
+            perform_modification(command, c->transaccion, out);
+        }
+    }
+
+    else if (strncmp(command, "IMPORT CSV", 10) == 0) {
+        // IMPORT reemplaza la tabla en el acto y no se puede deshacer: dentro de una transacción
+        // un ROLLBACK no lo desharía, así que sólo se acepta fuera de ellas. Corre como una
+        // transacción propia con el lock exclusivo de la tabla mientras dura la carga.
+        if (c->transaccion_activa) {
+            salida_texto(out, "ERROR: IMPORT CSV reemplaza la tabla en el momento y no se puede deshacer. Haga COMMIT o ROLLBACK primero.\n");
+        } else if (!(c->transaccion = transaccion_nueva(espera_lock_ms))) {
+            salida_texto(out, "ERROR: Memoria insuficiente.\n");
+        } else {
+            c->transaccion_activa = 1;
+            int success;
+            int rc = transaccion_bloquear_tabla(c->transaccion, 1);
+            if (rc == LOCK_MORIR) {
+                // Es la más nueva: no espera a las transacciones con cambios pendientes
+                metricas_sumar(&metricas.conflictos_lock, 1);
+                salida_texto(out, "ERROR: Hay transacciones con cambios sin confirmar. Reintente IMPORT CSV luego de su COMMIT.\n");
+            } else if (rc != LOCK_OK) {
+                salida_entregar(out, transaccion_error_lock(c->transaccion, rc));
+            } else {
+                salida_entregar(out, import_csv(command, &success));
+            }
+            transaccion_terminar(c);
+        }
+    }
+
+    else if (strncmp(command, "BATCH", 5) == 0) {
+        // Sin transacción abierta el lote es una transacción propia: un solo COMMIT al final
+        // (una escritura del WAL). Dentro de una transacción se suma a ella, entero o nada.
+        int implicita = !c->transaccion_activa;
+        if (implicita && !(c->transaccion = transaccion_nueva(espera_lock_ms))) {
+            salida_texto(out, "ERROR: Memoria insuficiente.\n");
+        } else {
+            c->transaccion_activa = 1;
+            size_t sentencias = 0, conteo[3] = { 0, 0, 0 };
+            char *response = ejecutar_lote(command, c->transaccion, &sentencias, conteo);
+            if (!response && implicita) {
+                int confirmada;
+                const char *confirmacion = confirmar_transaccion(c->transaccion->escrituras, &confirmada);
+                if (!confirmada) salida_texto(out, confirmacion);
+            }
+            if (implicita) transaccion_terminar(c);
+            if (response) {
+                salida_entregar(out, response);
+            } else if (out->len == 0) {
+                char ok[160];
+                snprintf(ok, sizeof(ok), "OK: Lote de %zu sentencias %s: %zu filas insertadas, %zu actualizadas, %zu eliminadas.\n",
+                         sentencias, implicita ? "confirmado" : "aplicado a la transaccion", conteo[0], conteo[1], conteo[2]);
+                salida_texto(out, ok);
+            }
+        }
+    }
+
+    // --- 3. Consultas (SELECT / EXPORT CSV) ---
+    else if (strncmp(command, "SELECT", 6) == 0 || strncmp(command, "EXPORT CSV", 10) == 0) {
+        // Las consultas no esperan a las transacciones: leen los datos confirmados y,
+        // dentro de una transacción, también sus propios cambios. EXPORT vuelca sólo lo confirmado.
+        int success;
+        Flujo *flujo = NULL;
+        size_t antes = out->len;
+        if (strncmp(command, "EXPORT", 6) == 0) {
+            salida_entregar(out, export_csv(command, &success));
+        } else {
+            success = execute_query(command, c->transaccion, out, &flujo);
+        }
+
+        if (flujo) {
+            // Sin ORDER BY el resultado sale por trozos de una instantánea de la tabla:
+            // éste es el primero y el reactor pide los demás a medida que se envían
+            c->flujo = flujo;
+            conexion_continuar_flujo(c, out);
+        } else if (!c->tramas && es_select_all_simple(command) && success && out->len - antes > 3000) {
+            // El reactor envía la respuesta a medida que el socket tiene lugar (sin pausas entre trozos);
+            // las respuestas largas de SELECT ALL siguen cerrando con el marcador que espera el cliente
+            // (con tramas el largo ya delimita la respuesta)
+            salida_texto(out, "\n---END---\n");
+        }
+    }
+    // --- 4. Cursores: el resultado se pide de a n filas ---
+    else if (strncmp(command, "DECLARE", 7) == 0 || strncmp(command, "FETCH", 5) == 0 || strncmp(command, "CLOSE", 5) == 0) {
+        comando_cursor(c, command, out);
+    }
+    // --- 4b. Sentencias preparadas: se parsean una vez y se ejecutan con parámetros ---
+    else if (strncmp(command, "PREPARE", 7) == 0 || strncmp(command, "EXECUTE", 7) == 0 || strncmp(command, "DEALLOCATE", 10) == 0) {
+        comando_preparada(c, command, out);
+    }
+    // --- 5. Estadísticas (compactación, caché, STATS, TRACE) y checkpoint manual ---
+    else if (strncmp(command, "SHOW COMPACTION", 15) == 0 || strncmp(command, "CHECKPOINT", 10) == 0) {
+        if (strncmp(command, "CHECKPOINT", 10) == 0 && ejecutar_compactacion(0) < 0) {
+            salida_texto(out, "ERROR: No se pudo completar el checkpoint.\n");
+        } else {
+            char *reporte = compactacion_reporte();
+            if (reporte) {
+                salida_entregar(out, reporte);
+            } else {
+                salida_texto(out, "ERROR: Memoria insuficiente.\n");
+            }
+        }
+    }
+    else if (strncmp(command, "SHOW CACHE", 10) == 0) {
+        cache_reporte(out);
+    }
+    else if (strncmp(command, "STATS", 5) == 0) {
+        metricas_reporte(out);
+    }
+    else if (strncmp(command, "TRACE", 5) == 0) {
+        comando_traza(command, out);
+    }
+    // --- 6. Protocolo de la conexión ---
+    else if (strncmp(command, "PROTOCOL", 8) == 0) {
+        // La respuesta sale en el modo en que llegó el pedido; los siguientes usan el nuevo
+        if (strcmp(command, "PROTOCOL FRAMED") == 0) {
+            c->tramas = 1;
+            salida_texto(out, "OK: Protocolo con tramas activado.\n");
+        } else if (strcmp(command, "PROTOCOL TEXT") == 0) {
+            c->tramas = 0;
+            salida_texto(out, "OK: Protocolo de texto activado.\n");
+        } else {
+            salida_texto(out, "ERROR: Use PROTOCOL FRAMED o PROTOCOL TEXT.\n");
+        }
+    }
+    // --- 7. Comando HELP ---
+    else if (strncmp(command, "HELP", 4) == 0) {
+        salida_texto(out, mostrar_ayuda_detallada());
+    }
+
+    // --- 8. Comando no reconocido - Mostrar ayuda automáticamente ---
+    else {
+        // Se repite el comando (recortado) y sigue la ayuda fija, sin armar un mensaje aparte
+        size_t largo = strlen(command);
+        salida_texto(out, "ERROR: Comando no reconocido: '");
+        salida_agregar(out, command, largo < MAX_ECO_COMANDO ? largo : MAX_ECO_COMANDO);
+        salida_texto(out, largo < MAX_ECO_COMANDO ? "'\n\n" : "...'\n\n");
+        salida_texto(out, mostrar_ayuda_detallada());
+    }
+
+    // Perdió un conflicto de locks (wait-die): se descartan sus cambios y se sueltan sus locks
+    if (c->transaccion && c->transaccion->abortada) {
+        printf("[SERVIDOR] Transaccion del socket %d abortada por conflicto de locks.\n", socket_cliente);
+        transaccion_terminar(c);
+    }
+}
+
+// --- MAIN
+int main(int argc, char *argv[]) {
+    char ip[16] = "127.0.0.1";
+    int puerto = DEFAULT_PORT;
+    int config_max_clientes = MAX_CLIENTS;
+    int config_backlog = BACKLOG_QUEUE;
+
+    load_config(ip, &puerto, &config_max_clientes, &config_backlog);
+
+    // Modo benchmark del parser CSV: no levanta el servidor
+    if (argc >= 3 && strcmp(argv[1], "--bench-csv") == 0) {
+        return bench_csv(argv[2], argc >= 4 && atoi(argv[3]) > 0 ? atoi(argv[3]) : 3);
+    }
+
+    // Validación de parámetros (como antes)
+    if (argc == 2) {
+        fprintf(stderr, "ERROR: Parámetros incorrectos.\n");
+        fprintf(stderr, "Se esperan 0, 2 o 4 parámetros, pero se proporcionó 1.\n\n");
+        fprintf(stderr, "USO CORRECTO:\n");
+        fprintf(stderr, "  %s                           - Valores por defecto\n", argv[0]);
+        fprintf(stderr, "  %s N M                       - Configurar clientes concurrentes y backlog\n", argv[0]);
+        fprintf(stderr, "  %s IP PUERTO N M             - Configurar IP, puerto, clientes y backlog\n", argv[0]);
+        exit(EXIT_FAILURE);
+    } else if (argc > 5) {
+        fprintf(stderr, "ERROR: Demasiados parámetros.\n");
+        fprintf(stderr, "Se proporcionaron %d parámetros, pero el máximo es 4.\n\n", argc - 1);
+        fprintf(stderr, "USO CORRECTO:\n");
+        fprintf(stderr, "  %s                           - Valores por defecto\n", argv[0]);
+        fprintf(stderr, "  %s N M                       - Configurar clientes concurrentes y backlog\n", argv[0]);
+        fprintf(stderr, "  %s IP PUERTO N M             - Configurar IP, puerto, clientes y backlog\n", argv[0]);
+        exit(EXIT_FAILURE);
+    } else if (argc == 3) {
+        config_max_clientes = atoi(argv[1]);
+        config_backlog = atoi(argv[2]);
+        if (config_max_clientes <= 0) {
+            fprintf(stderr, "ERROR: N (clientes concurrentes) debe ser mayor que 0. Valor recibido: %d\n", config_max_clientes);
+            exit(EXIT_FAILURE);
+        }
+        if (config_backlog < 0) {
+            fprintf(stderr, "ERROR: M (backlog) debe ser mayor o igual a 0. Valor recibido: %d\n", config_backlog);
+            exit(EXIT_FAILURE);
+        }
+    } else if (argc == 5) {
+        strncpy(ip, argv[1], sizeof(ip) - 1);
+        ip[sizeof(ip) - 1] = '\0';
+        puerto = atoi(argv[2]);
+        config_max_clientes = atoi(argv[3]);
+        config_backlog = atoi(argv[4]);
+        if (strlen(ip) == 0) { fprintf(stderr, "ERROR: Dirección IP vacía.\n"); exit(EXIT_FAILURE); }
         if (puerto <= 0 || puerto > 65535) { fprintf(stderr, "ERROR: Puerto inválido: %d. Debe estar entre 1 y 65535.\n", puerto); exit(EXIT_FAILURE); }
         if (config_max_clientes <= 0) { fprintf(stderr, "ERROR: N (clientes concurrentes) debe ser mayor que 0. Valor recibido: %d\n", config_max_clientes); exit(EXIT_FAILURE); }
         if (config_backlog < 0) { fprintf(stderr, "ERROR: M (backlog) debe ser mayor o igual a 0. Valor recibido: %d\n", config_backlog); exit(EXIT_FAILURE); }
     }
 
 
-    // Inicialización de mutexes
-    pthread_mutex_init(&mutex_clientes, NULL);
-    pthread_mutex_init(&mutex_estado_bloqueo, NULL);
-    pthread_cond_init(&condicion_clientes, NULL);
-    memset(sockets_clientes, 0, sizeof(sockets_clientes));
+    // Cargar la tabla en memoria (CSV base + WAL) antes de aceptar clientes
+    if (!cargar_base_de_datos()) exit(EXIT_FAILURE);
+
+    // Manejo de señales: evitar caídas por SIGPIPE y limpieza en SIGINT/SIGTERM
+    evento_terminar = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (evento_terminar < 0) { perror("eventfd"); exit(EXIT_FAILURE); }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_termination_signal);
+    signal(SIGTERM, handle_termination_signal);
+
+    // Registrar limpieza en salida normal
+    atexit(cleanup_resources);
+
+    ajustar_limite_descriptores(config_max_clientes);
+
+    // Hilos de E/S: cada uno acepta y atiende miles de conexiones con su propio epoll y su
+    // propio socket de escucha (SO_REUSEPORT); los comandos los ejecuta el pool
+    long nucleos = sysconf(_SC_NPROCESSORS_ONLN);
+    int hilos_red = (int)config_entero_env("MICRODB_HILOS_RED", nucleos > 0 ? nucleos : 1, 1);
+    if (hilos_red > MAX_HILOS_RED) hilos_red = MAX_HILOS_RED;
+    int hilos_trabajo = (int)config_entero_env("MICRODB_HILOS_TRABAJO", nucleos > MIN_HILOS_TRABAJO ? nucleos : MIN_HILOS_TRABAJO,
+                                               MIN_HILOS_TRABAJO);
+    if (hilos_trabajo > MAX_HILOS_TRABAJO) hilos_trabajo = MAX_HILOS_TRABAJO;
+    int fijar_nucleos = (int)config_entero_env("MICRODB_FIJAR_NUCLEOS", 1, 0);
+    espera_lock_ms = config_entero_env("MICRODB_ESPERA_LOCK_MS", espera_lock_ms, 0);
+    if (espera_lock_ms > MAX_ESPERA_LOCK_MS) espera_lock_ms = MAX_ESPERA_LOCK_MS;
+    duracion_max_tx_ms = config_entero_env("MICRODB_DURACION_MAX_TX_MS", duracion_max_tx_ms, 0);
+    max_clientes_config = config_max_clientes;
+    int puerto_metricas = (int)config_entero_env("MICRODB_PUERTO_METRICAS", 0, 0);
+    metricas.inicio_ns = reloj_ns();
+    traza_activa = config_entero_env("MICRODB_TRAZA", 0, 0) > 0;
+
+    int escuchas[MAX_HILOS_RED];
+    int reuseport = 1;
+    int num_escuchas = 0;
+    while (num_escuchas < (reuseport ? hilos_red : 1)) {
+        int s = crear_socket_escucha(ip, puerto, config_backlog, &reuseport);
+        if (s < 0) {
+            while (num_escuchas > 0) close(escuchas[--num_escuchas]);
+            exit(EXIT_FAILURE);
+        }
+        escuchas[num_escuchas++] = s;
+    }
+
+    if (!iniciar_trabajadores(hilos_trabajo) || !iniciar_reactores(hilos_red, escuchas, !reuseport, fijar_nucleos)) {
+        detener_reactores();
+        exit(EXIT_FAILURE);
+    }
+    if (puerto_metricas > 0 && !iniciar_metricas(puerto_metricas)) {
+        printf("[SERVIDOR] ADVERTENCIA: No se pudo abrir el puerto de metricas %d; siguen disponibles con STATS.\n", puerto_metricas);
+    }
+
+    printf("Servidor Micro DB escuchando en %s:%d. Max concurrentes (N): %d, Backlog (M): %d, Hilos de E/S: %d (%s), Trabajadores: %d.\n",
+           ip, puerto, config_max_clientes, config_backlog, num_reactores,
+           reuseport ? "SO_REUSEPORT" : "socket compartido", num_trabajadores);
+
+    // El hilo principal sólo espera la terminación: aceptan los reactores
+    struct pollfd espera = { .fd = evento_terminar, .events = POLLIN };
+    while (!stop_requested) {
+        if (poll(&espera, 1, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+    }
+
+    // Salimos del while principal => stop_requested o error terminal
+    printf("[Servidor] Señal de terminación recibida o error. Limpiando recursos...\n");
+    detener_reactores();
+    detener_metricas();
+    cleanup_resources();
+    return 0;
+}
+
+// --- SIMULACIÓN DE LÓGICA DE BD (implementación incompleta por brevedad)
+
+typedef struct {
+    int id;
+    char producto[128];
+    int cantidad;
+    double precio;
+} Registro;
+
+static void rtrim(char *s) {
+    size_t n = strlen(s);
+    while (n > 0 && (s[n-1] == '\n' || s[n-1] == '\r' || s[n-1] == ' ' || s[n-1] == '\t')) {
+        s[n-1] = '\0';
+        n--;
+    }
+}
+
+static void ltrim_inplace(char **ps) {
+    while (**ps == ' ' || **ps == '\t') (*ps)++;
+}
+
+// --- Parser CSV de una pasada
+//
+// Recorre el buffer (normalmente el archivo mapeado con mmap) una sola vez: las
+// posiciones de ';' y '\n' salen de máscaras de bits calculadas de a 32 bytes con
+// AVX2 o SSE2 (o un bucle escalar en otras arquitecturas) y cada campo se convierte
+// en cuanto se cierra, sin copiar la línea ni llamar a strtok/atoi/atof.
+// El precio se convierte directo a centavos (redondeando el tercer decimal).
+
+typedef struct {
+    int32_t id;
+    int32_t cantidad;
+    int64_t precio;        // centavos
+    const char *producto;  // apunta dentro del buffer, sin '\0'
+    size_t largo_producto;
+} FilaCsv;
+
+// Devuelve 0 para cortar el recorrido
+typedef int (*CsvFilaFn)(void *ctx, const FilaCsv *fila);
+
+#define CSV_BLOQUE 32
+
+// Bit i encendido si p[i] es ';' o '\n'
+static uint32_t csv_mascara_bloque(const char *p) {
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i d = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    return (uint32_t)_mm256_movemask_epi8(d);
+#elif defined(__SSE2__)
+    const __m128i pc = _mm_set1_epi8(';'), nl = _mm_set1_epi8('\n');
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    uint32_t ma = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(a, pc), _mm_cmpeq_epi8(a, nl)));
+    uint32_t mb = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, pc), _mm_cmpeq_epi8(b, nl)));
+    return ma | (mb << 16);
+#else
+    uint32_t m = 0;
+    for (int i = 0; i < CSV_BLOQUE; i++) {
+        if (p[i] == ';' || p[i] == '\n') m |= 1u << i;
+    }
+    return m;
+#endif
+}
+
+static uint32_t csv_mascara_resto(const char *p, size_t n) {
+    uint32_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == ';' || p[i] == '\n') m |= 1u << i;
+    }
+    return m;
+}
+
+static void csv_recortar(const char **p, const char **fin) {
+    while (*p < *fin && (**p == ' ' || **p == '\t')) (*p)++;
+    while (*fin > *p && ((*fin)[-1] == ' ' || (*fin)[-1] == '\t' || (*fin)[-1] == '\r')) (*fin)--;
+}
+
+static int csv_entero(const char *p, const char *fin, int32_t *out) {
+    csv_recortar(&p, &fin);
+    int negativo = 0;
+    if (p < fin && (*p == '-' || *p == '+')) negativo = (*p++ == '-');
+    if (p == fin) return 0;
+    int64_t v = 0;
+    for (; p < fin; p++) {
+        unsigned d = (unsigned)(*p - '0');
+        if (d > 9) return 0;
+        v = v * 10 + d;
+        if (v > (int64_t)INT32_MAX + negativo) return 0;
+    }
+    *out = (int32_t)(negativo ? -v : v);
+    return 1;
+}
+
+static int csv_centavos(const char *p, const char *fin, int64_t *out) {
+    csv_recortar(&p, &fin);
+    int negativo = 0;
+    if (p < fin && (*p == '-' || *p == '+')) negativo = (*p++ == '-');
+    int64_t enteros = 0;
+    int digitos = 0;
+    for (; p < fin && *p != '.'; p++, digitos++) {
+        unsigned d = (unsigned)(*p - '0');
+        if (d > 9 || enteros > INT64_MAX / 1000) return 0;
+        enteros = enteros * 10 + d;
+    }
+    int64_t decimales = 0;
+    int leidos = 0, redondeo = 0;
+    if (p < fin) {
+        for (p++; p < fin; p++, digitos++) {
+            unsigned d = (unsigned)(*p - '0');
+            if (d > 9) return 0;
+            if (leidos < 2) decimales = decimales * 10 + d;
+            else if (leidos == 2) redondeo = d >= 5;
+            leidos++;
+        }
+    }
+    if (digitos == 0) return 0;
+    if (leidos < 2) decimales *= (leidos == 0) ? 100 : 10;
+    int64_t v = enteros * 100 + decimales + redondeo;
+    *out = negativo ? -v : v;
+    return 1;
+}
+
+// campos[i] = [inicio, fin) de cada campo de la línea. Devuelve 1 si es una fila,
+// 0 si es vacía o la cabecera y -1 si es inválida.
+static int csv_convertir_linea(const char *const *inicio, const char *const *fin, int num_campos, FilaCsv *f) {
+    if (num_campos == 1) {
+        const char *p = inicio[0], *q = fin[0];
+        csv_recortar(&p, &q);
+        if (p == q) return 0;
+    }
+    if (num_campos != 4) return -1;
+    if (fin[0] - inicio[0] == 2 && inicio[0][0] == 'I' && inicio[0][1] == 'D') return 0; // cabecera
+    if (!csv_entero(inicio[0], fin[0], &f->id)) return -1;
+    if (!csv_entero(inicio[2], fin[2], &f->cantidad)) return -1;
+    if (!csv_centavos(inicio[3], fin[3], &f->precio)) return -1;
+    f->producto = inicio[1];
+    f->largo_producto = (size_t)(fin[1] - inicio[1]);
+    // Mismo límite que Registro.producto (y que el WAL)
+    if (f->largo_producto == 0 || f->largo_producto >= sizeof(((Registro *)0)->producto)) return -1;
+    return 1;
+}
+
+// Llama a 'fn' por cada fila válida de buf[0, n). Devuelve la cantidad de líneas inválidas.
+static long csv_recorrer(const char *buf, size_t n, CsvFilaFn fn, void *ctx) {
+    const char *inicio[4], *fin[4];
+    const char *campo = buf;
+    int num_campos = 0;
+    long invalidas = 0;
+    FilaCsv f;
+    for (size_t base = 0; base < n; base += CSV_BLOQUE) {
+        uint32_t m = (n - base >= CSV_BLOQUE) ? csv_mascara_bloque(buf + base)
+                                              : csv_mascara_resto(buf + base, n - base);
+        while (m) {
+            const char *d = buf + base + __builtin_ctz(m);
+            m &= m - 1;
+            if (num_campos < 4) { inicio[num_campos] = campo; fin[num_campos] = d; }
+            num_campos++;
+            campo = d + 1;
+            if (*d != '\n') continue;
+            int r = csv_convertir_linea(inicio, fin, num_campos, &f);
+            num_campos = 0;
+            if (r < 0) invalidas++;
+            else if (r > 0 && !fn(ctx, &f)) return invalidas;
+        }
+    }
+    // Última línea sin '\n' final
+    if (campo < buf + n || num_campos > 0) {
+        if (num_campos < 4) { inicio[num_campos] = campo; fin[num_campos] = buf + n; }
+        num_campos++;
+        int r = csv_convertir_linea(inicio, fin, num_campos, &f);
+        if (r < 0) invalidas++;
+        else if (r > 0) fn(ctx, &f);
+    }
+    return invalidas;
+}
+
+// Mapea el archivo completo en modo lectura; NULL si no existe o no se puede leer.
+// Un archivo vacío devuelve un puntero no nulo con *bytes = 0.
+static const char *csv_mapear(const char *path, size_t *bytes) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) { close(fd); return NULL; }
+    *bytes = (size_t)st.st_size;
+    if (*bytes == 0) { close(fd); return ""; }
+    void *p = mmap(NULL, *bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    madvise(p, *bytes, MADV_SEQUENTIAL);
+    return (const char *)p;
+}
+
+static void csv_desmapear(const char *datos, size_t bytes) {
+    if (bytes > 0) munmap((void *)datos, bytes);
+}
+
+void load_config(char *ip, int *puerto, int *max_clientes, int *backlog) {
+    strcpy(ip, "127.0.0.1");
+    *puerto = 8080;
+    *max_clientes = MAX_CLIENTS;
+    *backlog = BACKLOG_QUEUE;
+}
+
+static int write_full(int fd, const void *datos, size_t n) {
+    const char *p = (const char *)datos;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += w; n -= (size_t)w;
+    }
+    return 1;
+}
+
+// --- Almacenamiento paginado
+//
+// Formato nativo de DB_FILE_NAME (enteros en el orden de bytes de la máquina):
+//   página 0      : CabeceraArchivo (resto de la página en cero)
+//   páginas 1..N  : Pagina = cabecera de CABECERA_PAGINA bytes + FILAS_POR_PAGINA slots FilaDisco
+//   al final      : diccionario de productos, [u16 largo][bytes] por código y en orden
+// Las filas guardan el producto como código del diccionario y el precio en centavos,
+// así que leerlas no requiere parsear texto y un UPDATE reescribe el slot en su lugar.
+// Todas las páginas salvo la última están llenas, de modo que el slot global s vive
+// en la página s / FILAS_POR_PAGINA.
+//
+// La cabecera de cada página lleva un zone map (mínimo y máximo de ID, Cantidad y
+// Precio) y un filtro de Bloom de 128 bits sobre el código de Producto: SELECT WHERE
+// descarta las páginas que no pueden contener filas que cumplan el filtro.
+// Las cotas sólo se amplían con INSERT/UPDATE (un DELETE no las achica); se vuelven
+// exactas cuando la compactación reescribe la página.
+//
+// Al arrancar el archivo se mapea con mmap(MAP_PRIVATE) y sus páginas pasan a ser
+// la tabla en memoria: las modificaciones quedan en copias privadas del proceso y el
+// archivo sólo cambia cuando la compactación escribe uno nuevo y lo instala con rename.
+// El CSV queda como formato de intercambio (IMPORT CSV / EXPORT CSV).
+
+#define DB_MAGIA "MICRODB1"
+#define DB_VERSION 2 // 2: zone maps en la cabecera de página (la versión 1 se lee y se recalcula)
+#define TAM_PAGINA 4096
+#define CABECERA_PAGINA 64
+#define FILA_VIVA 0x1u
+
+typedef struct {
+    int32_t id;
+    uint32_t producto; // código en el diccionario
+    int32_t cantidad;
+    uint32_t flags;    // FILA_VIVA
+    int64_t precio;    // centavos
+} FilaDisco;
+
+#define FILAS_POR_PAGINA ((TAM_PAGINA - CABECERA_PAGINA) / sizeof(FilaDisco))
+
+typedef struct {
+    uint32_t num_filas; // slots usados, incluidos los borrados
+    uint32_t num_vivas;
+    int32_t min_id, max_id; // zone map: en una página vacía min > max
+    int32_t min_cantidad, max_cantidad;
+    int64_t min_precio, max_precio;
+    uint64_t bloom_producto[2];
+    uint64_t epoca;     // época de instantáneas en que se creó en memoria (0 en el archivo)
+    FilaDisco filas[FILAS_POR_PAGINA];
+} Pagina;
+
+// Falla la compilación si Pagina no ocupa exactamente una página
+typedef char pagina_ocupa_tam_pagina[(sizeof(Pagina) == TAM_PAGINA) ? 1 : -1];
+
+typedef struct {
+    char magia[8];
+    uint32_t version;
+    uint32_t tam_pagina;
+    uint64_t num_paginas;        // páginas de datos, sin contar la cabecera
+    uint64_t num_filas;          // filas vigentes
+    uint64_t lsn;                // último registro del WAL ya incluido en el archivo
+    uint64_t offset_diccionario;
+    uint64_t bytes_diccionario;
+    uint32_t num_productos;
+    uint32_t crc;                // CRC32 de los campos anteriores
+} CabeceraArchivo;
+
+typedef struct {
+    char **nombres;   // código -> nombre; los nombres no cambian una vez agregados
+    uint32_t num, cap;
+    uint32_t *hash;   // nombre -> código + 1 (0 = vacío), sondeo lineal
+    size_t cap_hash;  // potencia de 2
+} Diccionario;
+
+typedef struct {
+    int id;
+    long slot; // -1 = entrada vacía
+} EntradaIndice;
+
+typedef struct {
+    Pagina **paginas;
+    size_t num_paginas, cap_paginas;
+    size_t num_filas;        // slots usados en todas las páginas (incluye filas borradas)
+    size_t num_vivas;
+    EntradaIndice *indice;   // direccionamiento abierto con sondeo lineal: ID -> slot
+    size_t indice_capacidad; // siempre potencia de 2
+    size_t indice_usadas;
+    Diccionario dic;
+    void *mapa;              // mmap del archivo base (NULL si todas las páginas son de heap)
+    size_t mapa_bytes;
+} Tabla;
+
+static Tabla tabla;
+static pthread_rwlock_t rwlock_tabla = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t epoca_tabla = 1;      // ver "Instantáneas de la tabla"; acceso con __atomic
+static uint64_t epoca_max_activa = 0; // época de la instantánea activa más nueva (0 = ninguna)
+static uint64_t version_tabla = 1;    // ver "Caché de resultados": sube con cada cambio confirmado; acceso con __atomic
+
+static FilaDisco *tabla_fila(const Tabla *t, size_t slot) {
+    return &t->paginas[slot / FILAS_POR_PAGINA]->filas[slot % FILAS_POR_PAGINA];
+}
+
+static uint32_t hash_texto(const char *s, size_t largo) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < largo; i++) { h ^= (uint8_t)s[i]; h *= 16777619u; }
+    return h;
+}
+
+// 'nombre' no necesita terminar en '\0' (el parser CSV pasa punteros al buffer mapeado)
+static long diccionario_buscar(const Diccionario *d, const char *nombre, size_t largo) {
+    if (d->cap_hash == 0) return -1;
+    size_t mascara = d->cap_hash - 1;
+    for (size_t i = hash_texto(nombre, largo) & mascara; d->hash[i] != 0; i = (i + 1) & mascara) {
+        const char *n = d->nombres[d->hash[i] - 1];
+        if (strncmp(n, nombre, largo) == 0 && n[largo] == '\0') return (long)(d->hash[i] - 1);
+    }
+    return -1;
+}
+
+// Devuelve el código del producto, agregándolo si no existía; -1 sin memoria
+static long diccionario_agregar(Diccionario *d, const char *nombre, size_t largo) {
+    long codigo = diccionario_buscar(d, nombre, largo);
+    if (codigo >= 0) return codigo;
+    if ((d->num + 1) * 10 > d->cap_hash * 7) {
+        size_t nueva = d->cap_hash ? d->cap_hash * 2 : 256;
+        uint32_t *hash = (uint32_t *)calloc(nueva, sizeof(uint32_t));
+        if (!hash) return -1;
+        for (uint32_t c = 0; c < d->num; c++) {
+            size_t i = hash_texto(d->nombres[c], strlen(d->nombres[c])) & (nueva - 1);
+            while (hash[i] != 0) i = (i + 1) & (nueva - 1);
+            hash[i] = c + 1;
+        }
+        free(d->hash);
+        d->hash = hash;
+        d->cap_hash = nueva;
+    }
+    if (d->num == d->cap) {
+        uint32_t nueva = d->cap ? d->cap * 2 : 64;
+        char **nombres = (char **)realloc(d->nombres, nueva * sizeof(char *));
+        if (!nombres) return -1;
+        d->nombres = nombres;
+        d->cap = nueva;
+    }
+    char *copia = (char *)malloc(largo + 1);
+    if (!copia) return -1;
+    memcpy(copia, nombre, largo);
+    copia[largo] = '\0';
+    d->nombres[d->num] = copia;
+    size_t i = hash_texto(nombre, largo) & (d->cap_hash - 1);
+    while (d->hash[i] != 0) i = (i + 1) & (d->cap_hash - 1);
+    d->hash[i] = d->num + 1;
+    return (long)d->num++;
+}
+
+// Serializa el diccionario con el formato de disco: [u16 largo][bytes] por código
+static uint8_t *diccionario_serializar(const Diccionario *d, size_t *bytes) {
+    size_t total = 0;
+    for (uint32_t c = 0; c < d->num; c++) total += 2 + strlen(d->nombres[c]);
+    uint8_t *buf = (uint8_t *)malloc(total ? total : 1);
+    if (!buf) return NULL;
+    uint8_t *p = buf;
+    for (uint32_t c = 0; c < d->num; c++) {
+        uint16_t largo = (uint16_t)strlen(d->nombres[c]);
+        memcpy(p, &largo, 2); p += 2;
+        memcpy(p, d->nombres[c], largo); p += largo;
+    }
+    *bytes = total;
+    return buf;
+}
+
+static void diccionario_liberar(Diccionario *d) {
+    for (uint32_t c = 0; c < d->num; c++) free(d->nombres[c]);
+    free(d->nombres);
+    free(d->hash);
+    memset(d, 0, sizeof(*d));
+}
+
+static size_t indice_hash(int id, size_t capacidad) {
+    return ((uint32_t)id * 2654435761u) & (capacidad - 1);
+}
+
+static long indice_buscar(const Tabla *t, int id) {
+    if (t->indice_capacidad == 0) return -1;
+    size_t mascara = t->indice_capacidad - 1;
+    for (size_t i = indice_hash(id, t->indice_capacidad); t->indice[i].slot >= 0; i = (i + 1) & mascara) {
+        if (t->indice[i].id == id) return t->indice[i].slot;
+    }
+    return -1;
+}
+
+static int indice_redimensionar(Tabla *t, size_t nueva_capacidad) {
+    EntradaIndice *nuevo = (EntradaIndice *)malloc(nueva_capacidad * sizeof(EntradaIndice));
+    if (!nuevo) return 0;
+    for (size_t i = 0; i < nueva_capacidad; i++) nuevo[i].slot = -1;
+    size_t mascara = nueva_capacidad - 1;
+    for (size_t i = 0; i < t->indice_capacidad; i++) {
+        if (t->indice[i].slot < 0) continue;
+        size_t j = indice_hash(t->indice[i].id, nueva_capacidad);
+        while (nuevo[j].slot >= 0) j = (j + 1) & mascara;
+        nuevo[j] = t->indice[i];
+    }
+    free(t->indice);
+    t->indice = nuevo;
+    t->indice_capacidad = nueva_capacidad;
+    return 1;
+}
+
+static int indice_insertar(Tabla *t, int id, long slot) {
+    // Factor de carga máximo 0.7
+    if ((t->indice_usadas + 1) * 10 > t->indice_capacidad * 7) {
+        if (!indice_redimensionar(t, t->indice_capacidad ? t->indice_capacidad * 2 : 1024)) return 0;
+    }
+    size_t mascara = t->indice_capacidad - 1;
+    size_t i = indice_hash(id, t->indice_capacidad);
+    while (t->indice[i].slot >= 0) {
+        if (t->indice[i].id == id) { t->indice[i].slot = slot; return 1; }
+        i = (i + 1) & mascara;
+    }
+    t->indice[i].id = id;
+    t->indice[i].slot = slot;
+    t->indice_usadas++;
+    return 1;
+}
+
+static void indice_eliminar(Tabla *t, int id) {
+    if (t->indice_capacidad == 0) return;
+    size_t mascara = t->indice_capacidad - 1;
+    size_t i = indice_hash(id, t->indice_capacidad);
+    while (t->indice[i].slot >= 0 && t->indice[i].id != id) i = (i + 1) & mascara;
+    if (t->indice[i].slot < 0) return;
+    // Borrado con desplazamiento hacia atrás: no deja lápidas en el índice
+    size_t j = i;
+    while (1) {
+        t->indice[i].slot = -1;
+        size_t k;
+        do {
+            j = (j + 1) & mascara;
+            if (t->indice[j].slot < 0) { t->indice_usadas--; return; }
+            k = indice_hash(t->indice[j].id, t->indice_capacidad);
+        } while ((i <= j) ? (i < k && k <= j) : (i < k || k <= j));
+        t->indice[i] = t->indice[j];
+        i = j;
+    }
+}
+
+static int64_t precio_a_centavos(double precio) {
+    // El CSV usa dos decimales: la tabla guarda exactamente ese valor
+    return llround(precio * 100.0);
+}
+
+static void fila_a_registro(const Tabla *t, const FilaDisco *f, Registro *r) {
+    r->id = f->id;
+    strncpy(r->producto, t->dic.nombres[f->producto], sizeof(r->producto) - 1);
+    r->producto[sizeof(r->producto) - 1] = '\0';
+    r->cantidad = f->cantidad;
+    r->precio = (double)f->precio / 100.0;
+}
+
+// Formatea la fila como línea CSV; devuelve la cantidad de bytes escritos
+static int fila_to_csv(const Diccionario *d, const FilaDisco *f, char *out, size_t out_size) {
+    long long c = f->precio;
+    const char *signo = "";
+    if (c < 0) { signo = "-"; c = -c; }
+    return snprintf(out, out_size, "%d;%s;%d;%s%lld.%02lld\n", f->id, d->nombres[f->producto],
+                    f->cantidad, signo, c / 100, c % 100);
+}
+
+static void pagina_reiniciar_zona(Pagina *p) {
+    p->min_id = p->min_cantidad = INT32_MAX;
+    p->max_id = p->max_cantidad = INT32_MIN;
+    p->min_precio = INT64_MAX;
+    p->max_precio = INT64_MIN;
+    p->bloom_producto[0] = p->bloom_producto[1] = 0;
+}
+
+// Dos posiciones de bit (de 0 a 127) por código de producto
+static void bloom_posiciones(uint32_t codigo, unsigned *a, unsigned *b) {
+    *a = (codigo * 2654435761u) >> 25;
+    *b = (codigo * 2246822519u + 1u) >> 25;
+}
+
+static int bloom_contiene(const Pagina *p, uint32_t codigo) {
+    unsigned a, b;
+    bloom_posiciones(codigo, &a, &b);
+    return ((p->bloom_producto[a >> 6] >> (a & 63)) & 1) && ((p->bloom_producto[b >> 6] >> (b & 63)) & 1);
+}
+
+static void pagina_ampliar_zona(Pagina *p, const FilaDisco *f) {
+    if (f->id < p->min_id) p->min_id = f->id;
+    if (f->id > p->max_id) p->max_id = f->id;
+    if (f->cantidad < p->min_cantidad) p->min_cantidad = f->cantidad;
+    if (f->cantidad > p->max_cantidad) p->max_cantidad = f->cantidad;
+    if (f->precio < p->min_precio) p->min_precio = f->precio;
+    if (f->precio > p->max_precio) p->max_precio = f->precio;
+    unsigned a, b;
+    bloom_posiciones(f->producto, &a, &b);
+    p->bloom_producto[a >> 6] |= 1ull << (a & 63);
+    p->bloom_producto[b >> 6] |= 1ull << (b & 63);
+}
+
+// Cotas exactas a partir de las filas vivas
+static void pagina_recalcular_zona(Pagina *p) {
+    pagina_reiniciar_zona(p);
+    for (uint32_t j = 0; j < p->num_filas; j++) {
+        if (p->filas[j].flags & FILA_VIVA) pagina_ampliar_zona(p, &p->filas[j]);
+    }
+}
+
+static int pagina_es_mapeada(const Tabla *t, const Pagina *p) {
+    const char *inicio = (const char *)t->mapa;
+    return t->mapa && (const char *)p >= inicio && (const char *)p < inicio + t->mapa_bytes;
+}
+
+static Pagina *tabla_agregar_pagina(Tabla *t) {
+    if (t->num_paginas == t->cap_paginas) {
+        size_t nueva = t->cap_paginas ? t->cap_paginas * 2 : 64;
+        Pagina **paginas = (Pagina **)realloc(t->paginas, nueva * sizeof(Pagina *));
+        if (!paginas) return NULL;
+        t->paginas = paginas;
+        t->cap_paginas = nueva;
+    }
+    Pagina *p = (Pagina *)calloc(1, sizeof(Pagina));
+    if (!p) return NULL;
+    pagina_reiniciar_zona(p);
+    p->epoca = __atomic_load_n(&epoca_tabla, __ATOMIC_RELAXED);
+    t->paginas[t->num_paginas++] = p;
+    return p;
+}
+
+static void tabla_liberar(Tabla *t) {
+    for (size_t i = 0; i < t->num_paginas; i++) {
+        if (!pagina_es_mapeada(t, t->paginas[i])) free(t->paginas[i]);
+    }
+    if (t->mapa) munmap(t->mapa, t->mapa_bytes);
+    free(t->paginas);
+    free(t->indice);
+    diccionario_liberar(&t->dic);
+    memset(t, 0, sizeof(*t));
+}
+
+// --- Instantáneas de la tabla (copy-on-write por página)
+//
+// Un SELECT sin ORDER BY no arma la respuesta entera: la envía por trozos a medida que
+// el socket se vacía, leyendo de una instantánea. La instantánea copia sólo el arreglo
+// de punteros a páginas; mientras esté activa, el escritor que va a modificar una página
+// que ella ve trabaja sobre una copia (tabla_pagina_para_escribir), así que el recorrido
+// ve la tabla tal como estaba al empezar aunque entre trozos se confirmen transacciones.
+//
+// Épocas: cada instantánea nueva incrementa epoca_tabla y se queda con ese valor; cada
+// página de memoria guarda la época en que se creó. Una página es visible para alguna
+// instantánea activa si su época es menor que epoca_max_activa. Las páginas reemplazadas,
+// y las tablas enteras que reemplazan la compactación e IMPORT, se retiran con la época
+// vigente y se liberan cuando ya no queda ninguna instantánea de esa época o anterior.
+
+typedef struct Instantanea {
+    Pagina **paginas;
+    size_t num_paginas;
+    const Diccionario *dic; // nombres de producto: leer con rwlock_tabla en modo lectura
+    uint64_t epoca;
+    struct Instantanea *anterior, *siguiente;
+} Instantanea;
+
+typedef struct Retirada {
+    uint64_t epoca;
+    Pagina *pagina; // página de heap reemplazada por su copia
+    Tabla *tabla;   // tabla entera reemplazada
+    struct Retirada *siguiente;
+} Retirada;
+
+static pthread_mutex_t mutex_instantaneas = PTHREAD_MUTEX_INITIALIZER;
+static Instantanea *instantaneas = NULL; // activas, de la más nueva a la más vieja
+static Retirada *retiradas = NULL;
+
+static void retirada_liberar(Retirada *r) {
+    while (r) {
+        Retirada *sig = r->siguiente;
+        free(r->pagina);
+        if (r->tabla) { tabla_liberar(r->tabla); free(r->tabla); }
+        free(r);
+        r = sig;
+    }
+}
+
+// Llamar con rwlock_tabla tomado (alcanza en modo lectura: excluye a los escritores)
+static Instantanea *instantanea_tomar(void) {
+    Instantanea *s = (Instantanea *)calloc(1, sizeof(Instantanea));
+    if (!s) return NULL;
+    s->paginas = (Pagina **)malloc((tabla.num_paginas ? tabla.num_paginas : 1) * sizeof(Pagina *));
+    if (!s->paginas) { free(s); return NULL; }
+    if (tabla.num_paginas) memcpy(s->paginas, tabla.paginas, tabla.num_paginas * sizeof(Pagina *));
+    s->num_paginas = tabla.num_paginas;
+    s->dic = &tabla.dic;
+    pthread_mutex_lock(&mutex_instantaneas);
+    s->epoca = __atomic_add_fetch(&epoca_tabla, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&epoca_max_activa, s->epoca, __ATOMIC_RELAXED);
+    s->siguiente = instantaneas;
+    if (instantaneas) instantaneas->anterior = s;
+    instantaneas = s;
+    pthread_mutex_unlock(&mutex_instantaneas);
+    return s;
+}
+
+static void instantanea_soltar(Instantanea *s) {
+    if (!s) return;
+    Retirada *liberar = NULL;
+    pthread_mutex_lock(&mutex_instantaneas);
+    if (s->anterior) s->anterior->siguiente = s->siguiente;
+    else instantaneas = s->siguiente;
+    if (s->siguiente) s->siguiente->anterior = s->anterior;
+    uint64_t minima = UINT64_MAX;
+    for (Instantanea *i = instantaneas; i; i = i->siguiente) minima = i->epoca;
+    __atomic_store_n(&epoca_max_activa, instantaneas ? instantaneas->epoca : 0, __ATOMIC_RELAXED);
+    for (Retirada **r = &retiradas; *r; ) {
+        if ((*r)->epoca < minima) {
+            Retirada *x = *r;
+            *r = x->siguiente;
+            x->siguiente = liberar;
+            liberar = x;
+        } else {
+            r = &(*r)->siguiente;
+        }
+    }
+    pthread_mutex_unlock(&mutex_instantaneas);
+    retirada_liberar(liberar);
+    free(s->paginas);
+    free(s);
+}
+
+// Encola 'r' para liberarlo cuando lo permitan las instantáneas; 0 si ya se puede liberar
+static int retirar(Retirada *r) {
+    pthread_mutex_lock(&mutex_instantaneas);
+    int hay = (instantaneas != NULL);
+    if (hay) {
+        r->epoca = __atomic_load_n(&epoca_tabla, __ATOMIC_RELAXED);
+        r->siguiente = retiradas;
+        retiradas = r;
+    }
+    pthread_mutex_unlock(&mutex_instantaneas);
+    return hay;
+}
+
+// Devuelve la página 'pg' de 't' lista para modificarse: si es de la tabla global y
+// alguna instantánea activa la ve, la reemplaza por una copia. Llamar con rwlock_tabla
+// en modo escritura (o sin lectores posibles). NULL si no hay memoria.
+static Pagina *tabla_pagina_para_escribir(Tabla *t, size_t pg) {
+    Pagina *p = t->paginas[pg];
+    if (t != &tabla || p->epoca >= __atomic_load_n(&epoca_max_activa, __ATOMIC_RELAXED)) return p;
+    Pagina *copia = (Pagina *)malloc(sizeof(Pagina));
+    Retirada *r = (Retirada *)calloc(1, sizeof(Retirada));
+    if (!copia || !r) { free(copia); free(r); return NULL; }
+    memcpy(copia, p, sizeof(Pagina));
+    copia->epoca = __atomic_load_n(&epoca_tabla, __ATOMIC_RELAXED);
+    t->paginas[pg] = copia;
+    // Las páginas del mmap se liberan con el munmap de la tabla
+    if (!pagina_es_mapeada(t, p)) r->pagina = p;
+    if (!retirar(r)) retirada_liberar(r);
+    return copia;
+}
+
+// Saca de circulación la tabla 'vieja' que acaba de reemplazar a la global. Llamar con
+// rwlock_tabla en modo escritura. Devuelve 1 si la liberará la última instantánea que la
+// ve; con 0 la libera el que llama (después de soltar el rwlock).
+static int tabla_retirar(Tabla *vieja) {
+    Retirada *r = (Retirada *)calloc(1, sizeof(Retirada));
+    Tabla *copia = (Tabla *)malloc(sizeof(Tabla));
+    if (!r || !copia) {
+        free(r); free(copia);
+        pthread_mutex_lock(&mutex_instantaneas);
+        int hay = (instantaneas != NULL);
+        pthread_mutex_unlock(&mutex_instantaneas);
+        // Sin memoria ni para retirarla: si alguien la ve, se pierde antes que liberarla en uso
+        if (hay) fprintf(stderr, "[SERVIDOR] Sin memoria para retirar la tabla anterior; no se libera.\n");
+        return hay;
+    }
+    *copia = *vieja;
+    r->tabla = copia;
+    pthread_mutex_lock(&mutex_instantaneas);
+    int hay = (instantaneas != NULL);
+    if (hay) {
+        r->epoca = __atomic_load_n(&epoca_tabla, __ATOMIC_RELAXED);
+        r->siguiente = retiradas;
+        retiradas = r;
+        // Si el diccionario se va con la tabla vieja (IMPORT), las instantáneas lo siguen
+        if (copia->dic.nombres) {
+            for (Instantanea *i = instantaneas; i; i = i->siguiente) {
+                if (i->dic == &tabla.dic) i->dic = &copia->dic;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mutex_instantaneas);
+    if (!hay) { free(r); free(copia); }
+    return hay;
+}
+
+// Inserta o reemplaza la fila con ese ID (semántica idempotente, usada también al reaplicar el WAL).
+// El producto ya tiene que estar en el diccionario de 't'.
+static int tabla_upsert_fila(Tabla *t, const FilaDisco *fila) {
+    FilaDisco f = *fila;
+    f.flags = FILA_VIVA;
+    long slot = indice_buscar(t, f.id);
+    if (slot >= 0) {
+        Pagina *p = tabla_pagina_para_escribir(t, (size_t)slot / FILAS_POR_PAGINA);
+        if (!p) return 0;
+        p->filas[(size_t)slot % FILAS_POR_PAGINA] = f;
+        pagina_ampliar_zona(p, &f);
+        return 1;
+    }
+    Pagina *p;
+    if (t->num_paginas && t->paginas[t->num_paginas - 1]->num_filas < FILAS_POR_PAGINA) {
+        p = tabla_pagina_para_escribir(t, t->num_paginas - 1);
+    } else {
+        p = tabla_agregar_pagina(t);
+    }
+    if (!p) return 0;
+    if (!indice_insertar(t, f.id, (long)t->num_filas)) return 0;
+    p->filas[p->num_filas++] = f;
+    p->num_vivas++;
+    pagina_ampliar_zona(p, &f);
+    t->num_filas++;
+    t->num_vivas++;
+    return 1;
+}
+
+static int tabla_upsert(Tabla *t, const Registro *r) {
+    long codigo = diccionario_agregar(&t->dic, r->producto, strlen(r->producto));
+    if (codigo < 0) return 0;
+    FilaDisco f = { r->id, (uint32_t)codigo, r->cantidad, FILA_VIVA, precio_a_centavos(r->precio) };
+    return tabla_upsert_fila(t, &f);
+}
+
+// 1 si la borró, 0 si no existía, -1 sin memoria
+static int tabla_borrar(Tabla *t, int id) {
+    long slot = indice_buscar(t, id);
+    if (slot < 0) return 0;
+    Pagina *p = tabla_pagina_para_escribir(t, (size_t)slot / FILAS_POR_PAGINA);
+    if (!p) return -1;
+    p->filas[(size_t)slot % FILAS_POR_PAGINA].flags &= ~FILA_VIVA;
+    p->num_vivas--;
+    t->num_vivas--;
+    indice_eliminar(t, id);
+    return 1;
+}
+
+// --- Transacciones: cambios sin confirmar
+//
+// Los INSERT/UPDATE/DELETE de una transacción no tocan la tabla: se guardan en su
+// conjunto de escritura, con la última versión de cada fila modificada (una fila
+// sin FILA_VIVA es un borrado). Los demás clientes siguen leyendo la tabla
+// confirmada sin esperar a la transacción; las consultas del dueño ven la tabla
+// más sus propios cambios. COMMIT los escribe en el WAL y los aplica bajo un solo
+// wrlock, así que un lector ve todos los cambios de la transacción o ninguno.
+
+struct Escrituras {
+    FilaDisco *filas; // en orden de primera modificación
+    size_t num, cap;
+    uint32_t *hash;   // ID -> posición + 1 (0 = vacío), sondeo lineal
+    size_t cap_hash;  // potencia de 2
+};
+
+static Escrituras *escrituras_nueva(void) {
+    return (Escrituras *)calloc(1, sizeof(Escrituras));
+}
+
+static void escrituras_liberar(Escrituras *e) {
+    if (!e) return;
+    free(e->filas);
+    free(e->hash);
+    free(e);
+}
+
+static Escrituras *escrituras_copiar(const Escrituras *e) {
+    Escrituras *copia = escrituras_nueva();
+    if (!copia) return NULL;
+    copia->filas = (FilaDisco *)malloc((e->num ? e->num : 1) * sizeof(FilaDisco));
+    copia->hash = (uint32_t *)malloc((e->cap_hash ? e->cap_hash : 1) * sizeof(uint32_t));
+    if (!copia->filas || !copia->hash) { escrituras_liberar(copia); return NULL; }
+    memcpy(copia->filas, e->filas, e->num * sizeof(FilaDisco));
+    memcpy(copia->hash, e->hash, e->cap_hash * sizeof(uint32_t));
+    copia->num = copia->cap = e->num;
+    copia->cap_hash = e->cap_hash;
+    return copia;
+}
+
+static size_t escrituras_cantidad(const Escrituras *e) {
+    return e ? e->num : 0;
+}
+
+static FilaDisco *escrituras_buscar(const Escrituras *e, int id) {
+    if (!e || e->cap_hash == 0) return NULL;
+    size_t mascara = e->cap_hash - 1;
+    for (size_t i = indice_hash(id, e->cap_hash); e->hash[i] != 0; i = (i + 1) & mascara) {
+        FilaDisco *f = &e->filas[e->hash[i] - 1];
+        if (f->id == id) return f;
+    }
+    return NULL;
+}
+
+static void escrituras_enlazar(uint32_t *hash, size_t cap_hash, int id, uint32_t posicion) {
+    size_t i = indice_hash(id, cap_hash);
+    while (hash[i] != 0) i = (i + 1) & (cap_hash - 1);
+    hash[i] = posicion + 1;
+}
+
+// Registra la nueva versión de la fila; reemplaza la anterior de la misma transacción
+static int escrituras_poner(Escrituras *e, const FilaDisco *f) {
+    FilaDisco *previa = escrituras_buscar(e, f->id);
+    if (previa) {
+        *previa = *f;
+        return 1;
+    }
+    if (e->num == e->cap) {
+        size_t nueva = e->cap ? e->cap * 2 : 16;
+        FilaDisco *filas = (FilaDisco *)realloc(e->filas, nueva * sizeof(FilaDisco));
+        if (!filas) return 0;
+        e->filas = filas;
+        e->cap = nueva;
+    }
+    if ((e->num + 1) * 2 > e->cap_hash) {
+        size_t nueva = e->cap_hash ? e->cap_hash * 2 : 32;
+        uint32_t *hash = (uint32_t *)calloc(nueva, sizeof(uint32_t));
+        if (!hash) return 0;
+        for (size_t i = 0; i < e->num; i++) escrituras_enlazar(hash, nueva, e->filas[i].id, (uint32_t)i);
+        free(e->hash);
+        e->hash = hash;
+        e->cap_hash = nueva;
+    }
+    e->filas[e->num] = *f;
+    escrituras_enlazar(e->hash, e->cap_hash, f->id, (uint32_t)e->num);
+    e->num++;
+    return 1;
+}
+
+// Punto de retorno: lo que una sentencia cambió en la transacción, para deshacerlo si falla
+typedef struct {
+    size_t num;          // filas que ya estaban antes de la sentencia
+    FilaDisco *previas;  // versiones de esas filas que la sentencia pisó, en orden
+    size_t num_previas, cap_previas;
+} PuntoRetorno;
+
+static int escrituras_poner_deshacible(Escrituras *e, PuntoRetorno *pr, const FilaDisco *f) {
+    FilaDisco *previa = escrituras_buscar(e, f->id);
+    if (previa && (size_t)(previa - e->filas) < pr->num) {
+        if (pr->num_previas == pr->cap_previas) {
+            size_t nueva = pr->cap_previas ? pr->cap_previas * 2 : 16;
+            FilaDisco *previas = (FilaDisco *)realloc(pr->previas, nueva * sizeof(FilaDisco));
+            if (!previas) return 0;
+            pr->previas = previas;
+            pr->cap_previas = nueva;
+        }
+        pr->previas[pr->num_previas++] = *previa;
+    }
+    return escrituras_poner(e, f);
+}
+
+// Repone las versiones pisadas (de atrás hacia adelante: gana la más vieja) y descarta
+// las filas agregadas desde el punto de retorno
+static void escrituras_volver(Escrituras *e, const PuntoRetorno *pr) {
+    for (size_t i = pr->num_previas; i-- > 0;) {
+        FilaDisco *f = escrituras_buscar(e, pr->previas[i].id);
+        if (f) *f = pr->previas[i];
+    }
+    if (e->num > pr->num) {
+        e->num = pr->num;
+        memset(e->hash, 0, e->cap_hash * sizeof(uint32_t));
+        for (size_t i = 0; i < e->num; i++) escrituras_enlazar(e->hash, e->cap_hash, e->filas[i].id, (uint32_t)i);
+    }
+}
+
+// --- Carga en paralelo
+//
+// Tanto el CSV como el archivo base se cargan con hilos_carga hilos. El CSV se corta
+// en trozos terminados en fin de línea; cada hilo los parsea con su propio diccionario
+// y después, ya con los códigos globales, copia sus filas a los slots que le tocan.
+// El índice por ID se arma en paralelo sobre rangos de páginas con inserción por CAS
+// (la capacidad se reserva antes, así que no hay redimensionado concurrente).
+
+#define MAX_HILOS_CARGA 32
+#define CSV_MIN_TROZO (1 << 20)  // bytes mínimos por hilo al parsear un CSV
+#define MIN_PAGINAS_HILO 256     // páginas mínimas por hilo al indexar
+#define INDICE_RESERVADO (-2L)   // entrada tomada por un hilo que todavía no publicó el ID
+
+static int hilos_carga = 1; // MICRODB_HILOS_CARGA (por defecto, los núcleos en línea)
+static int hilos_consulta = 1; // MICRODB_HILOS_CONSULTA: ver "Recorrido en paralelo"
+
+// Ejecuta fn sobre n trabajos de 'tam' bytes: n - 1 hilos nuevos más el llamador
+static void ejecutar_en_paralelo(void *(*fn)(void *), void *trabajos, size_t tam, int n) {
+    pthread_t hilos[MAX_HILOS_CARGA];
+    int creados = 0;
+    for (int i = 1; i < n; i++) {
+        void *trabajo = (char *)trabajos + (size_t)i * tam;
+        if (pthread_create(&hilos[creados], NULL, fn, trabajo) == 0) creados++;
+        else fn(trabajo); // sin recursos para otro hilo: lo hace el llamador
+    }
+    fn(trabajos);
+    for (int i = 0; i < creados; i++) pthread_join(hilos[i], NULL);
+}
+
+static int indice_reservar(Tabla *t, size_t filas) {
+    size_t capacidad = 1024;
+    while (filas * 10 > capacidad * 7) capacidad *= 2;
+    return capacidad <= t->indice_capacidad || indice_redimensionar(t, capacidad);
+}
+
+// Inserción concurrente (sólo durante la carga, con capacidad reservada). Con IDs
+// repetidos gana el slot mayor. Devuelve el slot que quedó descartado o -1.
+static long indice_insertar_concurrente(Tabla *t, int id, long slot) {
+    size_t mascara = t->indice_capacidad - 1;
+    for (size_t i = indice_hash(id, t->indice_capacidad);; i = (i + 1) & mascara) {
+        EntradaIndice *e = &t->indice[i];
+        long actual = __atomic_load_n(&e->slot, __ATOMIC_ACQUIRE);
+        if (actual == -1) {
+            if (__atomic_compare_exchange_n(&e->slot, &actual, INDICE_RESERVADO, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                e->id = id;
+                __atomic_store_n(&e->slot, slot, __ATOMIC_RELEASE);
+                __atomic_add_fetch(&t->indice_usadas, 1, __ATOMIC_RELAXED);
+                return -1;
+            }
+        }
+        while (actual == INDICE_RESERVADO) actual = __atomic_load_n(&e->slot, __ATOMIC_ACQUIRE);
+        if (e->id != id) continue;
+        while (actual < slot) {
+            if (__atomic_compare_exchange_n(&e->slot, &actual, slot, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return actual;
+        }
+        return slot;
+    }
+}
+
+typedef struct {
+    Tabla *t;
+    size_t desde, hasta; // rango de páginas
+    size_t descartadas;
+    size_t vivas;
+    int invalida;
+} TrabajoIndice;
+
+static void *indexar_paginas(void *arg) {
+    TrabajoIndice *w = (TrabajoIndice *)arg;
+    for (size_t p = w->desde; p < w->hasta; p++) {
+        Pagina *pag = w->t->paginas[p];
+        for (uint32_t j = 0; j < pag->num_filas; j++) {
+            FilaDisco *f = &pag->filas[j];
+            if (!(f->flags & FILA_VIVA)) continue;
+            if (f->producto >= w->t->dic.num) { w->invalida = 1; return NULL; }
+            long perdedor = indice_insertar_concurrente(w->t, f->id, (long)(p * FILAS_POR_PAGINA + j));
+            if (perdedor >= 0) {
+                __atomic_and_fetch(&tabla_fila(w->t, (size_t)perdedor)->flags, ~FILA_VIVA, __ATOMIC_RELAXED);
+                w->descartadas++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *resumir_paginas(void *arg) {
+    TrabajoIndice *w = (TrabajoIndice *)arg;
+    for (size_t p = w->desde; p < w->hasta; p++) {
+        Pagina *pag = w->t->paginas[p];
+        pagina_recalcular_zona(pag);
+        uint32_t vivas = 0;
+        for (uint32_t j = 0; j < pag->num_filas; j++) vivas += (pag->filas[j].flags & FILA_VIVA) != 0;
+        pag->num_vivas = vivas;
+        w->vivas += vivas;
+    }
+    return NULL;
+}
+
+// Arma el índice de una tabla cuyas páginas ya están cargadas y recalcula num_vivas y
+// los zone maps. Devuelve las filas descartadas por ID repetido o -1 si una fila tiene
+// un código de producto fuera del diccionario.
+static long tabla_indexar_paralelo(Tabla *t) {
+    if (!indice_reservar(t, t->num_filas)) return -1;
+    int n = hilos_carga;
+    if ((size_t)n > t->num_paginas / MIN_PAGINAS_HILO) n = (int)(t->num_paginas / MIN_PAGINAS_HILO);
+    if (n < 1) n = 1;
+    TrabajoIndice trabajos[MAX_HILOS_CARGA];
+    memset(trabajos, 0, sizeof(trabajos));
+    for (int i = 0; i < n; i++) {
+        trabajos[i].t = t;
+        trabajos[i].desde = t->num_paginas * (size_t)i / (size_t)n;
+        trabajos[i].hasta = t->num_paginas * (size_t)(i + 1) / (size_t)n;
+    }
+    ejecutar_en_paralelo(indexar_paginas, trabajos, sizeof(TrabajoIndice), n);
+    long descartadas = 0;
+    for (int i = 0; i < n; i++) {
+        if (trabajos[i].invalida) return -1;
+        descartadas += (long)trabajos[i].descartadas;
+    }
+    // Los descartes pueden caer en páginas de otro hilo: el resumen va después de la barrera
+    ejecutar_en_paralelo(resumir_paginas, trabajos, sizeof(TrabajoIndice), n);
+    t->num_vivas = 0;
+    for (int i = 0; i < n; i++) t->num_vivas += trabajos[i].vivas;
+    return descartadas;
+}
+
+typedef struct {
+    const char *inicio, *fin; // trozo del CSV terminado en fin de línea
+    FilaDisco *filas;         // producto con código local del trozo
+    size_t num, cap;
+    Diccionario dic;
+    long invalidas;
+    int sin_memoria;
+    Tabla *t;
+    size_t primer_slot;
+    uint32_t *traduccion;     // código local -> código de t->dic
+} TrozoCsv;
+
+static int trozo_csv_fila(void *ctx, const FilaCsv *f) {
+    TrozoCsv *z = (TrozoCsv *)ctx;
+    if (z->num == z->cap) {
+        size_t nueva = z->cap ? z->cap * 2 : 4096;
+        FilaDisco *tmp = (FilaDisco *)realloc(z->filas, nueva * sizeof(FilaDisco));
+        if (!tmp) { z->sin_memoria = 1; return 0; }
+        z->filas = tmp;
+        z->cap = nueva;
+    }
+    long codigo = diccionario_agregar(&z->dic, f->producto, f->largo_producto);
+    if (codigo < 0) { z->sin_memoria = 1; return 0; }
+    FilaDisco fila = { f->id, (uint32_t)codigo, f->cantidad, FILA_VIVA, f->precio };
+    z->filas[z->num++] = fila;
+    return 1;
+}
+
+static void *trozo_csv_parsear(void *arg) {
+    TrozoCsv *z = (TrozoCsv *)arg;
+    z->invalidas = csv_recorrer(z->inicio, (size_t)(z->fin - z->inicio), trozo_csv_fila, z);
+    return NULL;
+}
+
+static void *trozo_csv_copiar(void *arg) {
+    TrozoCsv *z = (TrozoCsv *)arg;
+    for (size_t i = 0; i < z->num; i++) {
+        FilaDisco f = z->filas[i];
+        f.producto = z->traduccion[f.producto];
+        *tabla_fila(z->t, z->primer_slot + i) = f;
+    }
+    return NULL;
+}
+
+// Carga un CSV en una tabla vacía. Devuelve la cantidad de filas leídas, -1 si el
+// archivo no existe o -2 sin memoria.
+static long tabla_cargar_csv(Tabla *t, const char *path) {
+    size_t bytes;
+    const char *datos = csv_mapear(path, &bytes);
+    if (!datos) return -1;
+
+    int n = hilos_carga;
+    if ((size_t)n > bytes / CSV_MIN_TROZO) n = (int)(bytes / CSV_MIN_TROZO);
+    if (n < 1) n = 1;
+    TrozoCsv trozos[MAX_HILOS_CARGA];
+    memset(trozos, 0, sizeof(trozos));
+    const char *fin_datos = datos + bytes;
+    const char *p = datos;
+    for (int i = 0; i < n; i++) {
+        const char *corte = (i + 1 == n) ? fin_datos : datos + bytes * (size_t)(i + 1) / (size_t)n;
+        if (corte < p) corte = p;
+        if (corte < fin_datos) {
+            const char *nl = (const char *)memchr(corte, '\n', (size_t)(fin_datos - corte));
+            corte = nl ? nl + 1 : fin_datos;
+        }
+        trozos[i].inicio = p;
+        trozos[i].fin = corte;
+        trozos[i].t = t;
+        p = corte;
+    }
+    ejecutar_en_paralelo(trozo_csv_parsear, trozos, sizeof(TrozoCsv), n);
+
+    // Diccionario global en orden de aparición y ubicación de cada trozo en la tabla
+    long resultado = 0, invalidas = 0;
+    size_t total = 0;
+    for (int i = 0; i < n && resultado == 0; i++) {
+        TrozoCsv *z = &trozos[i];
+        invalidas += z->invalidas;
+        z->primer_slot = total;
+        total += z->num;
+        z->traduccion = (uint32_t *)malloc((z->dic.num ? z->dic.num : 1) * sizeof(uint32_t));
+        if (z->sin_memoria || !z->traduccion) { resultado = -2; break; }
+        for (uint32_t c = 0; c < z->dic.num; c++) {
+            long codigo = diccionario_agregar(&t->dic, z->dic.nombres[c], strlen(z->dic.nombres[c]));
+            if (codigo < 0) { resultado = -2; break; }
+            z->traduccion[c] = (uint32_t)codigo;
+        }
+    }
+    size_t num_paginas = (total + FILAS_POR_PAGINA - 1) / FILAS_POR_PAGINA;
+    if (resultado == 0 && num_paginas > 0) {
+        t->paginas = (Pagina **)calloc(num_paginas, sizeof(Pagina *));
+        if (!t->paginas) resultado = -2;
+        else t->cap_paginas = num_paginas;
+        for (size_t i = 0; i < num_paginas && resultado == 0; i++) {
+            Pagina *pag = (Pagina *)malloc(sizeof(Pagina));
+            if (!pag) { resultado = -2; break; }
+            memset(pag, 0, CABECERA_PAGINA);
+            pag->num_filas = (uint32_t)((i + 1 < num_paginas) ? FILAS_POR_PAGINA : total - i * FILAS_POR_PAGINA);
+            t->paginas[t->num_paginas++] = pag;
+        }
+    }
+    if (resultado == 0) {
+        t->num_filas = total;
+        ejecutar_en_paralelo(trozo_csv_copiar, trozos, sizeof(TrozoCsv), n);
+    }
+    for (int i = 0; i < n; i++) {
+        free(trozos[i].filas);
+        free(trozos[i].traduccion);
+        diccionario_liberar(&trozos[i].dic);
+    }
+    csv_desmapear(datos, bytes);
+    if (resultado < 0) return resultado;
+
+    long duplicadas = tabla_indexar_paralelo(t);
+    if (duplicadas < 0) return -2;
+    if (duplicadas > 0) {
+        printf("[SERVIDOR] ADVERTENCIA: %ld filas con ID repetido en %s; se conserva la ultima.\n", duplicadas, path);
+    }
+    if (invalidas > 0) {
+        printf("[SERVIDOR] ADVERTENCIA: %ld lineas invalidas en %s fueron ignoradas.\n", invalidas, path);
+    }
+    return (long)total;
+}
+
+static uint32_t crc32_calcular(const uint8_t *datos, size_t n);
+
+// Mapea el archivo base y arma el índice. Devuelve 1 si cargó, -1 si no existe y 0 si está dañado.
+static int tabla_cargar_binaria(Tabla *t, const char *path, uint64_t *lsn) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    CabeceraArchivo cab;
+    if (fstat(fd, &st) < 0 || st.st_size < TAM_PAGINA ||
+        pread(fd, &cab, sizeof(cab), 0) != (ssize_t)sizeof(cab)) {
+        close(fd);
+        return 0;
+    }
+    if (memcmp(cab.magia, DB_MAGIA, 8) != 0 || (cab.version != DB_VERSION && cab.version != 1) || cab.tam_pagina != TAM_PAGINA ||
+        cab.crc != crc32_calcular((const uint8_t *)&cab, offsetof(CabeceraArchivo, crc)) ||
+        cab.offset_diccionario < (1 + cab.num_paginas) * TAM_PAGINA ||
+        cab.offset_diccionario + cab.bytes_diccionario > (uint64_t)st.st_size) {
+        close(fd);
+        return 0;
+    }
+    void *mapa = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapa == MAP_FAILED) return 0;
+    t->mapa = mapa;
+    t->mapa_bytes = (size_t)st.st_size;
+
+    // Diccionario: los códigos son la posición en el archivo
+    const uint8_t *p = (const uint8_t *)mapa + cab.offset_diccionario;
+    const uint8_t *fin = p + cab.bytes_diccionario;
+    char nombre[256];
+    for (uint32_t c = 0; c < cab.num_productos; c++) {
+        uint16_t largo;
+        if (fin - p < 2) goto danado;
+        memcpy(&largo, p, 2); p += 2;
+        if (largo >= sizeof(nombre) || fin - p < largo) goto danado;
+        memcpy(nombre, p, largo); nombre[largo] = '\0'; p += largo;
+        if (diccionario_agregar(&t->dic, nombre, largo) != (long)c) goto danado;
+    }
+
+    t->cap_paginas = cab.num_paginas ? cab.num_paginas : 1;
+    t->paginas = (Pagina **)malloc(t->cap_paginas * sizeof(Pagina *));
+    if (!t->paginas) goto danado;
+    for (uint64_t i = 0; i < cab.num_paginas; i++) {
+        Pagina *pag = (Pagina *)((char *)mapa + (1 + i) * TAM_PAGINA);
+        // Sólo la última página puede estar incompleta (ver cálculo de slots)
+        if (pag->num_filas > FILAS_POR_PAGINA || (i + 1 < cab.num_paginas && pag->num_filas != FILAS_POR_PAGINA)) goto danado;
+        t->paginas[t->num_paginas++] = pag;
+        t->num_filas += pag->num_filas;
+    }
+    // Ya se recorren todas las filas para el índice: num_vivas y las cotas se
+    // recalculan ahí (el mapeo es privado), lo que también cubre archivos de la versión 1
+    if (tabla_indexar_paralelo(t) < 0) goto danado;
+    *lsn = cab.lsn;
+    return 1;
+danado:
+    tabla_liberar(t);
+    return 0;
+}
+
+// Escribe las filas en un archivo base nuevo (temporal + fsync + rename)
+static int escribir_base_binaria(const FilaDisco *filas, size_t n, const uint8_t *dic, size_t bytes_dic,
+                                 uint32_t num_productos, uint64_t lsn) {
+    const char *tmp_path = DB_FILE_NAME ".tmp";
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return 0;
+    Pagina *pag = (Pagina *)malloc(sizeof(Pagina));
+    int ok = pag != NULL;
+    uint64_t num_paginas = (n + FILAS_POR_PAGINA - 1) / FILAS_POR_PAGINA;
+    if (ok) {
+        memset(pag, 0, sizeof(Pagina));
+        ok = write_full(fd, pag, TAM_PAGINA); // lugar de la cabecera
+    }
+    for (uint64_t i = 0; ok && i < num_paginas; i++) {
+        size_t desde = (size_t)i * FILAS_POR_PAGINA;
+        size_t cuantas = (n - desde < FILAS_POR_PAGINA) ? n - desde : FILAS_POR_PAGINA;
+        memset(pag, 0, sizeof(Pagina));
+        pag->num_filas = pag->num_vivas = (uint32_t)cuantas;
+        memcpy(pag->filas, filas + desde, cuantas * sizeof(FilaDisco));
+        for (size_t j = 0; j < cuantas; j++) pag->filas[j].flags = FILA_VIVA;
+        pagina_recalcular_zona(pag);
+        ok = write_full(fd, pag, TAM_PAGINA);
+    }
+    free(pag);
+    ok = ok && write_full(fd, dic, bytes_dic);
+
+    CabeceraArchivo cab;
+    memset(&cab, 0, sizeof(cab));
+    memcpy(cab.magia, DB_MAGIA, 8);
+    cab.version = DB_VERSION;
+    cab.tam_pagina = TAM_PAGINA;
+    cab.num_paginas = num_paginas;
+    cab.num_filas = n;
+    cab.lsn = lsn;
+    cab.offset_diccionario = (1 + num_paginas) * TAM_PAGINA;
+    cab.bytes_diccionario = bytes_dic;
+    cab.num_productos = num_productos;
+    cab.crc = crc32_calcular((const uint8_t *)&cab, offsetof(CabeceraArchivo, crc));
+    ok = ok && pwrite(fd, &cab, sizeof(cab), 0) == (ssize_t)sizeof(cab);
+    ok = ok && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(tmp_path, DB_FILE_NAME) != 0) {
+        unlink(tmp_path);
+        return 0;
+    }
+    return 1;
+}
+
+// Arma una tabla nueva sin slots borrados a partir de las filas vigentes (sin diccionario)
+static int tabla_construir_compacta(const FilaDisco *filas, size_t n, Tabla *destino) {
+    memset(destino, 0, sizeof(*destino));
+    for (size_t i = 0; i < n; i++) {
+        Pagina *p = destino->num_paginas ? destino->paginas[destino->num_paginas - 1] : NULL;
+        if (!p || p->num_filas == FILAS_POR_PAGINA) {
+            p = tabla_agregar_pagina(destino);
+            if (!p) goto fallo;
+        }
+        p->filas[p->num_filas++] = filas[i];
+        p->num_vivas++;
+        pagina_ampliar_zona(p, &filas[i]);
+        if (!indice_insertar(destino, filas[i].id, (long)i)) goto fallo;
+    }
+    destino->num_filas = destino->num_vivas = n;
+    return 1;
+fallo:
+    tabla_liberar(destino);
+    return 0;
+}
+
+// --- Write-Ahead Log (WAL)
+//
+// Cada modificación se agrega al final de WAL_FILE_NAME como un registro binario:
+//   [u32 longitud][u32 crc32(payload)][payload]
+//   payload = [u64 lsn][u8 op][i32 id][i32 cantidad][f64 precio][u16 largo][producto]
+// INSERT/UPDATE guardan la imagen completa de la fila y DELETE sólo el ID, por lo
+// que reaplicar un registro dos veces es inocuo. Los registros de un COMMIT se
+// escriben juntos; si son varios, los precede un registro WAL_OP_LOTE cuyo 'id' es
+// la cantidad que sigue. Al arrancar se reaplican los registros en orden hasta el
+// primero incompleto o con CRC inválido (escritura cortada por una caída), o hasta
+// un lote al que le falten registros; ese resto se trunca, así que una transacción
+// se recupera entera o no se recupera. El WAL se descarta en cada compactación.
+
+enum { WAL_OP_INSERT = 1, WAL_OP_UPDATE = 2, WAL_OP_DELETE = 3, WAL_OP_LOTE = 4 };
+
+#define WAL_CABECERA 8
+#define WAL_PAYLOAD_FIJO 27
+#define WAL_MAX_REGISTRO (WAL_CABECERA + WAL_PAYLOAD_FIJO + 128)
+
+static int wal_fd = -1;
+static uint64_t wal_lsn = 0;
+static off_t wal_bytes = 0;
+static uint32_t crc32_tabla[256];
+
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc32_tabla[i] = c;
+    }
+}
+
+static uint32_t crc32_calcular(const uint8_t *datos, size_t n) {
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < n; i++) c = crc32_tabla[(c ^ datos[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static size_t wal_codificar(uint8_t *buf, uint64_t lsn, uint8_t op, const Registro *r) {
+    uint8_t *p = buf + WAL_CABECERA;
+    uint16_t largo = (uint16_t)strnlen(r->producto, sizeof(r->producto) - 1);
+    memcpy(p, &lsn, 8); p += 8;
+    *p++ = op;
+    memcpy(p, &r->id, 4); p += 4;
+    memcpy(p, &r->cantidad, 4); p += 4;
+    memcpy(p, &r->precio, 8); p += 8;
+    memcpy(p, &largo, 2); p += 2;
+    memcpy(p, r->producto, largo); p += largo;
+    uint32_t longitud = (uint32_t)(p - (buf + WAL_CABECERA));
+    uint32_t crc = crc32_calcular(buf + WAL_CABECERA, longitud);
+    memcpy(buf, &longitud, 4);
+    memcpy(buf + 4, &crc, 4);
+    return WAL_CABECERA + longitud;
+}
+
+// Decodifica un registro; devuelve su tamaño total o 0 si está incompleto o corrupto
+static size_t wal_decodificar(const uint8_t *buf, size_t disponible, uint64_t *lsn, uint8_t *op, Registro *r) {
+    uint32_t longitud, crc;
+    uint16_t largo;
+    if (disponible < WAL_CABECERA) return 0;
+    memcpy(&longitud, buf, 4);
+    memcpy(&crc, buf + 4, 4);
+    if (longitud < WAL_PAYLOAD_FIJO || longitud > WAL_MAX_REGISTRO - WAL_CABECERA) return 0;
+    if (disponible - WAL_CABECERA < longitud) return 0;
+    const uint8_t *p = buf + WAL_CABECERA;
+    if (crc32_calcular(p, longitud) != crc) return 0;
+    memcpy(lsn, p, 8); p += 8;
+    *op = *p++;
+    memcpy(&r->id, p, 4); p += 4;
+    memcpy(&r->cantidad, p, 4); p += 4;
+    memcpy(&r->precio, p, 8); p += 8;
+    memcpy(&largo, p, 2); p += 2;
+    if (largo != longitud - WAL_PAYLOAD_FIJO || largo >= sizeof(r->producto)) return 0;
+    memcpy(r->producto, p, largo);
+    r->producto[largo] = '\0';
+    return WAL_CABECERA + longitud;
+}
+
+// Agrega con una sola escritura 'registros' registros ya codificados (LSN wal_lsn + 1
+// en adelante). Si falla recorta lo que haya llegado a escribirse. Llamar con mutex_escritura tomado.
+static int wal_escribir_lote(const uint8_t *buf, size_t n, uint64_t registros) {
+    if (wal_fd < 0) return 0;
+    if (!write_full(wal_fd, buf, n)) {
+        if (ftruncate(wal_fd, wal_bytes) != 0) perror("ftruncate WAL");
+        return 0;
+    }
+    wal_lsn += registros;
+    wal_bytes += (off_t)n;
+    return 1;
+}
+
+// Falla después de escribir un lote en el WAL (sin memoria para aplicarlo, fdatasync
+// fallido): el estado en memoria ya no corresponde a lo que hay en disco y seguir
+// aceptando escrituras lo empeoraría. Como el PANIC de PostgreSQL, el proceso termina
+// sin checkpoint (_exit salta el atexit) y al reiniciar reaplica lo que esté en el WAL.
+// Los clientes de esos COMMIT no reciben respuesta: igual que ante una caída.
+static void wal_panico(const char *motivo) {
+    fprintf(stderr, "[WAL] PANICO: %s. Se detiene el servidor; al reiniciar se recupera desde el WAL.\n", motivo);
+    _exit(EXIT_FAILURE);
+}
+
+static int fsync_directorio(void) {
+    int fd = open(".", O_RDONLY);
+    if (fd < 0) return 0;
+    int ok = (fsync(fd) == 0);
+    close(fd);
+    return ok;
+}
+
+static off_t tamanio_archivo(const char *path) {
+    struct stat st;
+    return (stat(path, &st) == 0) ? st.st_size : 0;
+}
+
+// Pasa el WAL actual a WAL_OLD_FILE_NAME y abre uno vacío. Llamar con mutex_escritura tomado.
+static int wal_rotar(void) {
+    if (rename(WAL_FILE_NAME, WAL_OLD_FILE_NAME) != 0) return 0;
+    int fd = open(WAL_FILE_NAME, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        rename(WAL_OLD_FILE_NAME, WAL_FILE_NAME);
+        return 0;
+    }
+    if (wal_fd >= 0) {
+        // Lo que quedó en el WAL rotado pasa a estar en disco: los commits que esperan
+        // su fdatasync ya no dependen de este descriptor
+        if (fdatasync(wal_fd) != 0) {
+            perror("[WAL] fdatasync");
+            wal_panico("fallo el fdatasync del WAL al rotarlo");
+        }
+        close(wal_fd);
+    }
+    wal_fd = fd;
+    wal_bytes = 0;
+    fsync_directorio();
+    return 1;
+}
+
+// Vuelve a unir WAL_OLD_FILE_NAME + WAL_FILE_NAME en un único WAL, respetando el orden.
+// Se usa si la compactación falló después de rotar y al arrancar tras una caída.
+// Llamar con mutex_escritura tomado (o antes de aceptar clientes).
+static int wal_deshacer_rotacion(void) {
+    int viejo = open(WAL_OLD_FILE_NAME, O_WRONLY | O_APPEND);
+    if (viejo < 0) return errno == ENOENT;
+    int actual = open(WAL_FILE_NAME, O_RDONLY);
+    int ok = 1;
+    if (actual >= 0) {
+        char buf[65536];
+        ssize_t n;
+        while (ok && (n = read(actual, buf, sizeof(buf))) != 0) {
+            if (n < 0) { if (errno == EINTR) continue; ok = 0; break; }
+            ok = write_full(viejo, buf, (size_t)n);
+        }
+        close(actual);
+    }
+    ok = ok && (fsync(viejo) == 0);
+    close(viejo);
+    if (!ok || rename(WAL_OLD_FILE_NAME, WAL_FILE_NAME) != 0) return 0;
+    fsync_directorio();
+    if (wal_fd >= 0) {
+        close(wal_fd);
+        wal_fd = open(WAL_FILE_NAME, O_RDWR | O_APPEND);
+        wal_bytes = tamanio_archivo(WAL_FILE_NAME);
+    }
+    return 1;
+}
+
+// Reaplica un registro si es posterior al archivo base; 0 si no hay memoria
+static int wal_reaplicar(Tabla *t, uint64_t lsn_base, uint64_t lsn, uint8_t op, const Registro *r, long *aplicados) {
+    if (lsn <= lsn_base) return 1;
+    if (op == WAL_OP_DELETE) { if (tabla_borrar(t, r->id) < 0) return 0; }
+    else if (!tabla_upsert(t, r)) return 0;
+    wal_lsn = lsn;
+    (*aplicados)++;
+    return 1;
+}
+
+// Reaplica sobre la tabla los registros del WAL posteriores a lsn_base (el LSN que
+// ya incluye el archivo base) y deja el descriptor abierto para agregar
+static long wal_abrir_y_reaplicar(Tabla *t, uint64_t lsn_base) {
+    // Una compactación interrumpida deja el WAL partido en dos: se vuelve a unir
+    if (!wal_deshacer_rotacion()) return -1;
+    wal_fd = open(WAL_FILE_NAME, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (wal_fd < 0) return -1;
+    wal_lsn = lsn_base;
+    struct stat st;
+    if (fstat(wal_fd, &st) < 0) return -1;
+    if (st.st_size == 0) return 0;
+
+    uint8_t *datos = (uint8_t *)malloc((size_t)st.st_size);
+    if (!datos) return -1;
+    size_t leidos = 0;
+    while (leidos < (size_t)st.st_size) {
+        ssize_t r = pread(wal_fd, datos + leidos, (size_t)st.st_size - leidos, (off_t)leidos);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            // Un error de lectura no dice nada del contenido: no se descarta nada
+            if (r == 0) errno = EIO;
+            free(datos);
+            return -1;
+        }
+        leidos += (size_t)r;
+    }
+
+    // Sólo una cola rota (wal_decodificar devuelve 0) autoriza a truncar. Si falta
+    // memoria se aborta el arranque sin tocar el WAL: los commits siguen ahí.
+    long aplicados = 0;
+    size_t pos = 0;
+    int sin_memoria = 0;
+    while (pos < leidos) {
+        uint64_t lsn; uint8_t op; Registro r;
+        size_t n = wal_decodificar(datos + pos, leidos - pos, &lsn, &op, &r);
+        if (n == 0) break;
+        if (op != WAL_OP_LOTE) {
+            if (!wal_reaplicar(t, lsn_base, lsn, op, &r, &aplicados)) { sin_memoria = 1; break; }
+            pos += n;
+            continue;
+        }
+        // Un lote se reaplica sólo si llegaron todos sus registros
+        long cantidad = r.id, completos = 0;
+        size_t fin = pos + n;
+        while (completos < cantidad) {
+            uint64_t lsn2; uint8_t op2; Registro r2;
+            size_t m = wal_decodificar(datos + fin, leidos - fin, &lsn2, &op2, &r2);
+            if (m == 0 || op2 == WAL_OP_LOTE) break;
+            fin += m;
+            completos++;
+        }
+        if (cantidad <= 0 || completos < cantidad) break;
+        if (lsn > lsn_base) wal_lsn = lsn;
+        size_t p = pos + n;
+        int ok = 1;
+        while (ok && p < fin) {
+            p += wal_decodificar(datos + p, fin - p, &lsn, &op, &r);
+            ok = wal_reaplicar(t, lsn_base, lsn, op, &r, &aplicados);
+        }
+        if (!ok) { sin_memoria = 1; break; }
+        pos = fin;
+    }
+    free(datos);
+    if (sin_memoria) {
+        fprintf(stderr, "[WAL] Memoria insuficiente al reaplicar el registro en offset %zu.\n", pos);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (pos < (size_t)st.st_size) {
+        printf("[WAL] Registro incompleto o corrupto en offset %zu; se descartan %lld bytes finales.\n",
+               pos, (long long)st.st_size - (long long)pos);
+        if (ftruncate(wal_fd, (off_t)pos) < 0) perror("ftruncate WAL");
+    }
+    wal_bytes = (off_t)pos;
+    return aplicados;
+}
+
+// --- Compactación y checkpoint en segundo plano
+//
+// El hilo de compactación fusiona el WAL con el archivo base cuando el WAL supera
+// un tamaño, cuando hay demasiadas filas borradas en memoria o periódicamente.
+// Sólo pausa a los escritores (mutex_escritura) mientras rota el WAL y copia las
+// filas vigentes; los lectores siguen con rwlock_tabla en modo lectura. El archivo
+// nuevo se escribe fuera de todo lock y se instala con rename; recién entonces
+// se borra el WAL rotado. Una caída en cualquier punto deja base + WAL(s) cuya
+// reaplicación reconstruye el mismo estado.
+
+typedef struct {
+    off_t wal_max_bytes;       // tamaño del WAL que dispara una compactación
+    int max_filas_muertas_pct; // % de slots borrados en memoria que la dispara
+    int intervalo_seg;         // compactación periódica si el WAL no está vacío
+} ConfigCompactacion;
+
+typedef struct {
+    long ejecuciones;
+    double ultima_ms, max_ms, total_ms;
+    long long ultimos_bytes_recuperados, total_bytes_recuperados;
+    size_t ultimas_filas_recuperadas, total_filas_recuperadas;
+    off_t ultimo_tamanio_base;
+    time_t ultima_vez;
+} EstadisticasCompactacion;
+
+static pthread_mutex_t mutex_escritura = PTHREAD_MUTEX_INITIALIZER; // serializa a los escritores y al corte del compactador
+static pthread_mutex_t mutex_archivo_base = PTHREAD_MUTEX_INITIALIZER; // una sola compactación o IMPORT reescribe DB_FILE_NAME a la vez
+static pthread_mutex_t mutex_compactacion = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_compactacion = PTHREAD_COND_INITIALIZER;
+static pthread_t hilo_compactacion;
+static int hilo_compactacion_activo = 0;
+static int compactacion_pendiente = 0;
+static int compactacion_detener = 0;
+static ConfigCompactacion config_compactacion = { WAL_CHECKPOINT_BYTES, 25, 30 };
+static EstadisticasCompactacion stats_compactacion;
+
+static double ms_desde(const struct timespec *inicio) {
+    struct timespec ahora;
+    clock_gettime(CLOCK_MONOTONIC, &ahora);
+    return (double)(ahora.tv_sec - inicio->tv_sec) * 1000.0 + (double)(ahora.tv_nsec - inicio->tv_nsec) / 1e6;
+}
+
+static long config_entero_env(const char *nombre, long por_defecto, long minimo) {
+    const char *v = getenv(nombre);
+    if (!v || !*v) return por_defecto;
+    char *fin;
+    long n = strtol(v, &fin, 10);
+    if (*fin != '\0' || n < minimo) {
+        printf("[SERVIDOR] ADVERTENCIA: %s=%s invalido; se usa %ld.\n", nombre, v, por_defecto);
+        return por_defecto;
+    }
+    return n;
+}
+
+static void load_config_compactacion(ConfigCompactacion *cfg) {
+    cfg->wal_max_bytes = (off_t)config_entero_env("MICRODB_WAL_MAX_BYTES", WAL_CHECKPOINT_BYTES, 1);
+    cfg->max_filas_muertas_pct = (int)config_entero_env("MICRODB_MAX_FILAS_MUERTAS_PCT", 25, 1);
+    cfg->intervalo_seg = (int)config_entero_env("MICRODB_CHECKPOINT_SEG", 30, 1);
+}
+
+static int filas_muertas_exceden(const Tabla *t, int pct) {
+    size_t muertas = t->num_filas - t->num_vivas;
+    return muertas > 0 && muertas * 100 >= (size_t)pct * t->num_filas;
+}
+
+// Copia las filas vigentes en un arreglo contiguo (llamar sin escritores concurrentes)
+static FilaDisco *tabla_foto(const Tabla *t, size_t *n) {
+    FilaDisco *foto = (FilaDisco *)malloc((t->num_vivas ? t->num_vivas : 1) * sizeof(FilaDisco));
+    *n = 0;
+    if (!foto) return NULL;
+    for (size_t p = 0; p < t->num_paginas; p++) {
+        const Pagina *pag = t->paginas[p];
+        for (uint32_t j = 0; j < pag->num_filas; j++) {
+            if (pag->filas[j].flags & FILA_VIVA) foto[(*n)++] = pag->filas[j];
+        }
+    }
+    return foto;
+}
+
+// Fusiona el WAL con el archivo base. Devuelve 1 si hubo compactación, 0 si no hacía
+// falta y -1 si falló (en ese caso el WAL queda intacto). Con 'forzar' escribe el
+// archivo base aunque el WAL esté vacío (p. ej. al migrar desde el CSV).
+static int ejecutar_compactacion(int forzar) {
+    struct timespec inicio;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+
+    pthread_mutex_lock(&mutex_archivo_base);
+    pthread_mutex_lock(&mutex_escritura);
+    int compactar_memoria = filas_muertas_exceden(&tabla, config_compactacion.max_filas_muertas_pct);
+    if (wal_bytes == 0 && !compactar_memoria && !forzar) {
+        pthread_mutex_unlock(&mutex_escritura);
+        pthread_mutex_unlock(&mutex_archivo_base);
+        return 0;
+    }
+    off_t bytes_antes = tamanio_archivo(DB_FILE_NAME) + wal_bytes;
+    if (!wal_rotar()) {
+        pthread_mutex_unlock(&mutex_escritura);
+        pthread_mutex_unlock(&mutex_archivo_base);
+        perror("[COMPACTACION] No se pudo rotar el WAL");
+        return -1;
+    }
+    // Sin escritores no hace falta el rwlock para leer la tabla
+    size_t n = 0, filas_recuperadas = 0, bytes_dic = 0;
+    uint64_t lsn = wal_lsn;
+    uint32_t num_productos = tabla.dic.num;
+    FilaDisco *foto = tabla_foto(&tabla, &n);
+    uint8_t *dic = diccionario_serializar(&tabla.dic, &bytes_dic);
+    Tabla compacta;
+    if (foto && compactar_memoria && tabla_construir_compacta(foto, n, &compacta)) {
+        // Sólo el intercambio de punteros excluye a los lectores; los códigos de
+        // producto no cambian, así que el diccionario pasa tal cual a la tabla nueva
+        Tabla vieja;
+        pthread_rwlock_wrlock(&rwlock_tabla);
+        vieja = tabla;
+        compacta.dic = vieja.dic;
+        memset(&vieja.dic, 0, sizeof(vieja.dic));
+        tabla = compacta;
+        int retirada = tabla_retirar(&vieja);
+        pthread_rwlock_unlock(&rwlock_tabla);
+        filas_recuperadas = vieja.num_filas - vieja.num_vivas;
+        if (!retirada) tabla_liberar(&vieja);
+    }
+    pthread_mutex_unlock(&mutex_escritura);
+
+    int ok = foto && dic && escribir_base_binaria(foto, n, dic, bytes_dic, num_productos, lsn);
+    free(foto);
+    free(dic);
+    if (ok) {
+        unlink(WAL_OLD_FILE_NAME);
+        fsync_directorio();
+    } else {
+        pthread_mutex_lock(&mutex_escritura);
+        wal_deshacer_rotacion();
+        pthread_mutex_unlock(&mutex_escritura);
+        pthread_mutex_unlock(&mutex_archivo_base);
+        printf("[COMPACTACION] ADVERTENCIA: No se pudo escribir %s; el WAL se conserva.\n", DB_FILE_NAME);
+        return -1;
+    }
+    pthread_mutex_unlock(&mutex_archivo_base);
+
+    off_t bytes_despues = tamanio_archivo(DB_FILE_NAME);
+    double ms = ms_desde(&inicio);
+    long long recuperados = (long long)bytes_antes - (long long)bytes_despues;
+    if (recuperados < 0) recuperados = 0;
+
+    pthread_mutex_lock(&mutex_compactacion);
+    stats_compactacion.ejecuciones++;
+    stats_compactacion.ultima_ms = ms;
+    stats_compactacion.total_ms += ms;
+    if (ms > stats_compactacion.max_ms) stats_compactacion.max_ms = ms;
+    stats_compactacion.ultimos_bytes_recuperados = recuperados;
+    stats_compactacion.total_bytes_recuperados += recuperados;
+    stats_compactacion.ultimas_filas_recuperadas = filas_recuperadas;
+    stats_compactacion.total_filas_recuperadas += filas_recuperadas;
+    stats_compactacion.ultimo_tamanio_base = bytes_despues;
+    stats_compactacion.ultima_vez = time(NULL);
+    pthread_mutex_unlock(&mutex_compactacion);
+
+    printf("[COMPACTACION] %zu filas en %s en %.2f ms; %lld bytes y %zu slots recuperados.\n",
+           n, DB_FILE_NAME, ms, recuperados, filas_recuperadas);
+    return 1;
+}
+
+// Lo llaman los escritores (con mutex_escritura tomado) después de cada modificación
+static void compactacion_verificar_umbrales(void) {
+    if (wal_bytes < config_compactacion.wal_max_bytes &&
+        !filas_muertas_exceden(&tabla, config_compactacion.max_filas_muertas_pct)) return;
+    pthread_mutex_lock(&mutex_compactacion);
+    if (!compactacion_pendiente) {
+        compactacion_pendiente = 1;
+        pthread_cond_signal(&cond_compactacion);
+    }
+    pthread_mutex_unlock(&mutex_compactacion);
+}
+
+static void *compactacion_thread(void *arg) {
+    (void)arg;
+    traza_nombrar_hilo("compactacion", 0);
+    pthread_mutex_lock(&mutex_compactacion);
+    while (!compactacion_detener) {
+        struct timespec limite;
+        clock_gettime(CLOCK_REALTIME, &limite);
+        limite.tv_sec += config_compactacion.intervalo_seg;
+        while (!compactacion_pendiente && !compactacion_detener) {
+            if (pthread_cond_timedwait(&cond_compactacion, &mutex_compactacion, &limite) != 0) break;
+        }
+        if (compactacion_detener) break;
+        compactacion_pendiente = 0;
+        pthread_mutex_unlock(&mutex_compactacion);
+        uint64_t traza = traza_inicio();
+        ejecutar_compactacion(0);
+        traza_fin("compactacion", traza, -1);
+        pthread_mutex_lock(&mutex_compactacion);
+    }
+    pthread_mutex_unlock(&mutex_compactacion);
+    return NULL;
+}
+
+static char *compactacion_reporte(void) {
+    pthread_mutex_lock(&mutex_escritura);
+    long long wal_actual = (long long)wal_bytes;
+    pthread_mutex_unlock(&mutex_escritura);
+    pthread_mutex_lock(&mutex_compactacion);
+    EstadisticasCompactacion s = stats_compactacion;
+    pthread_mutex_unlock(&mutex_compactacion);
+    long fsyncs, commits;
+    grupo_estadisticas(&fsyncs, &commits);
+    char *out = (char *)malloc(1024);
+    if (!out) return NULL;
+    snprintf(out, 1024,
+        "OK: Estadisticas de compactacion\n"
+        "ejecuciones=%ld\n"
+        "ultima_duracion_ms=%.3f\n"
+        "max_duracion_ms=%.3f\n"
+        "total_duracion_ms=%.3f\n"
+        "ultimos_bytes_recuperados=%lld\n"
+        "total_bytes_recuperados=%lld\n"
+        "ultimas_filas_recuperadas=%zu\n"
+        "total_filas_recuperadas=%zu\n"
+        "tamanio_base_bytes=%lld\n"
+        "wal_bytes=%lld\n"
+        "umbral_wal_bytes=%lld\n"
+        "umbral_filas_muertas_pct=%d\n"
+        "intervalo_seg=%d\n"
+        "wal_fsyncs=%ld\n"
+        "commits_durables=%ld\n",
+        s.ejecuciones, s.ultima_ms, s.max_ms, s.total_ms,
+        s.ultimos_bytes_recuperados, s.total_bytes_recuperados,
+        s.ultimas_filas_recuperadas, s.total_filas_recuperadas,
+        (long long)s.ultimo_tamanio_base, wal_actual,
+        (long long)config_compactacion.wal_max_bytes,
+        config_compactacion.max_filas_muertas_pct, config_compactacion.intervalo_seg,
+        fsyncs, commits);
+    return out;
+}
+
+// --- Group commit: fsync del WAL por lotes
+//
+// Un COMMIT escribe su lote en el WAL (sin fsync) y recién responde cuando ese lote está
+// en disco. El primero que llega sin que haya un fsync en curso hace de líder: espera a
+// lo sumo MICRODB_GRUPO_RETRASO_US (o hasta que esperen MICRODB_GRUPO_MAX_LOTE commits),
+// hace un único fdatasync de todo lo escrito hasta ese momento y despierta a los que
+// quedaron cubiertos. Los que llegan durante un fdatasync se juntan para el siguiente,
+// así que con mucha concurrencia el costo del fsync se reparte entre todos.
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t hecho;          // terminó un fdatasync
+    pthread_cond_t llegada;        // llegó otro commit mientras el líder junta el lote
+    uint64_t lsn_durable;          // todo hasta este LSN está en disco
+    int sincronizando;             // hay un líder activo
+    int esperando;                 // commits esperando su fdatasync
+    long fsyncs, commits;          // estadísticas (SHOW COMPACTION)
+} grupo = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0 };
+
+static long grupo_retraso_us = 0;  // MICRODB_GRUPO_RETRASO_US
+static long grupo_max_lote = 64;   // MICRODB_GRUPO_MAX_LOTE
+
+static void load_config_grupo(void) {
+    grupo_retraso_us = config_entero_env("MICRODB_GRUPO_RETRASO_US", grupo_retraso_us, 0);
+    if (grupo_retraso_us > 1000000) grupo_retraso_us = 1000000;
+    grupo_max_lote = config_entero_env("MICRODB_GRUPO_MAX_LOTE", grupo_max_lote, 1);
+}
+
+// Bloquea hasta que el WAL esté en disco al menos hasta 'lsn'. Si el fdatasync falla no
+// vuelve: después de un error no se sabe qué llegó al disco (un fdatasync posterior puede
+// dar éxito aunque se hayan perdido páginas), así que el servidor se detiene.
+static void wal_esperar_durable(uint64_t lsn) {
+    pthread_mutex_lock(&grupo.mutex);
+    grupo.esperando++;
+    grupo.commits++;
+    pthread_cond_signal(&grupo.llegada);
+    while (grupo.lsn_durable < lsn) {
+        if (grupo.sincronizando) {
+            pthread_cond_wait(&grupo.hecho, &grupo.mutex);
+            continue;
+        }
+        grupo.sincronizando = 1;
+        if (grupo_retraso_us > 0) {
+            struct timespec limite;
+            clock_gettime(CLOCK_REALTIME, &limite);
+            limite.tv_nsec += grupo_retraso_us * 1000L;
+            limite.tv_sec += limite.tv_nsec / 1000000000L;
+            limite.tv_nsec %= 1000000000L;
+            while (grupo.esperando < grupo_max_lote &&
+                   pthread_cond_timedwait(&grupo.llegada, &grupo.mutex, &limite) != ETIMEDOUT) {}
+        }
+        pthread_mutex_unlock(&grupo.mutex);
+
+        // Se sincroniza todo lo escrito hasta ahora, también lo de los que llegaron detrás.
+        // dup: una compactación puede rotar (y cerrar) wal_fd mientras dura el fdatasync.
+        // Si dup falla (EMFILE con muchas conexiones) no se perdió nada: se sincroniza
+        // wal_fd sin soltar mutex_escritura, a costa de frenar a los escritores mientras tanto.
+        pthread_mutex_lock(&mutex_escritura);
+        uint64_t objetivo = wal_lsn;
+        int fd = (wal_fd >= 0) ? dup(wal_fd) : -1;
+        int sincronizado;
+        if (fd < 0 && wal_fd >= 0) {
+            sincronizado = fdatasync(wal_fd) == 0;
+            pthread_mutex_unlock(&mutex_escritura);
+        } else {
+            pthread_mutex_unlock(&mutex_escritura);
+            sincronizado = (fd >= 0) && fdatasync(fd) == 0;
+            if (fd >= 0) close(fd);
+        }
+        if (!sincronizado) {
+            perror("[WAL] fdatasync");
+            wal_panico("fallo el fdatasync del WAL");
+        }
+
+        pthread_mutex_lock(&grupo.mutex);
+        if (objetivo > grupo.lsn_durable) grupo.lsn_durable = objetivo;
+        grupo.fsyncs++;
+        grupo.sincronizando = 0;
+        pthread_cond_broadcast(&grupo.hecho);
+    }
+    grupo.esperando--;
+    pthread_mutex_unlock(&grupo.mutex);
+}
+
+static void grupo_estadisticas(long *fsyncs, long *commits) {
+    pthread_mutex_lock(&grupo.mutex);
+    *fsyncs = grupo.fsyncs;
+    *commits = grupo.commits;
+    pthread_mutex_unlock(&grupo.mutex);
+}
+
+// Mapea el archivo base (o importa el CSV si todavía no existe) y reaplica el WAL.
+// Devuelve 0 si el servidor no puede arrancar.
+static int cargar_base_de_datos(void) {
+    crc32_init();
+    load_config_compactacion(&config_compactacion);
+    load_config_grupo();
+    load_config_cache();
+    long nucleos = sysconf(_SC_NPROCESSORS_ONLN);
+    hilos_carga = (int)config_entero_env("MICRODB_HILOS_CARGA", nucleos > 0 ? nucleos : 1, 1);
+    if (hilos_carga > MAX_HILOS_CARGA) hilos_carga = MAX_HILOS_CARGA;
+    hilos_consulta = (int)config_entero_env("MICRODB_HILOS_CONSULTA", nucleos > 0 ? nucleos : 1, 1);
+    if (hilos_consulta > MAX_HILOS_CARGA) hilos_consulta = MAX_HILOS_CARGA;
+    struct timespec inicio;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    uint64_t lsn_base = 0;
+    long filas = 0;
+    const char *origen = DB_FILE_NAME;
+    int cargada = tabla_cargar_binaria(&tabla, DB_FILE_NAME, &lsn_base);
+    if (cargada == 0) {
+        fprintf(stderr, "ERROR: %s esta danado o no es un archivo de Micro DB.\n", DB_FILE_NAME);
+        return 0;
+    }
+    if (cargada == 1) {
+        filas = (long)tabla.num_vivas;
+    } else {
+        // Primer arranque: se migra el CSV que produce generador_datos
+        origen = CSV_FILE_NAME;
+        filas = tabla_cargar_csv(&tabla, CSV_FILE_NAME);
+        if (filas == -2) {
+            fprintf(stderr, "ERROR: Memoria insuficiente al cargar %s.\n", CSV_FILE_NAME);
+            return 0;
+        }
+        if (filas == -1) {
+            printf("[SERVIDOR] ADVERTENCIA: No se encontro %s ni %s; se inicia con la tabla vacia.\n", DB_FILE_NAME, CSV_FILE_NAME);
+            filas = 0;
+        }
+    }
+    long reaplicados = wal_abrir_y_reaplicar(&tabla, lsn_base);
+    if (reaplicados < 0) {
+        perror("No se pudo abrir o reaplicar el WAL " WAL_FILE_NAME);
+        return 0;
+    }
+    double ms = ms_desde(&inicio);
+    printf("[SERVIDOR] Tabla cargada: %ld filas de %s, %ld operaciones reaplicadas del WAL, %zu filas vigentes en %zu paginas.\n",
+           filas, origen, reaplicados, tabla.num_vivas, tabla.num_paginas);
+    printf("[SERVIDOR] Carga en %.1f ms (%.0f filas/s, %d hilos).\n",
+           ms, ms > 0 ? (double)filas / (ms / 1000.0) : 0.0, hilos_carga);
+    if (cargada != 1) {
+        if (ejecutar_compactacion(1) < 0) return 0;
+        printf("[SERVIDOR] Creado %s a partir de %s.\n", DB_FILE_NAME, origen);
+    }
+    stats_compactacion.ultimo_tamanio_base = tamanio_archivo(DB_FILE_NAME);
+
+    if (pthread_create(&hilo_compactacion, NULL, compactacion_thread, NULL) != 0) {
+        perror("pthread_create compactacion");
+        return 0;
+    }
+    hilo_compactacion_activo = 1;
+    return 1;
+}
+
+// Detiene el hilo de compactación y hace un checkpoint final para dejar el archivo base al día
+static void cerrar_base_de_datos(void) {
+    if (hilo_compactacion_activo) {
+        pthread_mutex_lock(&mutex_compactacion);
+        compactacion_detener = 1;
+        pthread_cond_signal(&cond_compactacion);
+        pthread_mutex_unlock(&mutex_compactacion);
+        pthread_join(hilo_compactacion, NULL);
+        hilo_compactacion_activo = 0;
+    }
+    if (wal_fd >= 0) {
+        if (ejecutar_compactacion(0) < 0) {
+            printf("[SERVIDOR] ADVERTENCIA: Checkpoint final fallido; el WAL se reaplicara al reiniciar.\n");
+        }
+        pthread_mutex_lock(&mutex_escritura);
+        close(wal_fd);
+        wal_fd = -1;
+        pthread_mutex_unlock(&mutex_escritura);
+    }
+    // Un hilo de cliente rezagado verá la tabla vacía en lugar de páginas ya liberadas
+    pthread_rwlock_wrlock(&rwlock_tabla);
+    tabla_liberar(&tabla);
+    pthread_rwlock_unlock(&rwlock_tabla);
+}
+
+// --- Caché de resultados
+//
+// Los SELECT que se repiten (un tablero que pide una y otra vez el mismo
+// "SELECT WHERE Producto=...") se responden desde una caché LRU cuya clave es el texto
+// normalizado de la consulta. Cada cambio confirmado (COMMIT, BATCH, IMPORT) incrementa
+// version_tabla con el wrlock tomado; la consulta anota la versión antes de leer la tabla
+// y su resultado sólo se guarda y se sirve mientras la versión siga siendo ésa. Así un
+// COMMIT invalida la caché entera sin recorrerla: se vacía en el acceso siguiente.
+// La memoria se acota con MICRODB_CACHE_MB (0 la apaga) y un resultado de más de
+// 1/16 de ese total no se guarda. Las consultas de una transacción con cambios propios
+// no la usan.
+
+#define BUCKETS_CACHE 4096 // potencia de 2
+#define CACHE_MB_POR_DEFECTO 16
+
+typedef struct EntradaCache {
+    struct EntradaCache *sig_bucket;
+    struct EntradaCache *anterior, *siguiente; // orden LRU: la primera es la más reciente
+    uint32_t hash;
+    size_t largo_clave, len;
+    char *datos;  // a continuación de la clave, en el mismo bloque
+    char clave[];
+} EntradaCache;
+
+static pthread_mutex_t mutex_cache = PTHREAD_MUTEX_INITIALIZER;
+static size_t cache_max_bytes = (size_t)CACHE_MB_POR_DEFECTO * 1024 * 1024; // MICRODB_CACHE_MB
+static struct {
+    EntradaCache *buckets[BUCKETS_CACHE];
+    EntradaCache *primera, *ultima;
+    uint64_t version;        // versión de la tabla de todas las entradas
+    size_t entradas, bytes;
+    long aciertos, fallos, guardadas, desalojadas, invalidaciones;
+} cache;
+
+static void load_config_cache(void) {
+    cache_max_bytes = (size_t)config_entero_env("MICRODB_CACHE_MB", CACHE_MB_POR_DEFECTO, 0) * 1024 * 1024;
+}
+
+static size_t cache_max_entrada(void) {
+    return cache_max_bytes / 16;
+}
+
+// Incrementa la versión de la tabla: llamar con el wrlock tomado, después de cambiarla
+static void tabla_nueva_version(void) {
+    __atomic_add_fetch(&version_tabla, 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t tabla_version_actual(void) {
+    return __atomic_load_n(&version_tabla, __ATOMIC_ACQUIRE);
+}
+
+// Copia la consulta a 'clave' sin espacios repetidos ni espacios junto a los operadores,
+// así "SELECT WHERE Producto = Mouse" y "SELECT  WHERE Producto=Mouse" comparten entrada.
+// 'clave' tiene lugar para MAX_COMMAND_LENGTH bytes.
+static size_t cache_normalizar(const char *consulta, char *clave) {
+    size_t n = 0;
+    int espacio = 0;
+    for (const char *p = consulta; *p && n < MAX_COMMAND_LENGTH - 1; p++) {
+        if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            espacio = 1;
+            continue;
+        }
+        int operador = (*p == '=' || *p == '<' || *p == '>');
+        if (espacio && n > 0 && !operador && !strchr("=<>", clave[n - 1])) clave[n++] = ' ';
+        espacio = 0;
+        if (n < MAX_COMMAND_LENGTH - 1) clave[n++] = *p;
+    }
+    clave[n] = '\0';
+    return n;
+}
+
+static void cache_sacar(EntradaCache *e) {
+    EntradaCache **pp = &cache.buckets[e->hash & (BUCKETS_CACHE - 1)];
+    while (*pp != e) pp = &(*pp)->sig_bucket;
+    *pp = e->sig_bucket;
+    if (e->anterior) e->anterior->siguiente = e->siguiente; else cache.primera = e->siguiente;
+    if (e->siguiente) e->siguiente->anterior = e->anterior; else cache.ultima = e->anterior;
+    cache.entradas--;
+    cache.bytes -= sizeof(EntradaCache) + e->largo_clave + e->len;
+    free(e);
+}
+
+static void cache_al_frente(EntradaCache *e) {
+    if (cache.primera == e) return;
+    e->anterior->siguiente = e->siguiente;
+    if (e->siguiente) e->siguiente->anterior = e->anterior; else cache.ultima = e->anterior;
+    e->anterior = NULL;
+    e->siguiente = cache.primera;
+    cache.primera->anterior = e;
+    cache.primera = e;
+}
+
+// Con mutex_cache tomado. Si la tabla cambió desde que se llenó la caché, la vacía y la
+// pasa a 'version'. Devuelve 1 si las entradas valen para una consulta que leyó 'version'.
+static int cache_vigente(uint64_t version) {
+    if (version > cache.version) {
+        if (cache.entradas > 0) cache.invalidaciones++;
+        while (cache.ultima) cache_sacar(cache.ultima);
+        cache.version = version;
+    }
+    return version == cache.version;
+}
+
+static EntradaCache *cache_encontrar(const char *clave, size_t largo, uint32_t hash) {
+    for (EntradaCache *e = cache.buckets[hash & (BUCKETS_CACHE - 1)]; e; e = e->sig_bucket) {
+        if (e->hash == hash && e->largo_clave == largo && memcmp(e->clave, clave, largo) == 0) return e;
+    }
+    return NULL;
+}
+
+// Copia a 'out' el resultado guardado para la consulta, si está vigente. Devuelve 1 si lo encontró.
+static int cache_buscar(const char *clave, size_t largo, Salida *out) {
+    uint64_t version = tabla_version_actual();
+    uint32_t hash = hash_texto(clave, largo);
+    pthread_mutex_lock(&mutex_cache);
+    EntradaCache *e = cache_vigente(version) ? cache_encontrar(clave, largo, hash) : NULL;
+    if (e) {
+        cache_al_frente(e);
+        salida_agregar(out, e->datos, e->len);
+        cache.aciertos++;
+    } else {
+        cache.fallos++;
+    }
+    pthread_mutex_unlock(&mutex_cache);
+    return e != NULL;
+}
+
+// Guarda el resultado de una consulta que leyó la tabla en 'version'. Si la tabla ya
+// cambió, o el resultado es muy grande, no hace nada.
+static void cache_guardar(const char *clave, size_t largo, uint64_t version, const char *datos, size_t len) {
+    if (len > cache_max_entrada() || version != tabla_version_actual()) return;
+    EntradaCache *e = (EntradaCache *)malloc(sizeof(EntradaCache) + largo + len);
+    if (!e) return;
+    memcpy(e->clave, clave, largo);
+    e->datos = e->clave + largo;
+    memcpy(e->datos, datos, len);
+    e->largo_clave = largo;
+    e->len = len;
+    e->hash = hash_texto(clave, largo);
+    e->anterior = NULL;
+
+    pthread_mutex_lock(&mutex_cache);
+    if (!cache_vigente(version) || cache_encontrar(clave, largo, e->hash)) {
+        pthread_mutex_unlock(&mutex_cache);
+        free(e);
+        return;
+    }
+    EntradaCache **bucket = &cache.buckets[e->hash & (BUCKETS_CACHE - 1)];
+    e->sig_bucket = *bucket;
+    *bucket = e;
+    e->siguiente = cache.primera;
+    if (cache.primera) cache.primera->anterior = e; else cache.ultima = e;
+    cache.primera = e;
+    cache.entradas++;
+    cache.bytes += sizeof(EntradaCache) + largo + len;
+    cache.guardadas++;
+    while (cache.bytes > cache_max_bytes && cache.ultima != e) {
+        cache_sacar(cache.ultima);
+        cache.desalojadas++;
+    }
+    pthread_mutex_unlock(&mutex_cache);
+}
+
+// SHOW CACHE: aciertos y fallos para dimensionar MICRODB_CACHE_MB
+static void cache_reporte(Salida *out) {
+    pthread_mutex_lock(&mutex_cache);
+    long consultas = cache.aciertos + cache.fallos;
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+        "OK: Estadisticas de la cache de resultados\n"
+        "aciertos=%ld\n"
+        "fallos=%ld\n"
+        "aciertos_pct=%.1f\n"
+        "entradas=%zu\n"
+        "bytes=%zu\n"
+        "max_bytes=%zu\n"
+        "max_bytes_entrada=%zu\n"
+        "guardadas=%ld\n"
+        "desalojadas=%ld\n"
+        "invalidaciones=%ld\n"
+        "version_tabla=%llu\n",
+        cache.aciertos, cache.fallos, consultas ? 100.0 * (double)cache.aciertos / (double)consultas : 0.0,
+        cache.entradas, cache.bytes, cache_max_bytes, cache_max_entrada(),
+        cache.guardadas, cache.desalojadas, cache.invalidaciones,
+        (unsigned long long)tabla_version_actual());
+    pthread_mutex_unlock(&mutex_cache);
+    salida_texto(out, buf);
+}
+
+// --- STATS y puerto de métricas
+//
+// Los dos reportes salen de los contadores de "Métricas". STATS usa líneas clave=valor
+// como SHOW CACHE, con una línea por cada tipo de comando ya usado. El puerto de
+// métricas usa el formato de texto de Prometheus y lista todos los tipos, para que las
+// series no aparezcan y desaparezcan. Lo atiende un hilo propio, un pedido por vez: cada
+// GET recibe el reporte entero y la conexión se cierra.
+
+typedef struct {
+    size_t filas_vigentes, slots, paginas, indice_bytes;
+    long long wal_bytes, base_bytes;
+} TamanioTabla;
+
+static int socket_metricas = -1; // -1: puerto de métricas desactivado (MICRODB_PUERTO_METRICAS=0)
+static pthread_t hilo_metricas;
+
+static uint64_t metrica_leer(const uint64_t *contador) {
+    return __atomic_load_n(contador, __ATOMIC_RELAXED);
+}
+
+static void tabla_tamanio(TamanioTabla *t) {
+    pthread_rwlock_rdlock(&rwlock_tabla);
+    t->filas_vigentes = tabla.num_vivas;
+    t->slots = tabla.num_filas;
+    t->paginas = tabla.num_paginas;
+    t->indice_bytes = tabla.indice_capacidad * sizeof(EntradaIndice);
+    pthread_rwlock_unlock(&rwlock_tabla);
+    pthread_mutex_lock(&mutex_escritura);
+    t->wal_bytes = (long long)wal_bytes;
+    pthread_mutex_unlock(&mutex_escritura);
+    pthread_mutex_lock(&mutex_compactacion);
+    t->base_bytes = (long long)stats_compactacion.ultimo_tamanio_base;
+    pthread_mutex_unlock(&mutex_compactacion);
+}
+
+// "cantidad=... total_ms=... p50_ms=... p99_ms=... p999_ms=... max_ms=..." de un histograma
+static void reporte_histograma(Salida *out, const char *prefijo, const Histograma *h) {
+    char linea[320];
+    snprintf(linea, sizeof(linea), "%s cantidad=%llu total_ms=%.3f p50_ms=%.3f p99_ms=%.3f p999_ms=%.3f max_ms=%.3f",
+             prefijo, (unsigned long long)metrica_leer(&h->cantidad), (double)metrica_leer(&h->suma_ns) / 1e6,
+             (double)histograma_percentil(h, 0.5) / 1e6, (double)histograma_percentil(h, 0.99) / 1e6,
+             (double)histograma_percentil(h, 0.999) / 1e6, (double)metrica_leer(&h->max_ns) / 1e6);
+    salida_texto(out, linea);
+}
+
+// STATS: contadores generales, locks y latencia por tipo de comando
+static void metricas_reporte(Salida *out) {
+    TamanioTabla t;
+    tabla_tamanio(&t);
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+        "OK: Estadisticas del servidor\n"
+        "activo_seg=%.0f\n"
+        "conexiones_activas=%d\n"
+        "conexiones_aceptadas=%llu\n"
+        "conexiones_rechazadas=%llu\n"
+        "max_clientes=%d\n"
+        "transacciones_abiertas=%d\n"
+        "bytes_recibidos=%llu\n"
+        "bytes_enviados=%llu\n"
+        "filas_vigentes=%zu\n"
+        "slots=%zu\n"
+        "paginas=%zu\n"
+        "tabla_bytes=%zu\n"
+        "indice_bytes=%zu\n"
+        "wal_bytes=%lld\n"
+        "base_bytes=%lld\n"
+        "lock_conflictos=%llu\n"
+        "lock_vencidos=%llu\n",
+        (double)(reloj_ns() - metricas.inicio_ns) / 1e9,
+        __atomic_load_n(&clientes_activos, __ATOMIC_RELAXED),
+        (unsigned long long)metrica_leer(&metricas.conexiones_aceptadas),
+        (unsigned long long)metrica_leer(&metricas.conexiones_rechazadas),
+        max_clientes_config, __atomic_load_n(&transacciones_abiertas, __ATOMIC_RELAXED),
+        (unsigned long long)metrica_leer(&metricas.bytes_recibidos),
+        (unsigned long long)metrica_leer(&metricas.bytes_enviados),
+        t.filas_vigentes, t.slots, t.paginas, t.paginas * (size_t)TAM_PAGINA, t.indice_bytes,
+        t.wal_bytes, t.base_bytes,
+        (unsigned long long)metrica_leer(&metricas.conflictos_lock),
+        (unsigned long long)metrica_leer(&metricas.vencidos_lock));
+    salida_texto(out, buf);
+    reporte_histograma(out, "lock=espera", &metricas.espera_lock);
+    salida_texto(out, "\n");
+    reporte_histograma(out, "lock=tenencia", &metricas.tenencia_lock);
+    salida_texto(out, "\n");
+    for (int i = 0; i < NUM_TIPOS_COMANDO; i++) {
+        if (metrica_leer(&metricas.comandos[i].cantidad) == 0) continue;
+        char prefijo[64];
+        snprintf(prefijo, sizeof(prefijo), "comando=%s", nombres_comando[i]);
+        reporte_histograma(out, prefijo, &metricas.comandos[i]);
+        snprintf(buf, sizeof(buf), " errores=%llu\n", (unsigned long long)metrica_leer(&metricas.errores[i]));
+        salida_texto(out, buf);
+    }
+}
+
+static void prometheus_valor(Salida *out, const char *nombre, const char *tipo, const char *ayuda, double valor) {
+    char linea[384];
+    snprintf(linea, sizeof(linea), "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", nombre, ayuda, nombre, tipo, nombre, valor);
+    salida_texto(out, linea);
+}
+
+// Cuantiles, suma y cantidad de un histograma (tipo summary, en segundos). 'etiqueta' va
+// delante de quantile, con su coma: "comando=\"select\"," o "".
+static void prometheus_resumen(Salida *out, const char *nombre, const char *etiqueta, const Histograma *h) {
+    static const double cuantiles[] = { 0.5, 0.99, 0.999 };
+    char linea[320];
+    for (size_t i = 0; i < sizeof(cuantiles) / sizeof(cuantiles[0]); i++) {
+        snprintf(linea, sizeof(linea), "%s{%squantile=\"%g\"} %.9f\n", nombre, etiqueta, cuantiles[i],
+                 (double)histograma_percentil(h, cuantiles[i]) / 1e9);
+        salida_texto(out, linea);
+    }
+    char etiquetas[128] = "";
+    size_t largo = strlen(etiqueta);
+    if (largo > 0) snprintf(etiquetas, sizeof(etiquetas), "{%.*s}", (int)largo - 1, etiqueta); // sin la coma final
+    snprintf(linea, sizeof(linea), "%s_sum%s %.9f\n%s_count%s %llu\n",
+             nombre, etiquetas, (double)metrica_leer(&h->suma_ns) / 1e9,
+             nombre, etiquetas, (unsigned long long)metrica_leer(&h->cantidad));
+    salida_texto(out, linea);
+}
+
+static void metricas_prometheus(Salida *out) {
+    TamanioTabla t;
+    tabla_tamanio(&t);
+    char linea[160];
+    prometheus_valor(out, "microdb_activo_segundos", "gauge", "Tiempo desde el arranque.",
+                     (double)(reloj_ns() - metricas.inicio_ns) / 1e9);
+    prometheus_valor(out, "microdb_conexiones_activas", "gauge", "Conexiones abiertas.",
+                     __atomic_load_n(&clientes_activos, __ATOMIC_RELAXED));
+    prometheus_valor(out, "microdb_conexiones_aceptadas_total", "counter", "Conexiones aceptadas.",
+                     (double)metrica_leer(&metricas.conexiones_aceptadas));
+    prometheus_valor(out, "microdb_conexiones_rechazadas_total", "counter", "Conexiones rechazadas por superar el maximo de clientes.",
+                     (double)metrica_leer(&metricas.conexiones_rechazadas));
+    prometheus_valor(out, "microdb_transacciones_abiertas", "gauge", "Transacciones abiertas.",
+                     __atomic_load_n(&transacciones_abiertas, __ATOMIC_RELAXED));
+    prometheus_valor(out, "microdb_bytes_recibidos_total", "counter", "Bytes recibidos de los clientes.",
+                     (double)metrica_leer(&metricas.bytes_recibidos));
+    prometheus_valor(out, "microdb_bytes_enviados_total", "counter", "Bytes enviados a los clientes.",
+                     (double)metrica_leer(&metricas.bytes_enviados));
+    prometheus_valor(out, "microdb_tabla_filas", "gauge", "Filas vigentes.", (double)t.filas_vigentes);
+    prometheus_valor(out, "microdb_tabla_paginas", "gauge", "Paginas de datos en memoria.", (double)t.paginas);
+    prometheus_valor(out, "microdb_tabla_bytes", "gauge", "Bytes de las paginas de datos.", (double)t.paginas * TAM_PAGINA);
+    prometheus_valor(out, "microdb_indice_bytes", "gauge", "Bytes del indice por ID.", (double)t.indice_bytes);
+    prometheus_valor(out, "microdb_wal_bytes", "gauge", "Bytes del WAL.", (double)t.wal_bytes);
+    prometheus_valor(out, "microdb_base_bytes", "gauge", "Bytes del archivo base.", (double)t.base_bytes);
+    prometheus_valor(out, "microdb_lock_conflictos_total", "counter", "Transacciones abortadas por wait-die.",
+                     (double)metrica_leer(&metricas.conflictos_lock));
+    prometheus_valor(out, "microdb_lock_vencidos_total", "counter", "Pedidos de lock con el plazo de espera agotado.",
+                     (double)metrica_leer(&metricas.vencidos_lock));
+
+    salida_texto(out, "# HELP microdb_lock_espera_segundos Espera de los pedidos de lock que se encolaron.\n"
+                      "# TYPE microdb_lock_espera_segundos summary\n");
+    prometheus_resumen(out, "microdb_lock_espera_segundos", "", &metricas.espera_lock);
+    salida_texto(out, "# HELP microdb_lock_tenencia_segundos Del primer lock de una transaccion hasta que los suelta.\n"
+                      "# TYPE microdb_lock_tenencia_segundos summary\n");
+    prometheus_resumen(out, "microdb_lock_tenencia_segundos", "", &metricas.tenencia_lock);
+
+    salida_texto(out, "# HELP microdb_comando_segundos Latencia por tipo de comando, de la entrada a la respuesta.\n"
+                      "# TYPE microdb_comando_segundos summary\n");
+    for (int i = 0; i < NUM_TIPOS_COMANDO; i++) {
+        snprintf(linea, sizeof(linea), "comando=\"%s\",", nombres_comando[i]);
+        prometheus_resumen(out, "microdb_comando_segundos", linea, &metricas.comandos[i]);
+    }
+    salida_texto(out, "# HELP microdb_comando_errores_total Respuestas ERROR por tipo de comando.\n"
+                      "# TYPE microdb_comando_errores_total counter\n");
+    for (int i = 0; i < NUM_TIPOS_COMANDO; i++) {
+        snprintf(linea, sizeof(linea), "microdb_comando_errores_total{comando=\"%s\"} %llu\n", nombres_comando[i],
+                 (unsigned long long)metrica_leer(&metricas.errores[i]));
+        salida_texto(out, linea);
+    }
+}
+
+static void *metricas_thread(void *arg) {
+    (void)arg;
+    Salida cuerpo = { NULL, 0, 0, 0, 0 };
+    struct pollfd eventos[2] = { { socket_metricas, POLLIN, 0 }, { evento_terminar, POLLIN, 0 } };
+    while (!stop_requested) {
+        if (poll(eventos, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll metricas");
+            break;
+        }
+        if (eventos[1].revents) break;
+        int s = accept4(socket_metricas, NULL, NULL, SOCK_CLOEXEC);
+        if (s < 0) continue;
+        // Un cliente que no manda el pedido o no lee la respuesta no traba al hilo
+        struct timeval limite = { 1, 0 };
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &limite, sizeof(limite));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &limite, sizeof(limite));
+        char pedido[512];
+        ssize_t n = recv(s, pedido, sizeof(pedido) - 1, 0);
+        if (n > 0) {
+            pedido[n] = '\0';
+            int encontrado = strncmp(pedido, "GET /metrics", 12) == 0 || strncmp(pedido, "GET / ", 6) == 0;
+            salida_reiniciar(&cuerpo, 64 * 1024);
+            if (encontrado) metricas_prometheus(&cuerpo);
+            else salida_texto(&cuerpo, "Use GET /metrics\n");
+            char cabecera[192];
+            int largo = snprintf(cabecera, sizeof(cabecera),
+                                 "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                 "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                                 encontrado ? "200 OK" : "404 Not Found", cuerpo.len);
+            if (!cuerpo.sin_memoria && write_full(s, cabecera, (size_t)largo)) write_full(s, cuerpo.datos, cuerpo.len);
+        }
+        close(s);
+    }
+    free(cuerpo.datos);
+    return NULL;
+}
+
+// Puerto de métricas sólo en 127.0.0.1: no es para exponerlo fuera de la máquina
+static int iniciar_metricas(int puerto) {
+    if (puerto > 65535) return 0;
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s < 0) { perror("socket metricas"); return 0; }
+    int opt = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in direccion;
+    memset(&direccion, 0, sizeof(direccion));
+    direccion.sin_family = AF_INET;
+    direccion.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    direccion.sin_port = htons(puerto);
+    if (bind(s, (struct sockaddr *)&direccion, sizeof(direccion)) < 0 || listen(s, 16) < 0) {
+        perror("bind metricas"); close(s); return 0;
+    }
+    socket_metricas = s;
+    if (pthread_create(&hilo_metricas, NULL, metricas_thread, NULL) != 0) {
+        perror("pthread_create metricas");
+        close(s);
+        socket_metricas = -1;
+        return 0;
+    }
+    printf("[SERVIDOR] Metricas en formato Prometheus en http://127.0.0.1:%d/metrics\n", puerto);
+    return 1;
+}
+
+// Después de detener_reactores: evento_terminar ya despertó al hilo
+static void detener_metricas(void) {
+    if (socket_metricas < 0) return;
+    pthread_join(hilo_metricas, NULL);
+    close(socket_metricas);
+    socket_metricas = -1;
+}
+
+// --- TRACE DUMP: anillos de trazas a JSON de Chrome
+//
+// Ver "Trazas". Los anillos no se vacían al volcarlos: otro TRACE DUMP vuelve a incluir
+// los eventos que todavía no se pisaron.
+
+// Copia un evento que su dueño puede estar pisando; 0 si no quedó entero
+static int traza_leer_evento(const EventoTraza *e, EventoTraza *copia) {
+    copia->secuencia = __atomic_load_n(&e->secuencia, __ATOMIC_ACQUIRE);
+    if (copia->secuencia == 0) return 0;
+    copia->nombre = __atomic_load_n(&e->nombre, __ATOMIC_RELAXED);
+    copia->inicio_ns = __atomic_load_n(&e->inicio_ns, __ATOMIC_RELAXED);
+    copia->fin_ns = __atomic_load_n(&e->fin_ns, __ATOMIC_RELAXED);
+    copia->dato = __atomic_load_n(&e->dato, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&e->secuencia, __ATOMIC_RELAXED) == copia->secuencia;
+}
+
+// Escribe todos los anillos en 'archivo' (JSON de Chrome, tiempos en µs desde el arranque)
+static const char *traza_volcar(const char *archivo, size_t *eventos, int *hilos) {
+    *eventos = 0;
+    *hilos = 0;
+    int fd = open(archivo, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return "ERROR: No se pudo crear el archivo de la traza.\n";
+    Salida s = { NULL, 0, 0, 0, 0 };
+    char linea[256];
+    int ok = 1;
+    salida_texto(&s, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                     "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Micro DB\"}}");
+    int n = __atomic_load_n(&num_anillos_traza, __ATOMIC_RELAXED);
+    for (int i = 0; i < n && ok; i++) {
+        const AnilloTraza *a = __atomic_load_n(&anillos_traza[i], __ATOMIC_ACQUIRE);
+        if (!a) continue; // recién reservado: todavía sin eventos
+        (*hilos)++;
+        snprintf(linea, sizeof(linea), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                 a->tid, a->hilo);
+        salida_texto(&s, linea);
+        for (size_t j = 0; j < EVENTOS_TRAZA_POR_HILO; j++) {
+            EventoTraza e;
+            if (!traza_leer_evento(&a->eventos[j], &e)) continue;
+            double ts = (double)(int64_t)(e.inicio_ns - metricas.inicio_ns) / 1000.0;
+            double dur = (double)(e.fin_ns - e.inicio_ns) / 1000.0;
+            int largo = snprintf(linea, sizeof(linea), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                                 e.nombre, a->tid, ts, dur);
+            if (e.dato >= 0) snprintf(linea + largo, sizeof(linea) - (size_t)largo, ",\"args\":{\"dato\":%ld}}", e.dato);
+            else snprintf(linea + largo, sizeof(linea) - (size_t)largo, "}");
+            salida_texto(&s, linea);
+            (*eventos)++;
+        }
+        // Un anillo por vez: la memoria no crece con la cantidad de hilos
+        ok = !s.sin_memoria && write_full(fd, s.datos, s.len);
+        salida_reiniciar(&s, 1024 * 1024);
+    }
+    salida_texto(&s, "\n]}\n");
+    ok = ok && !s.sin_memoria && write_full(fd, s.datos, s.len);
+    free(s.datos);
+    if (close(fd) != 0) ok = 0;
+    return ok ? NULL : "ERROR: No se pudo escribir el archivo de la traza.\n";
+}
+
+// TRACE ON | TRACE OFF | TRACE DUMP [archivo.json]
+static void comando_traza(const char *command, Salida *out) {
+    const char *resto = command + 5;
+    while (*resto == ' ') resto++;
+    char msg[256];
+    if (strcmp(resto, "ON") == 0 || strcmp(resto, "OFF") == 0) {
+        int activar = (resto[1] == 'N');
+        __atomic_store_n(&traza_activa, activar, __ATOMIC_RELAXED);
+        salida_texto(out, activar ? "OK: Trazas activadas.\n" : "OK: Trazas desactivadas; los eventos guardados siguen disponibles para TRACE DUMP.\n");
+    } else if (strncmp(resto, "DUMP", 4) == 0 && (resto[4] == '\0' || resto[4] == ' ')) {
+        char archivo[128], extra[2];
+        int n = sscanf(resto + 4, "%127s %1s", archivo, extra);
+        size_t l = (n >= 1) ? strlen(archivo) : 0;
+        if (n <= 0) strcpy(archivo, TRACE_FILE_NAME);
+        if (n == 2) {
+            salida_texto(out, "ERROR: Se esperaba un solo nombre de archivo.\n");
+        } else if (n == 1 && (strchr(archivo, '/') || archivo[0] == '.' || l < 6 || strcasecmp(archivo + l - 5, ".json") != 0)) {
+            salida_texto(out, "ERROR: El archivo debe ser un nombre .json sin directorios.\n");
+        } else {
+            size_t eventos;
+            int hilos;
+            const char *error = traza_volcar(archivo, &eventos, &hilos);
+            if (error) {
+                salida_texto(out, error);
+            } else {
+                snprintf(msg, sizeof(msg), "OK: Traza de %zu eventos de %d hilos escrita en %s (chrome://tracing o ui.perfetto.dev).\n",
+                         eventos, hilos, archivo);
+                salida_texto(out, msg);
+            }
+        }
+    } else {
+        salida_texto(out, "ERROR: Use TRACE ON, TRACE OFF o TRACE DUMP [archivo.json].\n");
+    }
+}
+
+// --- Planificación de consultas (WHERE / ORDER BY / LIMIT / OFFSET)
+
+typedef enum {
+    CAMPO_NINGUNO = -1,
+    CAMPO_ID = 0,
+    CAMPO_PRODUCTO,
+    CAMPO_CANTIDAD,
+    CAMPO_PRECIO
+} CampoRegistro;
+
+typedef enum {
+    OP_IGUAL,
+    OP_MENOR,
+    OP_MENOR_IGUAL,
+    OP_MAYOR,
+    OP_MAYOR_IGUAL
+} OperadorFiltro;
+
+typedef struct {
+    int tiene_filtro;
+    CampoRegistro filtro_campo;
+    OperadorFiltro filtro_op;
+    char filtro_valor[128];
+    int64_t filtro_numero;      // valor ya convertido: ID/Cantidad tal cual, Precio en centavos
+    long filtro_codigo;         // código de Producto en el diccionario (-1 si no existe)
+    CampoRegistro orden_campo;  // CAMPO_NINGUNO si no hay ORDER BY
+    int orden_desc;
+    long limite;                // -1 si no hay LIMIT
+    long desplazamiento;        // OFFSET (0 por defecto)
+} PlanConsulta;
+
+// Elemento del heap top-K: el número de secuencia desempata en orden de archivo
+typedef struct {
+    FilaDisco fila;
+    long secuencia;
+} FilaOrdenada;
+
+static CampoRegistro campo_desde_nombre(const char *nombre) {
+    if (strcasecmp(nombre, "ID") == 0) return CAMPO_ID;
+    if (strcasecmp(nombre, "Producto") == 0) return CAMPO_PRODUCTO;
+    if (strcasecmp(nombre, "Cantidad") == 0) return CAMPO_CANTIDAD;
+    if (strcasecmp(nombre, "Precio") == 0) return CAMPO_PRECIO;
+    return CAMPO_NINGUNO;
+}
+
+static void strip_quotes(char *value) {
+    size_t vlen = strlen(value);
+    if ((vlen >= 2) && ((value[0] == '"' && value[vlen-1] == '"') || (value[0] == '\'' && value[vlen-1] == '\''))) {
+        value[vlen-1] = '\0';
+        memmove(value, value+1, vlen-1);
+    }
+}
+
+static int es_select_all_simple(const char *command) {
+    while (*command == ' ' || *command == '\t') command++;
+    if (strncmp(command, "SELECT ALL", 10) != 0) return 0;
+    const char *resto = command + 10;
+    while (*resto == ' ' || *resto == '\t' || *resto == '\r') resto++;
+    return *resto == '\0';
+}
+
+// Interpreta las cláusulas opcionales ORDER BY <campo> [ASC|DESC] LIMIT n OFFSET m.
+// Devuelve NULL si son válidas o un mensaje de error estático.
+static const char *parse_clausulas_orden(const char *texto, PlanConsulta *plan) {
+    char tok[32];
+    int n;
+    while (sscanf(texto, "%31s%n", tok, &n) == 1) {
+        texto += n;
+        if (strcasecmp(tok, "ORDER") == 0) {
+            if (plan->orden_campo != CAMPO_NINGUNO) return "ERROR: ORDER BY duplicado.\n";
+            if (sscanf(texto, "%31s%n", tok, &n) != 1 || strcasecmp(tok, "BY") != 0) return "ERROR: Se esperaba BY despues de ORDER.\n";
+            texto += n;
+            if (sscanf(texto, "%31s%n", tok, &n) != 1) return "ERROR: Falta el campo de ORDER BY.\n";
+            texto += n;
+            plan->orden_campo = campo_desde_nombre(tok);
+            if (plan->orden_campo == CAMPO_NINGUNO) return "ERROR: Campo de ORDER BY desconocido.\n";
+            // Dirección opcional
+            if (sscanf(texto, "%31s%n", tok, &n) == 1) {
+                if (strcasecmp(tok, "DESC") == 0) { plan->orden_desc = 1; texto += n; }
+                else if (strcasecmp(tok, "ASC") == 0) { plan->orden_desc = 0; texto += n; }
+            }
+        } else if (strcasecmp(tok, "LIMIT") == 0) {
+            long v;
+            if (plan->limite >= 0) return "ERROR: LIMIT duplicado.\n";
+            if (sscanf(texto, "%ld%n", &v, &n) != 1 || v < 0) return "ERROR: LIMIT requiere un entero no negativo.\n";
+            texto += n;
+            plan->limite = v;
+        } else if (strcasecmp(tok, "OFFSET") == 0) {
+            long v;
+            if (sscanf(texto, "%ld%n", &v, &n) != 1 || v < 0) return "ERROR: OFFSET requiere un entero no negativo.\n";
+            texto += n;
+            plan->desplazamiento = v;
+        } else {
+            return "ERROR: Clausula no reconocida. Use ORDER BY, LIMIT u OFFSET.\n";
+        }
+    }
+    return NULL;
+}
+
+static int operador_desde_texto(const char *op, OperadorFiltro *out) {
+    if (strcmp(op, "=") == 0)  { *out = OP_IGUAL; return 1; }
+    if (strcmp(op, "<") == 0)  { *out = OP_MENOR; return 1; }
+    if (strcmp(op, "<=") == 0) { *out = OP_MENOR_IGUAL; return 1; }
+    if (strcmp(op, ">") == 0)  { *out = OP_MAYOR; return 1; }
+    if (strcmp(op, ">=") == 0) { *out = OP_MAYOR_IGUAL; return 1; }
+    return 0;
+}
+
+static int cumple_operador(int64_t v, OperadorFiltro op, int64_t x) {
+    switch (op) {
+        case OP_IGUAL:       return v == x;
+        case OP_MENOR:       return v < x;
+        case OP_MENOR_IGUAL: return v <= x;
+        case OP_MAYOR:       return v > x;
+        case OP_MAYOR_IGUAL: return v >= x;
+    }
+    return 0;
+}
+
+// Los filtros comparan la fila de disco tal cual: Producto por código y Precio en centavos
+static int fila_cumple_filtro(const FilaDisco *f, const PlanConsulta *plan) {
+    if (!plan->tiene_filtro) return 1;
+    switch (plan->filtro_campo) {
+        case CAMPO_ID:       return cumple_operador(f->id, plan->filtro_op, plan->filtro_numero);
+        case CAMPO_PRODUCTO: return (long)f->producto == plan->filtro_codigo;
+        case CAMPO_CANTIDAD: return cumple_operador(f->cantidad, plan->filtro_op, plan->filtro_numero);
+        case CAMPO_PRECIO:   return cumple_operador(f->precio, plan->filtro_op, plan->filtro_numero);
+        default:             return 0;
+    }
+}
+
+// 0 si el zone map (o el Bloom de Producto) garantiza que ninguna fila de la página cumple el filtro
+static int pagina_puede_cumplir(const Pagina *p, const PlanConsulta *plan) {
+    if (p->num_vivas == 0) return 0;
+    if (!plan->tiene_filtro) return 1;
+    int64_t min, max;
+    switch (plan->filtro_campo) {
+        case CAMPO_PRODUCTO: return bloom_contiene(p, (uint32_t)plan->filtro_codigo);
+        case CAMPO_ID:       min = p->min_id; max = p->max_id; break;
+        case CAMPO_CANTIDAD: min = p->min_cantidad; max = p->max_cantidad; break;
+        case CAMPO_PRECIO:   min = p->min_precio; max = p->max_precio; break;
+        default:             return 1;
+    }
+    int64_t x = plan->filtro_numero;
+    switch (plan->filtro_op) {
+        case OP_IGUAL:       return min <= x && x <= max;
+        case OP_MENOR:       return min < x;
+        case OP_MENOR_IGUAL: return min <= x;
+        case OP_MAYOR:       return max > x;
+        case OP_MAYOR_IGUAL: return max >= x;
+    }
+    return 1;
+}
+
+// Llamar con rwlock_tabla tomado: Producto se ordena por nombre, no por código
+static int comparar_campo(const FilaDisco *a, const FilaDisco *b, CampoRegistro campo) {
+    switch (campo) {
+        case CAMPO_ID:       return (a->id > b->id) - (a->id < b->id);
+        case CAMPO_PRODUCTO: return (a->producto == b->producto) ? 0 :
+                                    strcmp(tabla.dic.nombres[a->producto], tabla.dic.nombres[b->producto]);
+        case CAMPO_CANTIDAD: return (a->cantidad > b->cantidad) - (a->cantidad < b->cantidad);
+        case CAMPO_PRECIO:   return (a->precio > b->precio) - (a->precio < b->precio);
+        default:             return 0;
+    }
+}
+
+// 1 si 'a' debe aparecer antes que 'b' en el resultado (empates en orden de archivo)
+static int fila_va_antes(const FilaOrdenada *a, const FilaOrdenada *b, const PlanConsulta *plan) {
+    int c = comparar_campo(&a->fila, &b->fila, plan->orden_campo);
+    if (plan->orden_desc) c = -c;
+    if (c != 0) return c < 0;
+    return a->secuencia < b->secuencia;
+}
+
+// Heap cuya raíz es la fila que aparecería última: así la raíz es la candidata a descartar
+static void heap_hundir(FilaOrdenada *h, size_t n, size_t i, const PlanConsulta *plan) {
+    while (1) {
+        size_t mayor = i, izq = 2 * i + 1, der = 2 * i + 2;
+        if (izq < n && fila_va_antes(&h[mayor], &h[izq], plan)) mayor = izq;
+        if (der < n && fila_va_antes(&h[mayor], &h[der], plan)) mayor = der;
+        if (mayor == i) return;
+        FilaOrdenada tmp = h[i]; h[i] = h[mayor]; h[mayor] = tmp;
+        i = mayor;
+    }
+}
+
+static void heap_subir(FilaOrdenada *h, size_t i, const PlanConsulta *plan) {
+    while (i > 0) {
+        size_t padre = (i - 1) / 2;
+        if (!fila_va_antes(&h[padre], &h[i], plan)) return;
+        FilaOrdenada tmp = h[i]; h[i] = h[padre]; h[padre] = tmp;
+        i = padre;
+    }
+}
+
+static char *error_dup(const char *msg) {
+    char *e = (char *)malloc(strlen(msg) + 1);
+    if (e) strcpy(e, msg);
+    return e;
+}
+
+// Estado de una consulta en curso: lo comparten el recorrido de la tabla y el de los
+// cambios propios de la transacción
+typedef struct {
+    PlanConsulta *plan;
+    int ordenado, acotado;
+    long k;
+    FilaOrdenada *filas;
+    size_t num_filas, cap_filas;
+    long saltadas, emitidas;
+    Salida *out;
+    int sin_memoria, terminado;
+} Consulta;
+
+// Con ORDER BY: suma la fila al top-K acotado o a la lista a ordenar
+static void consulta_agregar_ordenada(Consulta *q, const FilaOrdenada *fila) {
+    const PlanConsulta *plan = q->plan;
+    if (q->acotado) {
+        if (q->k == 0) return;
+        if (q->num_filas < q->cap_filas) {
+            q->filas[q->num_filas] = *fila;
+            heap_subir(q->filas, q->num_filas, plan);
+            q->num_filas++;
+        } else if (fila_va_antes(fila, &q->filas[0], plan)) {
+            q->filas[0] = *fila;
+            heap_hundir(q->filas, q->num_filas, 0, plan);
+        }
+    } else {
+        if (q->num_filas == q->cap_filas) {
+            size_t nuevo = q->cap_filas ? q->cap_filas * 2 : 256;
+            FilaOrdenada *tmp = (FilaOrdenada *)realloc(q->filas, nuevo * sizeof(FilaOrdenada));
+            if (!tmp) { q->sin_memoria = 1; return; }
+            q->filas = tmp; q->cap_filas = nuevo;
+        }
+        q->filas[q->num_filas++] = *fila;
+    }
+}
+
+// Procesa una fila viva que ya cumple el filtro. 'secuencia' es su posición en la tabla
+// (los cambios propios van después): desempata el ORDER BY en orden de archivo.
+static void consulta_agregar_fila(Consulta *q, const FilaDisco *r, long secuencia) {
+    const PlanConsulta *plan = q->plan;
+    if (!q->ordenado) {
+        // Sin orden: se respeta el orden de la tabla y se corta apenas se llega a LIMIT
+        if (plan->limite >= 0 && q->emitidas >= plan->limite) { q->terminado = 1; return; }
+        if (q->saltadas < plan->desplazamiento) { q->saltadas++; return; }
+        char buf[256];
+        int l = fila_to_csv(&tabla.dic, r, buf, sizeof(buf));
+        salida_agregar(q->out, buf, (size_t)l);
+        q->sin_memoria = q->out->sin_memoria;
+        q->emitidas++;
+        return;
+    }
+
+    FilaOrdenada fila = { *r, secuencia };
+    consulta_agregar_ordenada(q, &fila);
+}
+
+// Recorre las páginas [pg_inicio, pg_fin) sin salir de los slots [desde, hasta)
+static void consulta_recorrer(Consulta *q, size_t pg_inicio, size_t pg_fin, size_t desde, size_t hasta,
+                              const Escrituras *tx) {
+    const PlanConsulta *plan = q->plan;
+    int con_cambios = escrituras_cantidad(tx) > 0;
+    for (size_t pg = pg_inicio; pg < pg_fin && pg * FILAS_POR_PAGINA < hasta && !q->sin_memoria && !q->terminado; pg++) {
+        const Pagina *pag = tabla.paginas[pg];
+        if (!pagina_puede_cumplir(pag, plan)) continue;
+        size_t base = pg * FILAS_POR_PAGINA;
+        size_t j = (desde > base) ? desde - base : 0;
+        size_t fin = (hasta - base < pag->num_filas) ? hasta - base : pag->num_filas;
+        for (; j < fin && !q->sin_memoria && !q->terminado; j++) {
+            const FilaDisco *r = &pag->filas[j];
+            if (!(r->flags & FILA_VIVA)) continue;
+            if (!fila_cumple_filtro(r, plan)) continue;
+            if (con_cambios && escrituras_buscar(tx, r->id)) continue; // la versión vigente es la de la transacción
+            consulta_agregar_fila(q, r, (long)(base + j));
+        }
+    }
+}
+
+// --- Recorrido en paralelo
+//
+// Sobre una tabla grande el recorrido de una consulta se reparte: las páginas se cortan
+// en morsels de PAGINAS_POR_MORSEL que los hilos toman de a uno con un contador atómico
+// (así se equilibran aunque el zone map saltee más páginas en unas zonas que en otras).
+// Con ORDER BY cada hilo evalúa el filtro y arma su propio top-K o su propia lista, y el
+// que hizo la consulta los junta. Sin ORDER BY (filtrar_en_paralelo) cada morsel junta
+// aparte los slots que cumplen el filtro y se concatenan en orden de página, así el
+// resultado sale igual que con un solo hilo; lo usan el SELECT sin LIMIT que se arma de
+// una vez y el SELECT por trozos, que filtra así una ventana de páginas por vez.
+// Los hilos se crean por recorrido, sin el rwlock propio: leen bajo el rdlock (o la
+// instantánea) del que los creó, que espera a que terminen. Los hilos extra salen de un
+// cupo global de MICRODB_HILOS_CONSULTA - 1, así varias consultas grandes a la vez no
+// multiplican los hilos; sin cupo la consulta se hace en un solo hilo.
+
+#define PAGINAS_POR_MORSEL 32
+#define MIN_PAGINAS_CONSULTA_HILO 128 // con menos páginas por hilo no conviene repartir
+
+static int hilos_recorrido_ocupados = 0; // acceso con __atomic
+
+typedef struct {
+    size_t pg_inicio, pg_fin, desde, hasta;
+    const Escrituras *tx;
+    size_t siguiente; // próximo morsel (atómico)
+} RecorridoParalelo;
+
+typedef struct {
+    RecorridoParalelo *r;
+    Consulta q;
+} TrabajoRecorrido;
+
+static int recorrido_tomar_hilos(int pedidos) {
+    int ocupados = __atomic_load_n(&hilos_recorrido_ocupados, __ATOMIC_RELAXED);
+    for (;;) {
+        int libres = (hilos_consulta - 1) - ocupados;
+        int tomar = (pedidos < libres) ? pedidos : libres;
+        if (tomar <= 0) return 0;
+        if (__atomic_compare_exchange_n(&hilos_recorrido_ocupados, &ocupados, ocupados + tomar, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return tomar;
+        }
+    }
+}
+
+// Cuántos hilos (el llamador incluido) recorren 'paginas' páginas; 0 si no conviene o no
+// hay cupo. Los extra quedan tomados hasta recorrido_soltar_hilos(n).
+static int recorrido_reservar_hilos(size_t paginas) {
+    size_t por_hilos = paginas / MIN_PAGINAS_CONSULTA_HILO;
+    int n = (por_hilos < (size_t)hilos_consulta) ? (int)por_hilos : hilos_consulta;
+    if (n < 2) return 0;
+    int extra = recorrido_tomar_hilos(n - 1);
+    return extra ? extra + 1 : 0;
+}
+
+static void recorrido_soltar_hilos(int n) {
+    __atomic_sub_fetch(&hilos_recorrido_ocupados, n - 1, __ATOMIC_RELAXED);
+}
+
+static void *recorrido_hilo(void *arg) {
+    TrabajoRecorrido *t = (TrabajoRecorrido *)arg;
+    RecorridoParalelo *r = t->r;
+    while (!t->q.sin_memoria) {
+        size_t pg = r->pg_inicio + __atomic_fetch_add(&r->siguiente, 1, __ATOMIC_RELAXED) * PAGINAS_POR_MORSEL;
+        if (pg >= r->pg_fin) break;
+        size_t fin = (pg + PAGINAS_POR_MORSEL < r->pg_fin) ? pg + PAGINAS_POR_MORSEL : r->pg_fin;
+        consulta_recorrer(&t->q, pg, fin, r->desde, r->hasta, r->tx);
+    }
+    return NULL;
+}
+
+// Hace en paralelo el recorrido de una consulta con ORDER BY y deja las filas en 'q'.
+// Devuelve 0 si no conviene o no hay hilos libres: el recorrido queda por hacer.
+static int consulta_en_paralelo(Consulta *q, size_t pg_inicio, size_t pg_fin, size_t desde, size_t hasta,
+                                const Escrituras *tx) {
+    int n = recorrido_reservar_hilos(pg_fin - pg_inicio);
+    if (n == 0) return 0;
+
+    RecorridoParalelo r = { pg_inicio, pg_fin, desde, hasta, tx, 0 };
+    TrabajoRecorrido trabajos[MAX_HILOS_CARGA];
+    for (int i = 0; i < n; i++) {
+        Consulta *parcial = &trabajos[i].q;
+        memset(parcial, 0, sizeof(*parcial));
+        trabajos[i].r = &r;
+        parcial->plan = q->plan;
+        parcial->ordenado = 1;
+        parcial->acotado = q->acotado;
+        parcial->k = q->k;
+        if (q->acotado && q->k > 0) {
+            parcial->cap_filas = (size_t)q->k;
+            parcial->filas = (FilaOrdenada *)malloc(parcial->cap_filas * sizeof(FilaOrdenada));
+            if (!parcial->filas) parcial->sin_memoria = 1;
+        }
+    }
+    uint64_t traza = traza_inicio();
+    ejecutar_en_paralelo(recorrido_hilo, trabajos, sizeof(TrabajoRecorrido), n);
+    traza_fin("recorrido_paralelo", traza, n);
+    recorrido_soltar_hilos(n);
+
+    // Junta los parciales: los top-K pasan por el heap de la consulta, las listas se concatenan
+    size_t total = q->num_filas;
+    for (int i = 0; i < n; i++) {
+        if (trabajos[i].q.sin_memoria) q->sin_memoria = 1;
+        total += trabajos[i].q.num_filas;
+    }
+    if (!q->acotado && !q->sin_memoria && total > q->cap_filas) {
+        FilaOrdenada *tmp = (FilaOrdenada *)realloc(q->filas, total * sizeof(FilaOrdenada));
+        if (tmp) { q->filas = tmp; q->cap_filas = total; } else q->sin_memoria = 1;
+    }
+    for (int i = 0; i < n; i++) {
+        Consulta *parcial = &trabajos[i].q;
+        if (q->sin_memoria) {
+            // nada que juntar
+        } else if (q->acotado) {
+            for (size_t j = 0; j < parcial->num_filas; j++) consulta_agregar_ordenada(q, &parcial->filas[j]);
+        } else {
+            memcpy(q->filas + q->num_filas, parcial->filas, parcial->num_filas * sizeof(FilaOrdenada));
+            q->num_filas += parcial->num_filas;
+        }
+        free(parcial->filas);
+    }
+    return 1;
+}
+
+// Slots que cumplen el filtro dentro de un morsel, en orden
+typedef struct {
+    size_t *slots;
+    size_t num, cap;
+} SlotsMorsel;
+
+typedef struct {
+    Pagina **paginas;          // de la tabla (con rdlock) o de una instantánea
+    size_t pg_inicio, pg_fin, desde, hasta;
+    const PlanConsulta *plan;
+    const Escrituras *cambios; // sus filas se saltean: vale la versión de la transacción
+    SlotsMorsel *morsels;
+    size_t siguiente;          // próximo morsel (atómico)
+    int sin_memoria;           // atómico
+} FiltradoParalelo;
+
+static void *filtrado_hilo(void *arg) {
+    FiltradoParalelo *fp = *(FiltradoParalelo **)arg;
+    int con_cambios = escrituras_cantidad(fp->cambios) > 0;
+    while (!__atomic_load_n(&fp->sin_memoria, __ATOMIC_RELAXED)) {
+        size_t m = __atomic_fetch_add(&fp->siguiente, 1, __ATOMIC_RELAXED);
+        size_t pg = fp->pg_inicio + m * PAGINAS_POR_MORSEL;
+        if (pg >= fp->pg_fin) break;
+        size_t pg_fin = (pg + PAGINAS_POR_MORSEL < fp->pg_fin) ? pg + PAGINAS_POR_MORSEL : fp->pg_fin;
+        SlotsMorsel *s = &fp->morsels[m];
+        for (; pg < pg_fin && pg * FILAS_POR_PAGINA < fp->hasta; pg++) {
+            const Pagina *pag = fp->paginas[pg];
+            if (!pagina_puede_cumplir(pag, fp->plan)) continue;
+            size_t base = pg * FILAS_POR_PAGINA;
+            size_t j = (fp->desde > base) ? fp->desde - base : 0;
+            size_t fin = (fp->hasta - base < pag->num_filas) ? fp->hasta - base : pag->num_filas;
+            for (; j < fin; j++) {
+                const FilaDisco *r = &pag->filas[j];
+                if (!(r->flags & FILA_VIVA) || !fila_cumple_filtro(r, fp->plan)) continue;
+                if (con_cambios && escrituras_buscar(fp->cambios, r->id)) continue;
+                if (s->num == s->cap) {
+                    size_t nueva = s->cap ? s->cap * 2 : 256;
+                    size_t *tmp = (size_t *)realloc(s->slots, nueva * sizeof(size_t));
+                    if (!tmp) { __atomic_store_n(&fp->sin_memoria, 1, __ATOMIC_RELAXED); return NULL; }
+                    s->slots = tmp;
+                    s->cap = nueva;
+                }
+                s->slots[s->num++] = base + j;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Filtra en paralelo las páginas [pg_inicio, pg_fin) sin salir de los slots [desde, hasta)
+// y deja en *slots (liberar con free) los que cumplen, en orden de página. Devuelve 0 si
+// no conviene, no hay hilos libres o falta memoria: el recorrido queda por hacer.
+static int filtrar_en_paralelo(Pagina **paginas, size_t pg_inicio, size_t pg_fin, size_t desde, size_t hasta,
+                               const PlanConsulta *plan, const Escrituras *cambios, size_t **slots, size_t *num_slots) {
+    int n = recorrido_reservar_hilos(pg_fin - pg_inicio);
+    if (n == 0) return 0;
+    size_t num_morsels = (pg_fin - pg_inicio + PAGINAS_POR_MORSEL - 1) / PAGINAS_POR_MORSEL;
+    FiltradoParalelo fp = { paginas, pg_inicio, pg_fin, desde, hasta, plan, cambios, NULL, 0, 0 };
+    fp.morsels = (SlotsMorsel *)calloc(num_morsels, sizeof(SlotsMorsel));
+    if (!fp.morsels) { recorrido_soltar_hilos(n); return 0; }
+    FiltradoParalelo *trabajos[MAX_HILOS_CARGA];
+    for (int i = 0; i < n; i++) trabajos[i] = &fp;
+    uint64_t traza = traza_inicio();
+    ejecutar_en_paralelo(filtrado_hilo, trabajos, sizeof(trabajos[0]), n);
+    traza_fin("recorrido_paralelo", traza, n);
+    recorrido_soltar_hilos(n);
+
+    size_t total = 0;
+    for (size_t m = 0; m < num_morsels; m++) total += fp.morsels[m].num;
+    size_t *todos = fp.sin_memoria ? NULL : (size_t *)malloc((total ? total : 1) * sizeof(size_t));
+    size_t usados = 0;
+    for (size_t m = 0; m < num_morsels; m++) {
+        if (todos && fp.morsels[m].num) memcpy(todos + usados, fp.morsels[m].slots, fp.morsels[m].num * sizeof(size_t));
+        usados += fp.morsels[m].num;
+        free(fp.morsels[m].slots);
+    }
+    free(fp.morsels);
+    if (!todos) return 0;
+    *slots = todos;
+    *num_slots = total;
+    return 1;
+}
+
+// Ejecuta el plan recorriendo las páginas una sola vez. Con LIMIT pequeño mantiene un
+// heap acotado de K = LIMIT + OFFSET filas, de modo que memoria y CPU dependen de K.
+// El rwlock se mantiene hasta formatear la salida porque los nombres salen del diccionario.
+// Con 'tx' la consulta ve además los cambios sin confirmar de esa transacción: las filas
+// que modificó reemplazan a las de la tabla y, sin ORDER BY, salen al final.
+// Las filas se escriben directo en 'out'; devuelve 1 si la consulta terminó bien.
+static int run_query_plan(PlanConsulta *plan, const Escrituras *tx, Salida *out) {
+    Consulta q;
+    memset(&q, 0, sizeof(q));
+    q.plan = plan;
+    q.out = out;
+    size_t inicio = out->len;
+    salida_texto(out, CSV_HEADER);
+
+    q.ordenado = (plan->orden_campo != CAMPO_NINGUNO);
+    // LIMIT + OFFSET que no entra en un long no acota nada: se ordena todo
+    q.k = (plan->limite >= 0 && plan->limite <= LONG_MAX - plan->desplazamiento) ? plan->limite + plan->desplazamiento : -1;
+    q.acotado = q.ordenado && q.k >= 0 && q.k <= MAX_TOPK_HEAP;
+
+    if (q.acotado && q.k > 0) {
+        q.cap_filas = (size_t)q.k;
+        q.filas = (FilaOrdenada *)malloc(q.cap_filas * sizeof(FilaOrdenada));
+        if (!q.filas) q.sin_memoria = 1;
+    }
+
+    // Búsqueda puntual por ID: se resuelve con el índice en lugar de recorrer la tabla
+    int por_indice = plan->tiene_filtro && plan->filtro_campo == CAMPO_ID && plan->filtro_op == OP_IGUAL;
+
+    uint64_t traza = traza_inicio();
+    pthread_rwlock_rdlock(&rwlock_tabla);
+    traza_fin("rdlock_tabla", traza, -1);
+    size_t desde = 0, hasta = tabla.num_filas;
+    if (por_indice) {
+        long slot = indice_buscar(&tabla, (int)plan->filtro_numero);
+        desde = (slot >= 0) ? (size_t)slot : 0;
+        hasta = (slot >= 0) ? (size_t)slot + 1 : 0;
+    }
+    if (plan->tiene_filtro && plan->filtro_campo == CAMPO_PRODUCTO) {
+        plan->filtro_codigo = diccionario_buscar(&tabla.dic, plan->filtro_valor, strlen(plan->filtro_valor));
+        if (plan->filtro_codigo < 0) hasta = 0; // producto inexistente: ninguna fila coincide
+    }
+    size_t pg_inicio = desde / FILAS_POR_PAGINA;
+    size_t pg_fin = (hasta + FILAS_POR_PAGINA - 1) / FILAS_POR_PAGINA;
+    // Sin ORDER BY y con LIMIT el recorrido corta apenas llega al límite: ése sigue en un solo hilo
+    size_t *slots = NULL, num_slots = 0;
+    if (q.ordenado) {
+        if (q.sin_memoria || !consulta_en_paralelo(&q, pg_inicio, pg_fin, desde, hasta, tx)) {
+            consulta_recorrer(&q, pg_inicio, pg_fin, desde, hasta, tx);
+        }
+    } else if (plan->limite < 0 && plan->tiene_filtro &&
+               filtrar_en_paralelo(tabla.paginas, pg_inicio, pg_fin, desde, hasta, plan, tx, &slots, &num_slots)) {
+        for (size_t i = 0; i < num_slots && !q.sin_memoria; i++) consulta_agregar_fila(&q, tabla_fila(&tabla, slots[i]), (long)slots[i]);
+        free(slots);
+    } else {
+        consulta_recorrer(&q, pg_inicio, pg_fin, desde, hasta, tx);
+    }
+    if (escrituras_cantidad(tx) > 0 && (plan->filtro_campo != CAMPO_PRODUCTO || plan->filtro_codigo >= 0)) {
+        for (size_t i = 0; i < tx->num && !q.sin_memoria && !q.terminado; i++) {
+            const FilaDisco *r = &tx->filas[i];
+            if ((r->flags & FILA_VIVA) && fila_cumple_filtro(r, plan)) consulta_agregar_fila(&q, r, (long)(tabla.num_filas + i));
+        }
+    }
+    if (q.ordenado && !q.sin_memoria) {
+        FilaOrdenada *filas = q.filas;
+        size_t num_filas = q.num_filas;
+        if (!q.acotado) {
+            for (size_t i = num_filas / 2; i-- > 0; ) heap_hundir(filas, num_filas, i, plan);
+        }
+        // Heapsort in situ: deja las filas en el orden de salida
+        for (size_t fin = num_filas; fin > 1; fin--) {
+            FilaOrdenada tmp = filas[0]; filas[0] = filas[fin - 1]; filas[fin - 1] = tmp;
+            heap_hundir(filas, fin - 1, 0, plan);
+        }
+        char buf[256];
+        for (size_t i = (size_t)plan->desplazamiento; i < num_filas; i++) {
+            if (plan->limite >= 0 && (long)(i - (size_t)plan->desplazamiento) >= plan->limite) break;
+            int l = fila_to_csv(&tabla.dic, &filas[i].fila, buf, sizeof(buf));
+            salida_agregar(out, buf, (size_t)l);
+            if (out->sin_memoria) { q.sin_memoria = 1; break; }
+        }
+    }
+    pthread_rwlock_unlock(&rwlock_tabla);
+    free(q.filas);
+    if (q.sin_memoria || out->sin_memoria) {
+        // Se descarta lo armado y se responde el error en su lugar
+        out->len = inicio;
+        out->sin_memoria = 0;
+        salida_texto(out, "ERROR: Memoria insuficiente.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// --- SELECT por trozos
+//
+// Sin ORDER BY el resultado no se arma entero: la consulta toma una instantánea de la
+// tabla y el trabajador agrega unos TAM_TROZO_FLUJO bytes por vez. El reactor pide el
+// trozo siguiente cuando el cliente ya recibió casi todo el anterior, así la memoria
+// por conexión no depende del tamaño del resultado y los COMMIT de otras conexiones no
+// esperan a que termine el envío. Mientras dura, la conexión no ejecuta otros comandos.
+
+struct Flujo {
+    Instantanea *inst;
+    PlanConsulta plan;
+    const Escrituras *cambios; // cambios propios de la transacción: salen al final
+    Escrituras *copia;         // copia propia de los cambios (cursores), si la hay
+    size_t pagina, fila;       // próxima fila de la instantánea
+    size_t *filtradas;         // slots ya filtrados en paralelo (filtrar_en_paralelo), antes de 'pagina'
+    size_t num_filtradas, filtrada;
+    size_t cambio;             // próximo cambio propio
+    long saltadas, emitidas;
+    size_t bytes;              // enviados hasta ahora, con la cabecera
+    int select_all;            // SELECT ALL sin cláusulas: en texto cierra con el marcador
+    char *clave;               // consulta normalizada, si el resultado va a la caché
+    size_t largo_clave;
+    uint64_t version;          // versión de la tabla anotada antes de la instantánea
+    Salida resultado;          // lo enviado hasta ahora, para la caché
+};
+
+// Las consultas con ORDER BY ordenan todo antes de emitir la primera fila, y con un
+// LIMIT chico o una búsqueda por ID la respuesta es corta: ésas se arman de una vez.
+static int plan_admite_flujo(const PlanConsulta *plan) {
+    if (plan->orden_campo != CAMPO_NINGUNO) return 0;
+    if (plan->tiene_filtro && plan->filtro_campo == CAMPO_ID && plan->filtro_op == OP_IGUAL) return 0;
+    return plan->limite < 0 || plan->limite >= MIN_LIMITE_FLUJO;
+}
+
+// Con 'copiar' el flujo se queda con una copia de los cambios de la transacción y no
+// depende de que ésta siga abierta
+static Flujo *flujo_nuevo(const PlanConsulta *plan, const Escrituras *tx, int copiar) {
+    Flujo *f = (Flujo *)calloc(1, sizeof(Flujo));
+    if (!f) return NULL;
+    f->plan = *plan;
+    if (escrituras_cantidad(tx) > 0) {
+        if (copiar && !(f->copia = escrituras_copiar(tx))) { free(f); return NULL; }
+        f->cambios = copiar ? f->copia : tx;
+    }
+    pthread_rwlock_rdlock(&rwlock_tabla);
+    if (f->plan.tiene_filtro && f->plan.filtro_campo == CAMPO_PRODUCTO) {
+        f->plan.filtro_codigo = diccionario_buscar(&tabla.dic, f->plan.filtro_valor, strlen(f->plan.filtro_valor));
+    }
+    f->inst = instantanea_tomar();
+    pthread_rwlock_unlock(&rwlock_tabla);
+    if (!f->inst) { escrituras_liberar(f->copia); free(f); return NULL; }
+    if (f->plan.tiene_filtro && f->plan.filtro_campo == CAMPO_PRODUCTO && f->plan.filtro_codigo < 0) {
+        f->pagina = f->inst->num_paginas; // producto inexistente: ninguna fila coincide
+        f->cambios = NULL;
+    }
+    return f;
+}
+
+// Deja de juntar el resultado para la caché
+static void flujo_sin_cache(Flujo *f) {
+    free(f->clave);
+    free(f->resultado.datos);
+    f->clave = NULL;
+    memset(&f->resultado, 0, sizeof(f->resultado));
+}
+
+static void flujo_liberar(Flujo *f) {
+    if (!f) return;
+    instantanea_soltar(f->inst);
+    escrituras_liberar(f->copia);
+    flujo_sin_cache(f);
+    free(f->filtradas);
+    free(f);
+}
+
+// Suma el trozo recién armado al resultado a guardar; al terminar lo pasa a la caché.
+// Si el resultado pasa del máximo de una entrada se descarta lo juntado.
+static void flujo_cachear(Flujo *f, const char *datos, size_t n, int terminado) {
+    salida_agregar(&f->resultado, datos, n);
+    if (f->resultado.sin_memoria || f->resultado.len > cache_max_entrada()) {
+        flujo_sin_cache(f);
+        return;
+    }
+    if (terminado) {
+        cache_guardar(f->clave, f->largo_clave, f->version, f->resultado.datos, f->resultado.len);
+        flujo_sin_cache(f);
+    }
+}
+
+static void flujo_agregar_fila(Flujo *f, const FilaDisco *r, Salida *out) {
+    if (f->plan.limite >= 0 && f->emitidas >= f->plan.limite) return;
+    if (f->saltadas < f->plan.desplazamiento) { f->saltadas++; return; }
+    char buf[256];
+    int l = fila_to_csv(f->inst->dic, r, buf, sizeof(buf));
+    salida_agregar(out, buf, (size_t)l);
+    f->emitidas++;
+}
+
+// Con filtro, la instantánea se filtra en paralelo de a ventanas de hasta
+// MICRODB_HILOS_CONSULTA * MIN_PAGINAS_CONSULTA_HILO páginas: la memoria por flujo queda
+// acotada por la ventana y las filas salen en el mismo orden. Sin filtro no se gana nada:
+// cuesta más armar el texto que recorrer. Devuelve 1 si filtró la ventana siguiente.
+static int flujo_filtrar_ventana(Flujo *f) {
+    if (!f->plan.tiene_filtro) return 0;
+    size_t fin = f->pagina + (size_t)hilos_consulta * MIN_PAGINAS_CONSULTA_HILO;
+    if (fin > f->inst->num_paginas) fin = f->inst->num_paginas;
+    free(f->filtradas);
+    f->filtradas = NULL;
+    f->num_filtradas = f->filtrada = 0;
+    if (!filtrar_en_paralelo(f->inst->paginas, f->pagina, fin, 0, SIZE_MAX, &f->plan, f->cambios,
+                             &f->filtradas, &f->num_filtradas)) {
+        return 0;
+    }
+    f->pagina = fin;
+    return 1;
+}
 
-    // Manejo de señales: evitar caídas por SIGPIPE y limpieza en SIGINT/SIGTERM
-    signal(SIGPIPE, SIG_IGN);
-    signal(SIGINT, handle_termination_signal);
-    signal(SIGTERM, handle_termination_signal);
+// Agrega filas a 'out' hasta sumar 'max_bytes' o 'max_filas'. Devuelve 1 si ya no quedan.
+static int flujo_avanzar(Flujo *f, Salida *out, size_t max_bytes, long max_filas) {
+    size_t antes = out->len;
+    long desde = f->emitidas;
+    int terminado = 0;
+    pthread_rwlock_rdlock(&rwlock_tabla); // sólo por los nombres del diccionario
+    while (!terminado && !out->sin_memoria && out->len - antes < max_bytes && f->emitidas - desde < max_filas) {
+        if (f->plan.limite >= 0 && f->emitidas >= f->plan.limite) {
+            terminado = 1;
+        } else if (f->filtrada < f->num_filtradas) {
+            size_t slot = f->filtradas[f->filtrada++];
+            flujo_agregar_fila(f, &f->inst->paginas[slot / FILAS_POR_PAGINA]->filas[slot % FILAS_POR_PAGINA], out);
+        } else if (f->pagina < f->inst->num_paginas && f->fila == 0 && flujo_filtrar_ventana(f)) {
+            continue;
+        } else if (f->pagina < f->inst->num_paginas) {
+            const Pagina *pag = f->inst->paginas[f->pagina];
+            if (f->fila >= pag->num_filas || (f->fila == 0 && !pagina_puede_cumplir(pag, &f->plan))) {
+                f->pagina++;
+                f->fila = 0;
+                continue;
+            }
+            const FilaDisco *r = &pag->filas[f->fila++];
+            if (!(r->flags & FILA_VIVA) || !fila_cumple_filtro(r, &f->plan)) continue;
+            if (f->cambios && escrituras_buscar(f->cambios, r->id)) continue; // vale la versión de la transacción
+            flujo_agregar_fila(f, r, out);
+        } else if (f->cambios && f->cambio < f->cambios->num) {
+            const FilaDisco *r = &f->cambios->filas[f->cambio++];
+            if ((r->flags & FILA_VIVA) && fila_cumple_filtro(r, &f->plan)) flujo_agregar_fila(f, r, out);
+        } else {
+            terminado = 1;
+        }
+    }
+    pthread_rwlock_unlock(&rwlock_tabla);
+    return terminado;
+}
 
-    // Registrar limpieza en salida normal
-    atexit(cleanup_resources);
+// Agrega a 'out' el trozo siguiente. Devuelve 1 cuando la respuesta quedó completa.
+static int flujo_continuar(Flujo *f, Salida *out, int con_tramas) {
+    size_t antes = out->len;
+    if (f->bytes == 0) salida_texto(out, CSV_HEADER);
+    int terminado = flujo_avanzar(f, out, TAM_TROZO_FLUJO, LONG_MAX);
+    f->bytes += out->len - antes;
+    if (f->clave && out->sin_memoria) flujo_sin_cache(f);
+    if (f->clave) flujo_cachear(f, out->datos + antes, out->len - antes, terminado);
+    // Con tramas el largo ya delimita la respuesta; en texto, un SELECT ALL largo sigue
+    // cerrando con el marcador que espera el cliente
+    if (terminado && !con_tramas && f->select_all && f->bytes > 3000) salida_texto(out, "\n---END---\n");
+    return terminado || out->sin_memoria;
+}
 
+// Con 'clave' el resultado se junta a medida que sale y al final se guarda en la caché
+static int consulta_por_trozos(const PlanConsulta *plan, Transaccion *tx, int select_all, const char *clave,
+                               size_t largo_clave, uint64_t version, Salida *out, Flujo **flujo) {
+    Flujo *f = flujo_nuevo(plan, tx ? tx->escrituras : NULL, 0);
+    if (!f) {
+        salida_texto(out, "ERROR: Memoria insuficiente.\n");
+        return 0;
+    }
+    f->select_all = select_all;
+    if (clave && (f->clave = (char *)malloc(largo_clave)) != NULL) {
+        memcpy(f->clave, clave, largo_clave);
+        f->largo_clave = largo_clave;
+        f->version = version;
+    }
+    *flujo = f;
+    return 1;
+}
 
-    // Creación del socket del servidor
-    socket_servidor = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_servidor == 0) { perror("socket failed"); exit(EXIT_FAILURE); }
-    socket_servidor_global = socket_servidor;
+// Interpreta "SELECT ALL ..." o "SELECT WHERE ..." en 'plan'. Devuelve NULL si la
+// consulta es válida o un mensaje de error estático.
+static const char *parse_select(char *pcmd, PlanConsulta *plan) {
+    memset(plan, 0, sizeof(*plan));
+    plan->filtro_campo = CAMPO_NINGUNO;
+    plan->orden_campo = CAMPO_NINGUNO;
+    plan->limite = -1;
 
-    int opt = 1;
-    if (setsockopt(socket_servidor, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt"); exit(EXIT_FAILURE);
+    if (strncmp(pcmd, "SELECT ALL", 10) == 0) return parse_clausulas_orden(pcmd + 10, plan);
+    if (strncmp(pcmd, "SELECT WHERE", 12) != 0) return "ERROR: Formato SELECT no soportado.\n";
+
+    char *cond = pcmd + 12;
+    ltrim_inplace(&cond);
+    char field[32] = {0};
+    char op[3] = {0};
+    int consumido = 0;
+    if (sscanf(cond, "%31[^=<>]%2[=<>]%127s%n", field, op, plan->filtro_valor, &consumido) != 3) {
+        return "ERROR: Formato de WHERE invalido.\n";
     }
-    // Habilitar SO_KEEPALIVE para detectar desconexiones colgadas
-    opt = 1;
-    if (setsockopt(socket_servidor, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt))) {
-        perror("setsockopt SO_KEEPALIVE");
+    rtrim(field);
+    strip_quotes(plan->filtro_valor);
+    plan->tiene_filtro = 1;
+    plan->filtro_campo = campo_desde_nombre(field);
+    if (plan->filtro_campo == CAMPO_NINGUNO) return "ERROR: Campo de WHERE desconocido.\n";
+    if (!operador_desde_texto(op, &plan->filtro_op)) return "ERROR: Operador de WHERE invalido. Use =, <, <=, > o >=.\n";
+    if (plan->filtro_campo == CAMPO_PRODUCTO && plan->filtro_op != OP_IGUAL) {
+        return "ERROR: Producto solo admite el operador =.\n";
     }
+    plan->filtro_numero = (plan->filtro_campo == CAMPO_PRECIO) ? precio_a_centavos(atof(plan->filtro_valor))
+                                                                : atoi(plan->filtro_valor);
+    return parse_clausulas_orden(cond + consumido, plan);
+}
 
-    direccion.sin_family = AF_INET;
-    direccion.sin_addr.s_addr = inet_addr(ip);
-    direccion.sin_port = htons(puerto);
+// Ejecuta un plan ya parseado y escribe el resultado (o el error) en 'out'; devuelve 1
+// si la consulta se resolvió. 'texto' es la consulta, para la clave de la caché (NULL:
+// no se usa la caché). Con 'flujo' las consultas que lo admiten no escriben nada: dejan
+// en *flujo el recorrido a enviar por trozos (ver flujo_continuar). Salvo con cambios
+// propios sin confirmar, el resultado se busca antes en la caché y se guarda en ella.
+static int ejecutar_plan(PlanConsulta *plan_consulta, const char *texto, int select_all, Transaccion *tx,
+                         Salida *out, Flujo **flujo) {
+    PlanConsulta plan = *plan_consulta;
+    if (tx && plan.tiene_filtro && plan.filtro_campo == CAMPO_ID && plan.filtro_op == OP_IGUAL) {
+        // Lectura puntual dentro de una transacción: lock compartido hasta el COMMIT,
+        // así ninguna otra transacción cambia esa fila mientras tanto
+        int rc = transaccion_bloquear_fila(tx, (int)plan.filtro_numero, 0);
+        if (rc != LOCK_OK) {
+            salida_entregar(out, transaccion_error_lock(tx, rc));
+            return 0;
+        }
+    }
 
-    if (bind(socket_servidor, (struct sockaddr *)&direccion, sizeof(direccion)) < 0) {
-        perror("bind failed"); exit(EXIT_FAILURE);
+    char clave[MAX_COMMAND_LENGTH];
+    size_t largo_clave = 0;
+    int cachear = texto && cache_max_bytes > 0 && escrituras_cantidad(tx ? tx->escrituras : NULL) == 0;
+    if (cachear) {
+        uint64_t traza = traza_inicio();
+        largo_clave = cache_normalizar(texto, clave);
+        int acierto = cache_buscar(clave, largo_clave, out);
+        traza_fin(acierto ? "cache_acierto" : "cache_fallo", traza, -1);
+        if (acierto) return 1;
     }
+    // Antes de leer la tabla: si un COMMIT entra en el medio, el resultado queda con una
+    // versión vieja y no se sirve nunca
+    uint64_t version = tabla_version_actual();
 
-    if (listen(socket_servidor, config_backlog) < 0) {
-        perror("listen"); exit(EXIT_FAILURE);
+    uint64_t traza = traza_inicio();
+    if (flujo && plan_admite_flujo(&plan)) {
+        int ok = consulta_por_trozos(&plan, tx, select_all, cachear ? clave : NULL, largo_clave, version, out, flujo);
+        traza_fin("primer_trozo", traza, -1);
+        return ok;
     }
+    size_t inicio = out->len;
+    int ok = run_query_plan(&plan, tx ? tx->escrituras : NULL, out);
+    traza_fin("consulta", traza, -1);
+    if (ok && cachear) cache_guardar(clave, largo_clave, version, out->datos + inicio, out->len - inicio);
+    return ok;
+}
 
-    printf("Servidor Micro DB escuchando en %s:%d. Max concurrentes (N): %d, Backlog (M): %d.\n", ip, puerto, config_max_clientes, config_backlog);
+// Parsea el SELECT y lo ejecuta (ver ejecutar_plan)
+int execute_query(const char *command, Transaccion *tx, Salida *out, Flujo **flujo) {
+    char cmd[MAX_COMMAND_LENGTH];
+    strncpy(cmd, command, sizeof(cmd) - 1);
+    cmd[sizeof(cmd) - 1] = '\0';
+    char *pcmd = cmd; ltrim_inplace(&pcmd);
 
-    // Bucle principal: permanecer a la espera de nuevos clientes
-    int clientes_en_espera = 0;
-    while (1) {
-        // Aceptar conexiones siempre, pero decidir si se atienden o se rechazan
-        info_cliente *info = (info_cliente *)malloc(sizeof(info_cliente));
-        if (!info) { perror("malloc failed"); continue; }
+    PlanConsulta plan;
+    uint64_t traza = traza_inicio();
+    const char *err = parse_select(pcmd, &plan);
+    traza_fin("parsear", traza, -1);
+    if (err) {
+        salida_texto(out, err);
+        return 0;
+    }
+    // parse_select no toca el texto: sirve tal cual como clave de la caché
+    return ejecutar_plan(&plan, pcmd, es_select_all_simple(pcmd), tx, out, flujo);
+}
 
-        nuevo_socket = accept(socket_servidor, (struct sockaddr *)&info->direccion, (socklen_t *)&longitud_direccion);
+// --- Cursores (DECLARE / FETCH / CLOSE)
+//
+// Un cursor es un SELECT por trozos que avanza sólo cuando el cliente lo pide: DECLARE
+// toma la instantánea y cada FETCH n devuelve las n filas siguientes. La memoria no
+// depende del tamaño del resultado sino de n y de los cambios propios de la transacción,
+// que se copian al declararlo: el cursor ve la tabla y la transacción como estaban en
+// ese momento, también después del COMMIT. Se cierra con CLOSE o al desconectarse.
 
-        if (nuevo_socket < 0) {
-            free(info);
-            if (stop_requested) {
-                break;
-            }
-            perror("accept");
-            continue;
-        }
+struct Cursor {
+    char nombre[32];
+    Flujo *flujo;
+    struct Cursor *siguiente;
+};
 
-        pthread_mutex_lock(&mutex_clientes);
-        int activos = clientes_activos;
-        pthread_mutex_unlock(&mutex_clientes);
+static Cursor **cursor_buscar(Conexion *c, const char *nombre) {
+    Cursor **p = &c->cursores;
+    while (*p && strcmp((*p)->nombre, nombre) != 0) p = &(*p)->siguiente;
+    return p;
+}
 
-        if (activos >= config_max_clientes) {
-            // Si hay N clientes activos, verificar backlog
-            // Contar conexiones en espera (aprox):
-            // No hay forma directa de saber el backlog, así que simplemente rechazamos si ya hay N activos
-            // y el accept() nos da una conexión extra (lo que significa que backlog estaba lleno y el SO la entregó)
-            // En este punto, si llegamos aquí, el backlog está lleno
-            const char *msg = "ERROR: Servidor ocupado. Se superó el máximo de clientes y conexiones en espera. Intente más tarde.\n";
-            send(nuevo_socket, msg, strlen(msg), 0);
-            close(nuevo_socket);
-            free(info);
-            continue;
-        }
+static void cursores_cerrar(Conexion *c) {
+    while (c->cursores) {
+        Cursor *cur = c->cursores;
+        c->cursores = cur->siguiente;
+        flujo_liberar(cur->flujo);
+        free(cur);
+    }
+    c->num_cursores = 0;
+}
 
-        info->socket = nuevo_socket;
-        info->id_usuario = siguiente_id_usuario++;
-        printf("[Servidor] Nuevo cliente! ID: %d, Clientes activos: %d.\n", info->id_usuario, activos + 1);
+// 1 si 'resto' no tiene más que espacios
+static int solo_espacios(const char *resto) {
+    while (*resto == ' ' || *resto == '\t' || *resto == '\r') resto++;
+    return *resto == '\0';
+}
 
-        pthread_mutex_lock(&mutex_clientes);
-        clientes_activos++;
-        printf("[Servidor] Nuevo cliente! Clientes activos: %d.\n", clientes_activos);
-        pthread_mutex_unlock(&mutex_clientes);
+static const char *cursor_declarar(Conexion *c, const char *command, char *nombre) {
+    int consumido = 0;
+    sscanf(command, "DECLARE %31[A-Za-z0-9_] CURSOR FOR %n", nombre, &consumido);
+    if (consumido == 0) return "ERROR: Formato: DECLARE <nombre> CURSOR FOR SELECT ...\n";
+    if (*cursor_buscar(c, nombre)) return "ERROR: Ya existe un cursor con ese nombre.\n";
+    if (c->num_cursores >= MAX_CURSORES) return "ERROR: Demasiados cursores abiertos; cierre alguno con CLOSE.\n";
 
-        pthread_t hilo_cliente;
-        if (pthread_create(&hilo_cliente, NULL, handle_client, (void *)info) != 0) {
-            perror("pthread_create failed");
-            close(nuevo_socket);
-            free(info);
-            pthread_mutex_lock(&mutex_clientes);
-            clientes_activos--;
-            pthread_cond_signal(&condicion_clientes);
-            pthread_mutex_unlock(&mutex_clientes);
-        } else {
-            pthread_detach(hilo_cliente);
-        }
+    char cmd[MAX_COMMAND_LENGTH];
+    strncpy(cmd, command + consumido, sizeof(cmd) - 1);
+    cmd[sizeof(cmd) - 1] = '\0';
+    PlanConsulta plan;
+    const char *err = parse_select(cmd, &plan);
+    if (err) return err;
+    if (plan.orden_campo != CAMPO_NINGUNO) return "ERROR: Los cursores no admiten ORDER BY.\n";
+
+    Cursor *cur = (Cursor *)calloc(1, sizeof(Cursor));
+    if (!cur) return "ERROR: Memoria insuficiente.\n";
+    cur->flujo = flujo_nuevo(&plan, c->transaccion ? c->transaccion->escrituras : NULL, 1);
+    if (!cur->flujo) { free(cur); return "ERROR: Memoria insuficiente.\n"; }
+    strcpy(cur->nombre, nombre);
+    cur->siguiente = c->cursores;
+    c->cursores = cur;
+    c->num_cursores++;
+    return NULL;
+}
+
+// FETCH [n] FROM nombre: la cabecera CSV y hasta n filas (menos al llegar al final)
+static const char *cursor_fetch(Conexion *c, const char *command, Salida *out) {
+    char nombre[32];
+    long n = 1;
+    int consumido = 0;
+    if (sscanf(command, "FETCH FROM %31[A-Za-z0-9_]%n", nombre, &consumido) != 1 &&
+        sscanf(command, "FETCH %ld FROM %31[A-Za-z0-9_]%n", &n, nombre, &consumido) != 2) {
+        return "ERROR: Formato: FETCH [n] FROM <nombre>\n";
     }
+    if (!solo_espacios(command + consumido)) return "ERROR: Formato: FETCH [n] FROM <nombre>\n";
+    if (n < 1 || n > MAX_FILAS_FETCH) return "ERROR: FETCH admite entre 1 y 10000 filas.\n";
+    Cursor *cur = *cursor_buscar(c, nombre);
+    if (!cur) return "ERROR: No existe un cursor con ese nombre.\n";
+    salida_texto(out, CSV_HEADER);
+    flujo_avanzar(cur->flujo, out, SIZE_MAX, n);
+    return NULL;
+}
 
-    // Salimos del while principal => stop_requested o error terminal
-    printf("[Servidor] Señal de terminación recibida o error. Limpiando recursos...\n");
-    cleanup_resources();
-    return 0;
+static const char *cursor_cerrar(Conexion *c, const char *command, char *nombre) {
+    int consumido = 0;
+    if (sscanf(command, "CLOSE %31[A-Za-z0-9_]%n", nombre, &consumido) != 1 ||
+        !solo_espacios(command + consumido)) {
+        return "ERROR: Formato: CLOSE <nombre>\n";
+    }
+    Cursor **p = cursor_buscar(c, nombre);
+    Cursor *cur = *p;
+    if (!cur) return "ERROR: No existe un cursor con ese nombre.\n";
+    *p = cur->siguiente;
+    c->num_cursores--;
+    flujo_liberar(cur->flujo);
+    free(cur);
+    return NULL;
 }
 
-// --- SIMULACIÓN DE LÓGICA DE BD (implementación incompleta por brevedad)
+// Ejecuta DECLARE, FETCH o CLOSE y deja la respuesta en 'out'
+static void comando_cursor(Conexion *c, const char *command, Salida *out) {
+    char nombre[32] = "";
+    char msg[96];
+    const char *err;
+    if (strncmp(command, "DECLARE", 7) == 0) {
+        err = cursor_declarar(c, command, nombre);
+        snprintf(msg, sizeof(msg), "OK: Cursor %s declarado.\n", nombre);
+    } else if (strncmp(command, "FETCH", 5) == 0) {
+        err = cursor_fetch(c, command, out);
+        msg[0] = '\0';
+    } else {
+        err = cursor_cerrar(c, command, nombre);
+        snprintf(msg, sizeof(msg), "OK: Cursor %s cerrado.\n", nombre);
+    }
+    salida_texto(out, err ? err : msg);
+}
 
-typedef struct {
-    int id;
-    char producto[128];
-    int cantidad;
-    double precio;
-} Registro;
+// --- Importación y exportación CSV
+//
+// El CSV sigue siendo el formato de intercambio con generador_datos: IMPORT CSV
+// reemplaza toda la tabla y EXPORT CSV vuelca las filas vigentes.
 
-static void rtrim(char *s) {
-    size_t n = strlen(s);
-    while (n > 0 && (s[n-1] == '\n' || s[n-1] == '\r' || s[n-1] == ' ' || s[n-1] == '\t')) {
-        s[n-1] = '\0';
-        n--;
+// Sólo se aceptan archivos .csv del directorio de trabajo del servidor.
+// 'archivo' debe tener lugar para 128 bytes; sin argumento se usa CSV_FILE_NAME.
+static const char *parse_archivo_csv(const char *texto, char *archivo) {
+    char extra[2];
+    int n = sscanf(texto, "%127s %1s", archivo, extra);
+    if (n <= 0) {
+        strcpy(archivo, CSV_FILE_NAME);
+        return NULL;
     }
+    if (n == 2) return "ERROR: Se esperaba un solo nombre de archivo.\n";
+    size_t l = strlen(archivo);
+    if (strchr(archivo, '/') || archivo[0] == '.' || l < 5 || strcasecmp(archivo + l - 4, ".csv") != 0) {
+        return "ERROR: El archivo debe ser un nombre .csv sin directorios.\n";
+    }
+    return NULL;
 }
 
-static void ltrim_inplace(char **ps) {
-    while (**ps == ' ' || **ps == '\t') (*ps)++;
+char *import_csv(const char *command, int *is_success) {
+    *is_success = 0;
+    char archivo[128];
+    const char *err = parse_archivo_csv(command + 10, archivo);
+    if (err) return error_dup(err);
+
+    struct timespec inicio;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    pthread_mutex_lock(&mutex_archivo_base);
+    Tabla nueva;
+    memset(&nueva, 0, sizeof(nueva));
+    uint64_t traza = traza_inicio();
+    long filas = tabla_cargar_csv(&nueva, archivo);
+    traza_fin("leer_csv", traza, filas);
+    double ms_carga = ms_desde(&inicio);
+    if (filas < 0) {
+        pthread_mutex_unlock(&mutex_archivo_base);
+        tabla_liberar(&nueva);
+        return error_dup(filas == -1 ? "ERROR: No se pudo abrir el archivo CSV.\n" : "ERROR: Memoria insuficiente.\n");
+    }
+    size_t n = 0, bytes_dic = 0;
+    FilaDisco *foto = tabla_foto(&nueva, &n);
+    uint8_t *dic = diccionario_serializar(&nueva.dic, &bytes_dic);
+
+    pthread_mutex_lock(&mutex_escritura);
+    // El archivo nuevo reemplaza todo lo registrado hasta wal_lsn: al reiniciar no se
+    // reaplica nada anterior, así que el WAL se puede vaciar
+    int ok = foto && dic && escribir_base_binaria(foto, n, dic, bytes_dic, nueva.dic.num, wal_lsn);
+    if (ok) {
+        fsync_directorio();
+        if (ftruncate(wal_fd, 0) == 0) wal_bytes = 0;
+        Tabla vieja;
+        pthread_rwlock_wrlock(&rwlock_tabla);
+        vieja = tabla;
+        tabla = nueva;
+        tabla_nueva_version();
+        int retirada = tabla_retirar(&vieja);
+        pthread_rwlock_unlock(&rwlock_tabla);
+        if (!retirada) tabla_liberar(&vieja);
+    }
+    pthread_mutex_unlock(&mutex_escritura);
+    pthread_mutex_unlock(&mutex_archivo_base);
+    free(foto);
+    free(dic);
+    if (!ok) {
+        tabla_liberar(&nueva);
+        return error_dup("ERROR: No se pudo escribir " DB_FILE_NAME ".\n");
+    }
+    pthread_mutex_lock(&mutex_compactacion);
+    stats_compactacion.ultimo_tamanio_base = tamanio_archivo(DB_FILE_NAME);
+    pthread_mutex_unlock(&mutex_compactacion);
+
+    printf("[SERVIDOR] IMPORT: %ld filas leidas de %s en %.1f ms (%.0f filas/s, %d hilos), %zu filas vigentes.\n",
+           filas, archivo, ms_carga, ms_carga > 0 ? (double)filas / (ms_carga / 1000.0) : 0.0, hilos_carga, n);
+    char *msg = (char *)malloc(256);
+    if (!msg) return NULL;
+    snprintf(msg, 256, "OK: %zu filas importadas desde %s.\n", n, archivo);
+    *is_success = 1;
+    return msg;
+}
+
+char *export_csv(const char *command, int *is_success) {
+    *is_success = 0;
+    char archivo[128];
+    const char *err = parse_archivo_csv(command + 10, archivo);
+    if (err) return error_dup(err);
+
+    char tmp_path[160];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", archivo);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) return error_dup("ERROR: No se pudo crear el archivo CSV.\n");
+    setvbuf(f, NULL, _IOFBF, 1 << 16);
+    fputs(CSV_HEADER, f);
+    char buf[256];
+    size_t n = 0;
+    pthread_rwlock_rdlock(&rwlock_tabla);
+    for (size_t p = 0; p < tabla.num_paginas; p++) {
+        const Pagina *pag = tabla.paginas[p];
+        for (uint32_t j = 0; j < pag->num_filas; j++) {
+            if (!(pag->filas[j].flags & FILA_VIVA)) continue;
+            fila_to_csv(&tabla.dic, &pag->filas[j], buf, sizeof(buf));
+            fputs(buf, f);
+            n++;
+        }
+    }
+    pthread_rwlock_unlock(&rwlock_tabla);
+    int ok = (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp_path, archivo) != 0) {
+        unlink(tmp_path);
+        return error_dup("ERROR: No se pudo escribir el archivo CSV.\n");
+    }
+
+    char *msg = (char *)malloc(256);
+    if (!msg) return NULL;
+    snprintf(msg, 256, "OK: %zu filas exportadas a %s.\n", n, archivo);
+    *is_success = 1;
+    return msg;
 }
 
+// --- Micro-benchmark del parser CSV (./servidor --bench-csv archivo [repeticiones])
+//
+// Compara el parser anterior (fgets + copia + strtok/atoi/atof) con csv_recorrer
+// sobre el mismo archivo y muestra filas/s y MB/s de cada uno. No abre sockets ni
+// toca la base de datos.
+
+// Parser anterior, conservado sólo como referencia para la comparación
 static int parse_record_line(const char *line, Registro *rec) {
     char copy[512];
     strncpy(copy, line, sizeof(copy) - 1);
@@ -498,267 +5387,758 @@ static int parse_record_line(const char *line, Registro *rec) {
     return 1;
 }
 
-static void record_to_csv(const Registro *rec, char *out, size_t out_size) {
-    snprintf(out, out_size, "%d;%s;%d;%.2f\n", rec->id, rec->producto, rec->cantidad, rec->precio);
+typedef struct {
+    long filas;
+    int64_t suma; // evita que el compilador descarte las conversiones
+} BenchCsv;
+
+static int bench_csv_fila(void *ctx, const FilaCsv *f) {
+    BenchCsv *b = (BenchCsv *)ctx;
+    b->filas++;
+    b->suma += f->id + f->cantidad + f->precio + (int64_t)f->largo_producto;
+    return 1;
 }
 
-void load_config(char *ip, int *puerto, int *max_clientes, int *backlog) {
-    strcpy(ip, "127.0.0.1");
-    *puerto = 8080;
-    *max_clientes = MAX_CLIENTS;
-    *backlog = BACKLOG_QUEUE;
+static int bench_csv(const char *path, int repeticiones) {
+    size_t bytes;
+    const char *datos = csv_mapear(path, &bytes);
+    if (!datos) {
+        fprintf(stderr, "ERROR: No se pudo abrir %s.\n", path);
+        return EXIT_FAILURE;
+    }
+#if defined(__AVX2__)
+    const char *variante = "AVX2";
+#elif defined(__SSE2__)
+    const char *variante = "SSE2";
+#else
+    const char *variante = "escalar";
+#endif
+    printf("[BENCH] %s: %.1f MB, %d repeticiones, parser nuevo con %s\n",
+           path, (double)bytes / 1e6, repeticiones, variante);
+
+    struct timespec inicio;
+    double ms_anterior = 0, ms_nuevo = 0;
+    long filas_anterior = 0, filas_nuevo = 0;
+    int64_t suma = 0;
+    char line[512];
+    for (int r = 0; r < repeticiones; r++) {
+        FILE *f = fopen(path, "r");
+        if (!f) break;
+        clock_gettime(CLOCK_MONOTONIC, &inicio);
+        filas_anterior = 0;
+        while (fgets(line, sizeof(line), f)) {
+            Registro reg;
+            if (parse_record_line(line, &reg) <= 0) continue;
+            suma += reg.id + reg.cantidad + (int64_t)reg.precio;
+            filas_anterior++;
+        }
+        ms_anterior += ms_desde(&inicio);
+        fclose(f);
+
+        BenchCsv b = { 0, 0 };
+        clock_gettime(CLOCK_MONOTONIC, &inicio);
+        csv_recorrer(datos, bytes, bench_csv_fila, &b);
+        ms_nuevo += ms_desde(&inicio);
+        filas_nuevo = b.filas;
+        suma += b.suma;
+    }
+    csv_desmapear(datos, bytes);
+
+    double mb = (double)bytes * repeticiones / 1e6;
+    printf("[BENCH] anterior (strtok/atoi/atof): %ld filas, %.1f ms, %.0f filas/s, %.1f MB/s\n",
+           filas_anterior, ms_anterior / repeticiones, filas_anterior * repeticiones / (ms_anterior / 1000.0), mb / (ms_anterior / 1000.0));
+    printf("[BENCH] nuevo (una pasada, %s):    %ld filas, %.1f ms, %.0f filas/s, %.1f MB/s\n",
+           variante, filas_nuevo, ms_nuevo / repeticiones, filas_nuevo * repeticiones / (ms_nuevo / 1000.0), mb / (ms_nuevo / 1000.0));
+    printf("[BENCH] aceleracion: %.2fx (control %lld)\n", ms_anterior / ms_nuevo, (long long)suma);
+    return EXIT_SUCCESS;
 }
 
-static char *read_entire_file(const char *path) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return NULL;
-    fseek(f, 0, SEEK_END);
-    long sz = ftell(f);
-    if (sz < 0) { fclose(f); return NULL; }
-    fseek(f, 0, SEEK_SET);
-    char *buf = (char *)malloc((size_t)sz + 1);
-    if (!buf) { fclose(f); return NULL; }
-    size_t rd = fread(buf, 1, (size_t)sz, f);
-    buf[rd] = '\0';
-    fclose(f);
-    return buf;
+// Versión de la fila que ve la transacción: la propia si la modificó, si no la confirmada.
+// Devuelve 1 si para la transacción la fila existe.
+static int transaccion_leer_fila(const Escrituras *e, int id, FilaDisco *fila) {
+    const FilaDisco *propia = escrituras_buscar(e, id);
+    if (propia) {
+        *fila = *propia;
+        return (propia->flags & FILA_VIVA) != 0;
+    }
+    pthread_rwlock_rdlock(&rwlock_tabla);
+    long slot = indice_buscar(&tabla, id);
+    if (slot >= 0) *fila = *tabla_fila(&tabla, (size_t)slot);
+    pthread_rwlock_unlock(&rwlock_tabla);
+    return slot >= 0;
 }
 
-static int write_all_text(const char *path, const char *text) {
-    FILE *f = fopen(path, "wb");
-    if (!f) return 0;
-    size_t len = strlen(text);
-    size_t wr = fwrite(text, 1, len, f);
-    fclose(f);
-    return wr == len;
+// Código del producto en el diccionario compartido; lo agrega si no existe (-1 sin memoria).
+// El diccionario sólo crece: un nombre agregado por una transacción sin confirmar no
+// aparece en ningún resultado.
+static long codigo_producto(const char *nombre) {
+    size_t largo = strlen(nombre);
+    pthread_rwlock_rdlock(&rwlock_tabla);
+    long codigo = diccionario_buscar(&tabla.dic, nombre, largo);
+    pthread_rwlock_unlock(&rwlock_tabla);
+    if (codigo >= 0) return codigo;
+    pthread_mutex_lock(&mutex_escritura);
+    pthread_rwlock_wrlock(&rwlock_tabla);
+    codigo = diccionario_agregar(&tabla.dic, nombre, largo);
+    pthread_rwlock_unlock(&rwlock_tabla);
+    pthread_mutex_unlock(&mutex_escritura);
+    return codigo;
 }
 
-char *execute_query(const char *command, int *is_success) {
+// Escribe los cambios de la transacción en el WAL y los aplica a la tabla. Todos los
+// registros se codifican en un buffer y se agregan con una sola escritura; si son varios
+// van dentro de un lote, que al reaplicar se descarta entero si quedó cortado. Si el WAL
+// falla la transacción sigue abierta con sus cambios. Una vez escrito el lote, el COMMIT
+// responde OK o no responde: si no se puede aplicar o sincronizar, wal_panico. Las
+// respuestas son constantes.
+static const char *confirmar_transaccion(Escrituras *e, int *is_success) {
     *is_success = 0;
+    size_t n = escrituras_cantidad(e);
+    if (n > 0) {
+        uint64_t traza = traza_inicio();
+        pthread_mutex_lock(&mutex_escritura);
+        traza_fin("mutex_escritura", traza, -1);
+        // Con mutex_escritura tomado nadie más modifica la tabla ni el diccionario: se leen sin el rwlock.
+        // Una fila insertada y borrada dentro de la misma transacción no deja registro.
+        size_t registros = 0;
+        for (size_t i = 0; i < n; i++) {
+            if ((e->filas[i].flags & FILA_VIVA) || indice_buscar(&tabla, e->filas[i].id) >= 0) registros++;
+        }
+        uint8_t *lote = (registros > 0) ? (uint8_t *)malloc((registros + 1) * WAL_MAX_REGISTRO) : NULL;
+        if (registros > 0 && !lote) {
+            pthread_mutex_unlock(&mutex_escritura);
+            return "ERROR: Memoria insuficiente. La transaccion sigue abierta.\n";
+        }
+        size_t usados = 0;
+        uint64_t lsn = wal_lsn;
+        Registro r;
+        if (registros > 1) {
+            memset(&r, 0, sizeof(r));
+            r.id = (int)registros;
+            usados += wal_codificar(lote, ++lsn, WAL_OP_LOTE, &r);
+        }
+        for (size_t i = 0; i < n; i++) {
+            const FilaDisco *f = &e->filas[i];
+            int existe = indice_buscar(&tabla, f->id) >= 0;
+            if (f->flags & FILA_VIVA) {
+                fila_a_registro(&tabla, f, &r);
+                usados += wal_codificar(lote + usados, ++lsn, existe ? WAL_OP_UPDATE : WAL_OP_INSERT, &r);
+            } else if (existe) {
+                memset(&r, 0, sizeof(r));
+                r.id = f->id;
+                usados += wal_codificar(lote + usados, ++lsn, WAL_OP_DELETE, &r);
+            }
+        }
+        traza = traza_inicio();
+        int ok = (registros == 0) || wal_escribir_lote(lote, usados, lsn - wal_lsn);
+        traza_fin("wal_escribir", traza, (long)usados);
+        free(lote);
+        if (!ok) {
+            pthread_mutex_unlock(&mutex_escritura);
+            return "ERROR: No se pudo escribir el WAL. La transaccion sigue abierta.\n";
+        }
 
-    char cmd[MAX_COMMAND_LENGTH];
-    strncpy(cmd, command, sizeof(cmd) - 1);
-    cmd[sizeof(cmd) - 1] = '\0';
-    char *pcmd = cmd; ltrim_inplace(&pcmd);
+        traza = traza_inicio();
+        pthread_rwlock_wrlock(&rwlock_tabla);
+        traza_fin("wrlock_tabla", traza, -1);
+        traza = traza_inicio();
+        for (size_t i = 0; i < n; i++) {
+            const FilaDisco *f = &e->filas[i];
+            int aplicado = (f->flags & FILA_VIVA) ? tabla_upsert_fila(&tabla, f) : tabla_borrar(&tabla, f->id) >= 0;
+            // Con el wrlock todavía tomado: ningún lector llega a ver la transacción a medias
+            if (!aplicado) wal_panico("memoria insuficiente al aplicar una transaccion ya escrita en el WAL");
+        }
+        tabla_nueva_version();
+        pthread_rwlock_unlock(&rwlock_tabla);
+        traza_fin("aplicar_a_tabla", traza, (long)n);
+        compactacion_verificar_umbrales();
+        pthread_mutex_unlock(&mutex_escritura);
+        // Se responde (y se sueltan los locks) recién cuando el lote está en disco. Los
+        // SELECT de otras conexiones ya pueden ver los cambios mientras tanto.
+        traza = traza_inicio();
+        if (registros > 0) wal_esperar_durable(lsn);
+        traza_fin("wal_fsync", traza, -1);
+    }
+    *is_success = 1;
+    return "OK: Transaccion confirmada. Locks liberados.\n";
+}
 
-    if (strncmp(pcmd, "SELECT ALL", 10) == 0) {
-        char *content = read_entire_file(CSV_FILE_NAME);
-        if (!content) {
-            char *err = (char *)malloc(64);
-            strcpy(err, "ERROR: No se pudo leer el CSV.\n");
-            return err;
-        }
-        size_t content_len = strlen(content);
-        if (content_len > 3000) {
-            char *chunk_response = (char *)malloc(100);
-            snprintf(chunk_response, 100, "OK: Contenido grande (%zu bytes). Enviando en chunks...\n", content_len);
-            *is_success = 1;
-            return chunk_response;
-        }
-        *is_success = 1;
-        return content;
-    }
-
-    if (strncmp(pcmd, "SELECT WHERE", 12) == 0) {
-        char *cond = pcmd + 12;
-        ltrim_inplace(&cond);
-        char field[32] = {0};
-        char value[128] = {0};
-        if (sscanf(cond, "%31[^=]=%127s", field, value) != 2) {
-            char *err = (char *)malloc(64);
-            strcpy(err, "ERROR: Formato de WHERE invalido.\n");
-            return err;
-        }
-        size_t vlen = strlen(value);
-        if ((vlen >= 2) && ((value[0] == '"' && value[vlen-1] == '"') || (value[0] == '\'' && value[vlen-1] == '\''))) {
-            value[vlen-1] = '\0';
-            memmove(value, value+1, vlen-1);
-        }
-
-        FILE *f = fopen(CSV_FILE_NAME, "r");
-        if (!f) {
-            char *err = (char *)malloc(64);
-            strcpy(err, "ERROR: No se pudo abrir el CSV.\n");
-            return err;
-        }
-
-        size_t cap = 1024; size_t len = 0;
-        char *out = (char *)malloc(cap);
-        if (!out) { fclose(f); char *err = (char *)malloc(64); strcpy(err, "ERROR: Memoria insuficiente.\n"); return err; }
-        out[0] = '\0';
-
-        char line[512];
-        while (fgets(line, sizeof(line), f)) {
-            Registro r; int pr = parse_record_line(line, &r);
-            if (pr <= 0) {
-                if (strncmp(line, "ID;", 3) == 0) {
-                    size_t l = strlen(line); if (len + l + 1 > cap) { cap *= 2; out = (char *)realloc(out, cap); }
-                    memcpy(out + len, line, l); len += l; out[len] = '\0';
-                }
-                continue;
-            }
+// --- Modificaciones: INSERT (una o varias filas), UPDATE, DELETE y BATCH
+//
+// Una sentencia (o todo un BATCH) se parsea completa antes de tocar nada. Después se
+// toman de una vez los locks de todas sus filas y recién entonces se aplican los cambios
+// al conjunto de escritura de la transacción. Si una fila falla (ID repetido, sin
+// memoria) se deshace lo que la sentencia ya había aplicado: un INSERT de muchas filas
+// o un BATCH entra entero a la transacción o no entra. El WAL se escribe una sola vez,
+// en el COMMIT.
 
-            int match = 0;
-            if (strcasecmp(field, "ID") == 0) {
-                match = (r.id == atoi(value));
-            } else if (strcasecmp(field, "Producto") == 0) {
-                match = (strcmp(r.producto, value) == 0);
-            } else if (strcasecmp(field, "Cantidad") == 0) {
-                match = (r.cantidad == atoi(value));
-            } else if (strcasecmp(field, "Precio") == 0) {
-                match = (fabs(r.precio - atof(value)) < 1e-9);
-            }
+typedef enum { OP_INSERT, OP_UPDATE, OP_DELETE } TipoOperacion;
 
-            if (match) {
-                char buf[256];
-                record_to_csv(&r, buf, sizeof(buf));
-                size_t l = strlen(buf); if (len + l + 1 > cap) { cap = (cap + l) * 2; out = (char *)realloc(out, cap); }
-                memcpy(out + len, buf, l); len += l; out[len] = '\0';
-            }
+typedef struct {
+    TipoOperacion tipo;
+    int id;
+    int sentencia;          // número de sentencia dentro del BATCH (desde 1)
+    CampoRegistro campo;    // UPDATE
+    int cantidad;           // INSERT
+    double precio;          // INSERT
+    char texto[128];        // INSERT: producto; UPDATE: valor nuevo
+} Operacion;
+
+typedef struct {
+    Operacion *ops;
+    size_t num, cap;
+} ListaOperaciones;
+
+static Operacion *operaciones_agregar(ListaOperaciones *l, TipoOperacion tipo, int sentencia) {
+    if (l->num == l->cap) {
+        size_t nueva = l->cap ? l->cap * 2 : 8;
+        Operacion *ops = (Operacion *)realloc(l->ops, nueva * sizeof(Operacion));
+        if (!ops) return NULL;
+        l->ops = ops;
+        l->cap = nueva;
+    }
+    Operacion *op = &l->ops[l->num++];
+    memset(op, 0, sizeof(*op));
+    op->tipo = tipo;
+    op->sentencia = sentencia;
+    return op;
+}
+
+// Filas "id;producto;cantidad;precio" separadas por ','. El producto termina en ';', así
+// que puede tener comas.
+static const char *parsear_insert(const char *args, int sentencia, ListaOperaciones *l) {
+    const char *p = args;
+    for (;;) {
+        Operacion *op = operaciones_agregar(l, OP_INSERT, sentencia);
+        if (!op) return "ERROR: Memoria insuficiente.\n";
+        int usados = 0;
+        if (sscanf(p, "%d;%127[^;];%d;%lf%n", &op->id, op->texto, &op->cantidad, &op->precio, &usados) != 4) {
+            return "ERROR: Formato INSERT invalido.\n";
         }
-        fclose(f);
-        if (len == 0) {
-            char *msg = (char *)malloc(32); strcpy(msg, "OK: 0 filas.\n"); *is_success = 1; return msg;
+        p += usados;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') return NULL;
+        if (*p != ',') return "ERROR: Formato INSERT invalido.\n";
+        p++;
+    }
+}
+
+// Agrega a la lista las operaciones de una sentencia; devuelve el error o NULL
+static const char *parsear_sentencia(const char *sentencia, int numero, ListaOperaciones *l) {
+    while (*sentencia == ' ' || *sentencia == '\t') sentencia++;
+
+    if (strncmp(sentencia, "INSERT", 6) == 0) {
+        const char *args = sentencia + 6;
+        while (*args == ' ' || *args == '\t') args++;
+        return parsear_insert(args, numero, l);
+    }
+
+    if (strncmp(sentencia, "UPDATE", 6) == 0) {
+        int id; char field[32]; char value[128];
+        if (sscanf(sentencia, "UPDATE ID=%d SET %31[^=]=%127s", &id, field, value) != 3) {
+            return "ERROR: Formato UPDATE invalido.\n";
         }
-    *is_success = 1;
-        return out;
+        strip_quotes(value);
+        CampoRegistro campo = campo_desde_nombre(field);
+        if (campo == CAMPO_NINGUNO) return "ERROR: Campo de UPDATE desconocido.\n";
+        if (campo == CAMPO_ID) return "ERROR: El ID no se puede modificar.\n";
+        if (campo == CAMPO_PRODUCTO && strchr(value, ';')) return "ERROR: Producto no puede contener ';'.\n";
+        Operacion *op = operaciones_agregar(l, OP_UPDATE, numero);
+        if (!op) return "ERROR: Memoria insuficiente.\n";
+        op->id = id;
+        op->campo = campo;
+        strcpy(op->texto, value);
+        return NULL;
+    }
+
+    if (strncmp(sentencia, "DELETE", 6) == 0) {
+        int id;
+        if (sscanf(sentencia, "DELETE ID=%d", &id) != 1) return "ERROR: Formato DELETE invalido.\n";
+        Operacion *op = operaciones_agregar(l, OP_DELETE, numero);
+        if (!op) return "ERROR: Memoria insuficiente.\n";
+        op->id = id;
+        return NULL;
     }
 
-    char *err = (char *)malloc(64);
-    strcpy(err, "ERROR: Formato SELECT no soportado.\n");
-    return err;
+    return "ERROR: Operacion no soportada.\n";
 }
 
-char *perform_modification(const char *command, int *is_success) {
-    *is_success = 0;
+// Aplica una operación con sus locks ya tomados. Devuelve el error o NULL; *afectada
+// queda en 0 si UPDATE/DELETE no encontró la fila.
+static const char *aplicar_operacion(Escrituras *cambios, PuntoRetorno *pr, const Operacion *op, int *afectada) {
+    FilaDisco f;
+    *afectada = transaccion_leer_fila(cambios, op->id, &f);
+    if (op->tipo == OP_INSERT) {
+        // El lock del ID también evita que otra transacción inserte el mismo
+        if (*afectada) return "ERROR: Ya existe un registro con ese ID.\n";
+        long codigo = codigo_producto(op->texto);
+        if (codigo < 0) return "ERROR: Memoria insuficiente.\n";
+        FilaDisco nueva = { op->id, (uint32_t)codigo, op->cantidad, FILA_VIVA, precio_a_centavos(op->precio) };
+        f = nueva;
+        *afectada = 1;
+    } else if (!*afectada) {
+        return NULL;
+    } else if (op->tipo == OP_DELETE) {
+        f.flags &= ~FILA_VIVA;
+    } else if (op->campo == CAMPO_PRODUCTO) {
+        long codigo = codigo_producto(op->texto);
+        if (codigo < 0) return "ERROR: Memoria insuficiente.\n";
+        f.producto = (uint32_t)codigo;
+    } else if (op->campo == CAMPO_CANTIDAD) {
+        f.cantidad = atoi(op->texto);
+    } else {
+        f.precio = precio_a_centavos(atof(op->texto));
+    }
+    return escrituras_poner_deshacible(cambios, pr, &f) ? NULL : "ERROR: Memoria insuficiente.\n";
+}
 
-    char cmd[MAX_COMMAND_LENGTH];
-    strncpy(cmd, command, sizeof(cmd) - 1);
-    cmd[sizeof(cmd) - 1] = '\0';
-    char *pcmd = cmd; ltrim_inplace(&pcmd);
+// Ejecuta la lista en la transacción, todo o nada. conteo: filas insertadas, actualizadas
+// y eliminadas. Devuelve NULL o la respuesta de error (con el número de sentencia si es un lote).
+static char *ejecutar_operaciones(Transaccion *tx, const ListaOperaciones *l, int es_lote, size_t conteo[3]) {
+    int *ids = (int *)malloc((l->num ? l->num : 1) * sizeof(int));
+    if (!ids) return error_dup("ERROR: Memoria insuficiente.\n");
+    for (size_t i = 0; i < l->num; i++) ids[i] = l->ops[i].id;
+    uint64_t traza = traza_inicio();
+    int rc = transaccion_bloquear_filas(tx, ids, l->num);
+    traza_fin("locks_filas", traza, (long)l->num);
+    free(ids);
+    if (rc != LOCK_OK) return transaccion_error_lock(tx, rc);
 
-    if (strncmp(pcmd, "INSERT", 6) == 0) {
-        char *args = pcmd + 6; ltrim_inplace(&args);
-        int id, qty; double precio; char prod[128];
-        if (sscanf(args, "%d;%127[^;];%d;%lf", &id, prod, &qty, &precio) != 4) {
-            char *e = (char *)malloc(64); strcpy(e, "ERROR: Formato INSERT invalido.\n"); return e;
+    PuntoRetorno pr = { escrituras_cantidad(tx->escrituras), NULL, 0, 0 };
+    const char *error = NULL;
+    size_t i;
+    traza = traza_inicio();
+    for (i = 0; i < l->num && !error; i++) {
+        int afectada;
+        error = aplicar_operacion(tx->escrituras, &pr, &l->ops[i], &afectada);
+        if (!error && afectada) conteo[l->ops[i].tipo]++;
+    }
+    traza_fin("aplicar_a_transaccion", traza, (long)l->num);
+    char *respuesta = NULL;
+    if (error) {
+        escrituras_volver(tx->escrituras, &pr);
+        conteo[OP_INSERT] = conteo[OP_UPDATE] = conteo[OP_DELETE] = 0;
+        if (!es_lote) {
+            respuesta = error_dup(error);
+        } else if ((respuesta = (char *)malloc(256)) != NULL) {
+            snprintf(respuesta, 256, "ERROR: Sentencia %d del lote: %s", l->ops[i - 1].sentencia, error + 7);
         }
-        FILE *f = fopen(CSV_FILE_NAME, "a");
-        if (!f) { char *e = (char *)malloc(64); strcpy(e, "ERROR: No se pudo abrir el CSV para escribir.\n"); return e; }
-        fprintf(f, "%d;%s;%d;%.2f\n", id, prod, qty, precio);
-        fclose(f);
-    *is_success = 1;
-        char *ok = (char *)malloc(64); strcpy(ok, "OK: Fila insertada.\n"); return ok;
+        if (!respuesta) respuesta = error_dup("ERROR: Memoria insuficiente.\n");
     }
+    free(pr.previas);
+    return respuesta;
+}
 
-    if (strncmp(pcmd, "UPDATE", 6) == 0) {
-        int id; char field[32]; char value[128];
-        if (sscanf(pcmd, "UPDATE ID=%d SET %31[^=]=%127s", &id, field, value) != 3) {
-            char *e = (char *)malloc(64); strcpy(e, "ERROR: Formato UPDATE invalido.\n"); return e;
+// Ejecuta las operaciones de una sentencia ya parseada y escribe la respuesta en 'out';
+// devuelve 1 si la sentencia cambió alguna fila
+static int ejecutar_modificacion(Transaccion *tx, const ListaOperaciones *l, Salida *out) {
+    size_t conteo[3] = { 0, 0, 0 };
+    char *fallo = ejecutar_operaciones(tx, l, 0, conteo);
+    TipoOperacion tipo = l->ops[0].tipo;
+    size_t filas = l->num;
+    if (fallo) {
+        salida_entregar(out, fallo);
+        return 0;
+    }
+
+    if (tipo == OP_INSERT && filas > 1) {
+        char ok[64];
+        snprintf(ok, sizeof(ok), "OK: %zu filas insertadas.\n", filas);
+        salida_texto(out, ok);
+    } else if (tipo == OP_INSERT) {
+        salida_texto(out, "OK: Fila insertada.\n");
+    } else if (tipo == OP_UPDATE) {
+        salida_texto(out, conteo[tipo] ? "OK: Fila actualizada.\n" : "OK: 0 filas actualizadas.\n");
+    } else {
+        salida_texto(out, conteo[tipo] ? "OK: Fila eliminada.\n" : "OK: 0 filas eliminadas.\n");
+    }
+    return conteo[tipo] > 0;
+}
+
+// Escribe la respuesta en 'out'; devuelve 1 si la sentencia cambió alguna fila
+int perform_modification(const char *command, Transaccion *tx, Salida *out) {
+    ListaOperaciones l = { NULL, 0, 0 };
+    uint64_t traza = traza_inicio();
+    const char *error = parsear_sentencia(command, 1, &l);
+    traza_fin("parsear", traza, -1);
+    if (error) {
+        free(l.ops);
+        salida_texto(out, error);
+        return 0;
+    }
+    int cambio = ejecutar_modificacion(tx, &l, out);
+    free(l.ops);
+    return cambio;
+}
+
+// "BATCH\n<sentencia>\n...\nEND": INSERT, UPDATE y DELETE, uno por línea. Se parsean
+// todas antes de ejecutar ninguna; *sentencias queda con la cantidad.
+static char *ejecutar_lote(const char *command, Transaccion *tx, size_t *sentencias, size_t conteo[3]) {
+    const char *p = strchr(command, '\n');
+    if (!p || !linea_es(command, p, "BATCH")) return error_dup("ERROR: Formato BATCH invalido. Use BATCH, una sentencia por linea y END.\n");
+    ListaOperaciones l = { NULL, 0, 0 };
+    char linea[MAX_ENTRADA_CONEXION];
+    int numero = 0, terminado = 0;
+    char *respuesta = NULL;
+    for (p++; *p && !respuesta; ) {
+        const char *fin = strchr(p, '\n');
+        if (!fin) fin = p + strlen(p);
+        if (terminado) {
+            if (!linea_es(p, fin, "")) respuesta = error_dup("ERROR: Hay texto despues de END.\n");
+        } else if (linea_es(p, fin, "END")) {
+            terminado = 1;
+        } else if (!linea_es(p, fin, "")) {
+            size_t largo = (size_t)(fin - p);
+            memcpy(linea, p, largo);
+            linea[largo] = '\0';
+            if (largo > 0 && linea[largo - 1] == '\r') linea[largo - 1] = '\0';
+            const char *error = parsear_sentencia(linea, ++numero, &l);
+            if (error && (respuesta = (char *)malloc(256)) != NULL) {
+                snprintf(respuesta, 256, "ERROR: Sentencia %d del lote: %s", numero, error + 7);
+            } else if (error) {
+                respuesta = error_dup("ERROR: Memoria insuficiente.\n");
+            }
         }
-        size_t vlen = strlen(value);
-        if ((vlen >= 2) && ((value[0] == '"' && value[vlen-1] == '"') || (value[0] == '\'' && value[vlen-1] == '\''))) {
-            value[vlen-1] = '\0';
-            memmove(value, value+1, vlen-1);
+        p = *fin ? fin + 1 : fin;
+    }
+    if (!respuesta && !terminado) respuesta = error_dup("ERROR: Falta END al final del BATCH.\n");
+    if (!respuesta && numero == 0) respuesta = error_dup("ERROR: BATCH sin sentencias.\n");
+    if (!respuesta) respuesta = ejecutar_operaciones(tx, &l, 1, conteo);
+    free(l.ops);
+    *sentencias = (size_t)numero;
+    return respuesta;
+}
+
+// --- Sentencias preparadas (PREPARE / EXECUTE / DEALLOCATE)
+//
+// PREPARE nombre AS <sentencia> parsea y valida una vez un SELECT, un INSERT de una fila,
+// un UPDATE o un DELETE con '?' en lugar de algunos valores, y guarda el plan (o la
+// operación) en la conexión. EXECUTE nombre(v1, v2, ...) copia ese plan, pone cada valor
+// en su lugar y lo ejecuta sin volver a pasar por el parser. Para ubicar los '?' se
+// parsea la sentencia con un valor testigo distinto en cada uno y se busca en qué campo
+// quedó. Los valores admitidos son el de WHERE, LIMIT y OFFSET en un SELECT, y el ID y
+// los valores en INSERT, UPDATE y DELETE.
+
+#define TESTIGO_PARAMETRO 1999999000L // valor de prueba del '?' número k: TESTIGO_PARAMETRO + k
+
+typedef enum {
+    PARAM_FILTRO, PARAM_LIMITE, PARAM_DESPLAZAMIENTO, // SELECT
+    PARAM_ID, PARAM_TEXTO, PARAM_CANTIDAD, PARAM_PRECIO // INSERT / UPDATE / DELETE
+} DestinoParametro;
+
+struct Preparada {
+    char nombre[32];
+    int es_select, select_all;
+    PlanConsulta plan;       // SELECT
+    Operacion op;            // INSERT, UPDATE o DELETE
+    int num_parametros;
+    DestinoParametro destinos[MAX_PARAMETROS];
+    char plantilla[MAX_COMMAND_LENGTH]; // SELECT normalizado con sus '?': arma la clave de la caché
+    struct Preparada *siguiente;
+};
+
+static Preparada **preparada_buscar(Conexion *c, const char *nombre) {
+    Preparada **p = &c->preparadas;
+    while (*p && strcmp((*p)->nombre, nombre) != 0) p = &(*p)->siguiente;
+    return p;
+}
+
+static void preparadas_liberar(Conexion *c) {
+    while (c->preparadas) {
+        Preparada *pr = c->preparadas;
+        c->preparadas = pr->siguiente;
+        free(pr);
+    }
+    c->num_preparadas = 0;
+}
+
+// Busca el único campo donde quedó el testigo del parámetro k
+static int preparada_ubicar(Preparada *pr, int k) {
+    long testigo = TESTIGO_PARAMETRO + k;
+    char texto[16];
+    snprintf(texto, sizeof(texto), "%ld", testigo);
+    int hallados = 0;
+    DestinoParametro destino = PARAM_FILTRO;
+    if (pr->es_select) {
+        if (pr->plan.tiene_filtro && strcmp(pr->plan.filtro_valor, texto) == 0) { destino = PARAM_FILTRO; hallados++; }
+        if (pr->plan.limite == testigo) { destino = PARAM_LIMITE; hallados++; }
+        if (pr->plan.desplazamiento == testigo) { destino = PARAM_DESPLAZAMIENTO; hallados++; }
+    } else {
+        const Operacion *op = &pr->op;
+        if (op->id == testigo) { destino = PARAM_ID; hallados++; }
+        if (strcmp(op->texto, texto) == 0) { destino = PARAM_TEXTO; hallados++; }
+        if (op->tipo == OP_INSERT && op->cantidad == testigo) { destino = PARAM_CANTIDAD; hallados++; }
+        if (op->tipo == OP_INSERT && op->precio == (double)testigo) { destino = PARAM_PRECIO; hallados++; }
+    }
+    pr->destinos[k] = destino;
+    return hallados == 1;
+}
+
+static const char *preparada_crear(Conexion *c, const char *command, char *nombre) {
+    int consumido = 0;
+    sscanf(command, "PREPARE %31[A-Za-z0-9_] AS %n", nombre, &consumido);
+    if (consumido == 0) return "ERROR: Formato: PREPARE <nombre> AS <SELECT|INSERT|UPDATE|DELETE con ?>\n";
+    if (*preparada_buscar(c, nombre)) return "ERROR: Ya existe una sentencia preparada con ese nombre.\n";
+    if (c->num_preparadas >= MAX_PREPARADAS) return "ERROR: Demasiadas sentencias preparadas; libere alguna con DEALLOCATE.\n";
+    const char *sentencia = command + consumido;
+    if (strlen(sentencia) >= MAX_COMMAND_LENGTH) return "ERROR: Sentencia demasiado larga.\n";
+
+    // La sentencia con un testigo en cada '?', para el parser de siempre
+    char texto[MAX_COMMAND_LENGTH + MAX_PARAMETROS * 12];
+    size_t n = 0;
+    int num = 0;
+    for (const char *p = sentencia; *p; p++) {
+        if (*p != '?') { texto[n++] = *p; continue; }
+        if (num == MAX_PARAMETROS) return "ERROR: Una sentencia preparada admite hasta 8 parametros.\n";
+        n += (size_t)snprintf(texto + n, sizeof(texto) - n, "%ld", TESTIGO_PARAMETRO + num++);
+    }
+    texto[n] = '\0';
+
+    Preparada *pr = (Preparada *)calloc(1, sizeof(Preparada));
+    if (!pr) return "ERROR: Memoria insuficiente.\n";
+    const char *err;
+    if (strncmp(texto, "SELECT", 6) == 0) {
+        pr->es_select = 1;
+        pr->select_all = es_select_all_simple(texto);
+        err = parse_select(texto, &pr->plan);
+        cache_normalizar(sentencia, pr->plantilla);
+    } else {
+        ListaOperaciones l = { NULL, 0, 0 };
+        err = parsear_sentencia(texto, 1, &l);
+        if (!err && l.num != 1) err = "ERROR: Una sentencia preparada admite un INSERT de una sola fila.\n";
+        if (!err) pr->op = l.ops[0];
+        free(l.ops);
+    }
+    pr->num_parametros = num;
+    for (int k = 0; k < num && !err; k++) {
+        if (!preparada_ubicar(pr, k)) err = "ERROR: '?' solo puede reemplazar el valor de WHERE, LIMIT u OFFSET, o un valor de INSERT, UPDATE o DELETE.\n";
+    }
+    if (err) { free(pr); return err; }
+    strcpy(pr->nombre, nombre);
+    pr->siguiente = c->preparadas;
+    c->preparadas = pr;
+    c->num_preparadas++;
+    return NULL;
+}
+
+// Separa "(v1, v2, ...)" en 'valores'. Un valor entre comillas puede tener comas.
+// Devuelve la cantidad o -1 si el formato no es válido.
+static int parametros_separar(const char *p, char valores[][128]) {
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '\0' || *p == '\r') return 0;
+    if (*p++ != '(') return -1;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == ')') return solo_espacios(p + 1) ? 0 : -1;
+    int num = 0;
+    for (;;) {
+        if (num == MAX_PARAMETROS) return -1;
+        while (*p == ' ' || *p == '\t') p++;
+        size_t n = 0;
+        char comilla = (*p == '\'' || *p == '"') ? *p : 0;
+        if (comilla) {
+            const char *cierre = strchr(p + 1, comilla);
+            if (!cierre) return -1;
+            n = (size_t)(cierre - p) + 1;
+        } else {
+            while (p[n] && p[n] != ',' && p[n] != ')') n++;
+            while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t')) n--;
         }
+        if (n == 0 || n >= 128) return -1;
+        memcpy(valores[num], p, n);
+        valores[num][n] = '\0';
+        strip_quotes(valores[num]);
+        num++;
+        p += n;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ')') return solo_espacios(p + 1) ? num : -1;
+        if (*p++ != ',') return -1;
+    }
+}
 
-        FILE *f = fopen(CSV_FILE_NAME, "r");
-        if (!f) { char *e = (char *)malloc(64); strcpy(e, "ERROR: No se pudo abrir el CSV.\n"); return e; }
+// Pone el valor en el campo del plan o de la operación; devuelve el motivo si no es válido
+static const char *parametro_poner(DestinoParametro destino, const char *valor, PlanConsulta *plan, Operacion *op) {
+    char *fin;
+    errno = 0;
+    if (*valor == '\0') return "el valor esta vacio";
+    switch (destino) {
+    case PARAM_FILTRO:
+        // Igual que un WHERE escrito a mano: un solo valor, sin espacios
+        if (strpbrk(valor, " \t")) return "el valor no puede tener espacios";
+        strcpy(plan->filtro_valor, valor);
+        plan->filtro_numero = (plan->filtro_campo == CAMPO_PRECIO) ? precio_a_centavos(atof(valor)) : atoi(valor);
+        return NULL;
+    case PARAM_LIMITE:
+    case PARAM_DESPLAZAMIENTO: {
+        long v = strtol(valor, &fin, 10);
+        if (fin == valor || *fin || errno || v < 0) return "se esperaba un entero no negativo";
+        if (destino == PARAM_LIMITE) plan->limite = v; else plan->desplazamiento = v;
+        return NULL;
+    }
+    case PARAM_ID:
+    case PARAM_CANTIDAD: {
+        long v = strtol(valor, &fin, 10);
+        if (fin == valor || *fin || errno || v < INT_MIN || v > INT_MAX) return "se esperaba un entero";
+        if (destino == PARAM_ID) op->id = (int)v; else op->cantidad = (int)v;
+        return NULL;
+    }
+    case PARAM_PRECIO: {
+        double v = strtod(valor, &fin);
+        if (fin == valor || *fin || errno) return "se esperaba un numero";
+        op->precio = v;
+        return NULL;
+    }
+    case PARAM_TEXTO:
+        if (strchr(valor, ';')) return "el texto no puede tener ';'";
+        strcpy(op->texto, valor);
+        return NULL;
+    }
+    return "destino desconocido";
+}
 
-        size_t cap = 1024; size_t len = 0; int updated = 0;
-        char *out = (char *)malloc(cap); if (!out) { fclose(f); char *e = (char *)malloc(64); strcpy(e, "ERROR: Memoria insuficiente.\n"); return e; }
-        out[0] = '\0';
-        char line[512];
-        while (fgets(line, sizeof(line), f)) {
-            if (strncmp(line, "ID;", 3) == 0) {
-                size_t l = strlen(line); if (len + l + 1 > cap) { cap = (cap + l) * 2; out = (char *)realloc(out, cap); }
-                memcpy(out + len, line, l); len += l; out[len] = '\0';
-                continue;
-            }
-            Registro r; int pr = parse_record_line(line, &r);
-            if (pr > 0 && r.id == id) {
-                if (strcasecmp(field, "Producto") == 0) {
-                    strncpy(r.producto, value, sizeof(r.producto)-1); r.producto[sizeof(r.producto)-1] = '\0';
-                } else if (strcasecmp(field, "Cantidad") == 0) {
-                    r.cantidad = atoi(value);
-                } else if (strcasecmp(field, "Precio") == 0) {
-                    r.precio = atof(value);
-                }
-                char buf[256]; record_to_csv(&r, buf, sizeof(buf));
-                size_t l = strlen(buf); if (len + l + 1 > cap) { cap = (cap + l) * 2; out = (char *)realloc(out, cap); }
-                memcpy(out + len, buf, l); len += l; out[len] = '\0';
-                updated = 1; continue;
-            }
-            size_t l = strlen(line); if (len + l + 1 > cap) { cap = (cap + l) * 2; out = (char *)realloc(out, cap); }
-            memcpy(out + len, line, l); len += l; out[len] = '\0';
+// Arma en 'texto' la consulta con los valores en lugar de los '?' (clave de la caché).
+// Devuelve 0 si no entra.
+static int preparada_texto(const Preparada *pr, char valores[][128], char *texto, size_t cap) {
+    size_t n = 0;
+    int k = 0;
+    for (const char *p = pr->plantilla; *p; p++) {
+        const char *trozo = (*p == '?') ? valores[k++] : p;
+        size_t largo = (*p == '?') ? strlen(trozo) : 1;
+        if (n + largo >= cap) return 0;
+        memcpy(texto + n, trozo, largo);
+        n += largo;
+    }
+    texto[n] = '\0';
+    return 1;
+}
+
+static void preparada_ejecutar(Conexion *c, const char *command, Salida *out) {
+    char nombre[32];
+    int consumido = 0;
+    if (sscanf(command, "EXECUTE %31[A-Za-z0-9_]%n", nombre, &consumido) != 1) {
+        salida_texto(out, "ERROR: Formato: EXECUTE <nombre>[(valor, ...)]\n");
+        return;
+    }
+    Preparada *pr = *preparada_buscar(c, nombre);
+    if (!pr) {
+        salida_texto(out, "ERROR: No existe una sentencia preparada con ese nombre.\n");
+        return;
+    }
+    char valores[MAX_PARAMETROS][128];
+    int num = parametros_separar(command + consumido, valores);
+    if (num < 0) {
+        salida_texto(out, "ERROR: Formato: EXECUTE <nombre>[(valor, ...)]\n");
+        return;
+    }
+    char msg[128];
+    if (num != pr->num_parametros) {
+        snprintf(msg, sizeof(msg), "ERROR: La sentencia %s espera %d parametros.\n", pr->nombre, pr->num_parametros);
+        salida_texto(out, msg);
+        return;
+    }
+    PlanConsulta plan = pr->plan;
+    Operacion op = pr->op;
+    for (int k = 0; k < num; k++) {
+        const char *motivo = parametro_poner(pr->destinos[k], valores[k], &plan, &op);
+        if (motivo) {
+            snprintf(msg, sizeof(msg), "ERROR: Parametro %d invalido: %s.\n", k + 1, motivo);
+            salida_texto(out, msg);
+            return;
         }
-        fclose(f);
-        int okw = write_all_text(CSV_FILE_NAME, out);
-        free(out);
-        if (!okw) { char *e = (char *)malloc(64); strcpy(e, "ERROR: No se pudo escribir el CSV.\n"); return e; }
-        *is_success = updated;
-        if (updated) { char *ok = (char *)malloc(64); strcpy(ok, "OK: Fila actualizada.\n"); return ok; }
-        char *no = (char *)malloc(64); strcpy(no, "OK: 0 filas actualizadas.\n"); return no;
     }
 
-    if (strncmp(pcmd, "DELETE", 6) == 0) {
-        int id;
-        if (sscanf(pcmd, "DELETE ID=%d", &id) != 1) {
-            char *e = (char *)malloc(64); strcpy(e, "ERROR: Formato DELETE invalido.\n"); return e;
-        }
-        FILE *f = fopen(CSV_FILE_NAME, "r");
-        if (!f) { char *e = (char *)malloc(64); strcpy(e, "ERROR: No se pudo abrir el CSV.\n"); return e; }
-        size_t cap = 1024; size_t len = 0; int deleted = 0;
-        char *out = (char *)malloc(cap); if (!out) { fclose(f); char *e = (char *)malloc(64); strcpy(e, "ERROR: Memoria insuficiente.\n"); return e; }
-        out[0] = '\0';
-        char line[512];
-        while (fgets(line, sizeof(line), f)) {
-            if (strncmp(line, "ID;", 3) == 0) {
-                size_t l = strlen(line); if (len + l + 1 > cap) { cap = (cap + l) * 2; out = (char *)realloc(out, cap); }
-                memcpy(out + len, line, l); len += l; out[len] = '\0';
-                continue;
-            }
-            Registro r; int pr = parse_record_line(line, &r);
-            if (pr > 0 && r.id == id) { deleted = 1; continue; }
-            size_t l = strlen(line); if (len + l + 1 > cap) { cap = (cap + l) * 2; out = (char *)realloc(out, cap); }
-            memcpy(out + len, line, l); len += l; out[len] = '\0';
+    if (!pr->es_select) {
+        if (!c->transaccion_activa) {
+            salida_texto(out, "ERROR: Las modificaciones requieren BEGIN TRANSACTION.\n");
+            return;
         }
-        fclose(f);
-        int okw = write_all_text(CSV_FILE_NAME, out);
-        free(out);
-        if (!okw) { char *e = (char *)malloc(64); strcpy(e, "ERROR: No se pudo escribir el CSV.\n"); return e; }
-        *is_success = deleted;
-        if (deleted) { char *ok = (char *)malloc(64); strcpy(ok, "OK: Fila eliminada.\n"); return ok; }
-        char *no = (char *)malloc(64); strcpy(no, "OK: 0 filas eliminadas.\n"); return no;
+        ListaOperaciones l = { &op, 1, 1 };
+        ejecutar_modificacion(c->transaccion, &l, out);
+        return;
     }
+    char texto[MAX_COMMAND_LENGTH];
+    int con_cache = preparada_texto(pr, valores, texto, sizeof(texto));
+    size_t antes = out->len;
+    Flujo *flujo = NULL;
+    int ok = ejecutar_plan(&plan, con_cache ? texto : NULL, pr->select_all, c->transaccion, out, &flujo);
+    if (flujo) {
+        c->flujo = flujo;
+        conexion_continuar_flujo(c, out);
+    } else if (!c->tramas && pr->select_all && ok && out->len - antes > 3000) {
+        salida_texto(out, "\n---END---\n");
+    }
+}
+
+static const char *preparada_liberar(Conexion *c, const char *command, char *nombre) {
+    int consumido = 0;
+    if (sscanf(command, "DEALLOCATE %31[A-Za-z0-9_]%n", nombre, &consumido) != 1 ||
+        !solo_espacios(command + consumido)) {
+        return "ERROR: Formato: DEALLOCATE <nombre>\n";
+    }
+    Preparada **p = preparada_buscar(c, nombre);
+    Preparada *pr = *p;
+    if (!pr) return "ERROR: No existe una sentencia preparada con ese nombre.\n";
+    *p = pr->siguiente;
+    c->num_preparadas--;
+    free(pr);
+    return NULL;
+}
 
-    char *e = (char *)malloc(64); strcpy(e, "ERROR: Operacion no soportada.\n"); return e;
+// Ejecuta PREPARE, EXECUTE o DEALLOCATE y deja la respuesta en 'out'
+static void comando_preparada(Conexion *c, const char *command, Salida *out) {
+    char nombre[32] = "";
+    char msg[96];
+    const char *err;
+    if (strncmp(command, "EXECUTE", 7) == 0) {
+        preparada_ejecutar(c, command, out);
+        return;
+    }
+    if (strncmp(command, "PREPARE", 7) == 0) {
+        err = preparada_crear(c, command, nombre);
+        snprintf(msg, sizeof(msg), "OK: Sentencia %s preparada.\n", nombre);
+    } else {
+        err = preparada_liberar(c, command, nombre);
+        snprintf(msg, sizeof(msg), "OK: Sentencia %s liberada.\n", nombre);
+    }
+    salida_texto(out, err ? err : msg);
 }
 
-char *mostrar_ayuda_detallada(void) {
-    char *ayuda = (char *)malloc(2048);
-    if (!ayuda) return NULL;
-    
-    snprintf(ayuda, 2048,
+// Texto fijo: se arma una vez al compilar y cada HELP lo copia tal cual
+const char *mostrar_ayuda_detallada(void) {
+    static const char ayuda[] =
         "=== AYUDA - MICRO DB ===\n"
         "\n"
         "COMANDOS DE CONSULTA (no requieren transacción):\n"
         "  SELECT ALL                           - Mostrar todos los registros\n"
         "  SELECT WHERE CAMPO=VALOR             - Filtrar registros\n"
         "    Campos disponibles: ID, Producto, Cantidad, Precio\n"
+        "    Operadores: =, <, <=, >, >= (Producto solo =)\n"
         "    Ejemplos:\n"
         "      SELECT WHERE Producto=Tablet\n"
         "      SELECT WHERE ID=10\n"
-        "      SELECT WHERE Cantidad=50\n"
-        "      SELECT WHERE Precio=25.99\n"
+        "      SELECT WHERE Cantidad>=50\n"
+        "      SELECT WHERE Precio<25.99\n"
+        "  ... ORDER BY Campo [ASC|DESC]         - Ordenar resultado (SELECT ALL o WHERE)\n"
+        "  ... LIMIT n [OFFSET m]               - Devolver n filas saltando las m primeras\n"
+        "    Ejemplos:\n"
+        "      SELECT ALL ORDER BY Precio DESC LIMIT 10\n"
+        "      SELECT WHERE Producto=Mouse ORDER BY Cantidad LIMIT 5 OFFSET 5\n"
+        "  DECLARE c CURSOR FOR SELECT ...      - Abrir un cursor sobre la consulta (sin ORDER BY)\n"
+        "  FETCH [n] FROM c / CLOSE c           - Traer las n filas siguientes / cerrar el cursor\n"
+        "\n"
+        "SENTENCIAS PREPARADAS (? en valores de WHERE, LIMIT, OFFSET, INSERT, UPDATE y DELETE):\n"
+        "  PREPARE s AS <sentencia con ?>       - Parsear una vez. Ej: PREPARE s AS SELECT WHERE Cantidad > ?\n"
+        "  EXECUTE s(v1, v2, ...)               - Ejecutar con esos valores. Ej: EXECUTE s(50)\n"
+        "  DEALLOCATE s                         - Descartar la sentencia\n"
         "\n"
         "COMANDOS DE TRANSACCIÓN:\n"
-        "  BEGIN TRANSACTION                    - Iniciar transacción (obtiene lock exclusivo)\n"
-        "  COMMIT TRANSACTION                   - Confirmar transacción (libera lock)\n"
+        "  BEGIN TRANSACTION [WAIT ms]          - Iniciar transacción (los locks se toman por registro;\n"
+        "                                         WAIT: espera máxima por un lock ocupado)\n"
+        "  COMMIT TRANSACTION                   - Aplicar los cambios de la transacción (libera locks)\n"
+        "  ROLLBACK [TRANSACTION]               - Descartar los cambios de la transacción (libera locks)\n"
         "\n"
         "COMANDOS DE MODIFICACIÓN (requieren transacción activa):\n"
-        "  INSERT id;producto;cantidad;precio   - Insertar nuevo registro\n"
-        "    Ejemplo: INSERT 100;Router;5;199.99\n"
+        "  INSERT id;producto;cantidad;precio   - Insertar nuevo registro (varias filas separadas por ',')\n"
+        "    Ejemplo: INSERT 100;Router;5;199.99, 101;Switch;2;89.90\n"
         "\n"
         "  UPDATE ID=<id> SET Campo=Valor        - Actualizar registro existente\n"
         "    Ejemplos:\n"
@@ -769,52 +6149,45 @@ char *mostrar_ayuda_detallada(void) {
         "  DELETE ID=<id>                       - Eliminar registro\n"
         "    Ejemplo: DELETE ID=10\n"
         "\n"
+        "  BATCH / sentencias / END             - INSERT, UPDATE y DELETE en un solo pedido, uno por linea;\n"
+        "                                         se aplican todos o ninguno (sin transaccion: se confirma solo)\n"
+        "\n"
+        "IMPORTACIÓN Y EXPORTACIÓN:\n"
+        "  IMPORT CSV [archivo.csv]             - Reemplazar la tabla con un CSV (por defecto " CSV_FILE_NAME "), sin transaccion abierta\n"
+        "  EXPORT CSV [archivo.csv]             - Volcar las filas vigentes confirmadas a un CSV\n"
+        "\n"
         "COMANDOS DE CONTROL:\n"
+        "  SHOW COMPACTION                      - Estadisticas de compactacion (tiempos, bytes recuperados)\n"
+        "  SHOW CACHE                           - Aciertos y fallos de la cache de resultados de SELECT\n"
+        "  STATS                                - Latencias p50/p99/p999 por comando, bytes, conexiones, locks y tamanio\n"
+        "  TRACE ON | OFF                       - Activar o desactivar las trazas de las fases de cada comando\n"
+        "  TRACE DUMP [archivo.json]            - Volcar las trazas en formato Chrome/Perfetto (por defecto traza.json)\n"
+        "  CHECKPOINT                           - Fusionar ya el WAL con el archivo base (.mdb)\n"
+        "  PROTOCOL FRAMED | TEXT               - Pedidos y respuestas con prefijo de largo y estado, o texto\n"
         "  HELP                                 - Mostrar esta ayuda\n"
         "  EXIT                                 - Desconectar del servidor\n"
         "\n"
         "NOTAS IMPORTANTES:\n"
         "- Las modificaciones requieren BEGIN TRANSACTION antes de ejecutarse\n"
-        "- Durante una transacción, otros clientes no pueden hacer consultas ni modificaciones\n"
-        "- Use COMMIT TRANSACTION para confirmar los cambios\n"
-        "- El formato CSV usa punto y coma (;) como separador\n"
-    );
-    
+        "- Una transacción bloquea sólo los registros que modifica; las consultas de otros ven los datos confirmados\n"
+        "- Ante un conflicto de locks la transacción más nueva se aborta y debe reintentarse\n"
+        "- Los cambios se aplican en COMMIT TRANSACTION; con ROLLBACK o si el cliente se desconecta, se descartan\n"
+        "- El formato CSV usa punto y coma (;) como separador\n";
     return ayuda;
 }
 
 static void cleanup_resources(void) {
-    // Liberar lock si está sostenido
-    if (descriptor_archivo_bloqueado >= 0) {
-        flock(descriptor_archivo_bloqueado, LOCK_UN);
-        close(descriptor_archivo_bloqueado);
-        descriptor_archivo_bloqueado = -1;
-    }
-    // Cerrar socket de servidor si existe
-    if (socket_servidor_global >= 0) {
-        close(socket_servidor_global);
-        socket_servidor_global = -1;
-    }
-    // Destruir mutexes
-    pthread_mutex_destroy(&mutex_clientes);
-    pthread_mutex_destroy(&mutex_estado_bloqueo);
-    pthread_cond_destroy(&condicion_clientes);
+    // Checkpoint final y cierre del WAL
+    cerrar_base_de_datos();
 }
 
 static void handle_termination_signal(int signum) {
-    // Handler minimal: marcar flag y cerrar socket de escucha (close es async-signal-safe)
+    // Handler minimal: marcar flag y despertar a los epoll_wait (write es async-signal-safe).
+    // Los reactores cierran sus conexiones y main hace la limpieza.
+    uint64_t uno = 1;
     stop_requested = 1;
-    if (socket_servidor_global >= 0) {
-        close(socket_servidor_global);
-        socket_servidor_global = -1;
-    }
-    // Hacer shutdown() de todos los clientes activos para que detecten EOF
-    pthread_mutex_lock(&mutex_sockets_clientes);
-    for (int i = 0; i < MAX_TOTAL_CLIENTES; ++i) {
-        if (sockets_clientes[i] > 0) {
-            shutdown(sockets_clientes[i], SHUT_RDWR);
-        }
+    if (evento_terminar >= 0 && write(evento_terminar, &uno, sizeof(uno)) < 0) {
+        // nada que hacer desde un handler
     }
-    pthread_mutex_unlock(&mutex_sockets_clientes);
     // NO llamar cleanup_resources() ni exit() desde aquí
 }